@@ -87,6 +87,7 @@
 
 #include "CImgFilter.h"
 #include "CImgOperator.h"
+#include "CImgBilateralGrid.h"
 
 #if cimg_version < 160
 #error "The bilateral filter before CImg 1.6.0 produces incorrect results, please upgrade CImg."
@@ -96,20 +97,20 @@
 #define kPluginGrouping      "Filter"
 #define kPluginDescription \
 "Blur input stream by bilateral filtering.\n" \
-"Uses the 'blur_bilateral' function from the CImg library.\n" \
+"Uses a bilateral grid, as in the 'blur_bilateral' function from the CImg library, computed using all threads.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
 
 #define kPluginIdentifier    "net.sf.cimg.CImgBilateral"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kPluginGuidedName          "BilateralGuidedCImg"
 #define kPluginGuidedIdentifier    "net.sf.cimg.CImgBilateralGuided"
 #define kPluginGuidedDescription \
 "Apply joint/cross bilateral filtering on image A, guided by the intensity differences of image B. " \
-"Uses the 'blur_bilateral' function from the CImg library.\n" \
+"Uses a bilateral grid, as in the 'blur_bilateral' function from the CImg library, computed using all threads.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
@@ -135,6 +136,11 @@
 #define kParamSigmaRHint "Standard deviation of the range kernel (color sigma), in intensity units (>=0). A reasonable value is 1/10 of the intensity range. Small values (1/256 of the intensity range and below) will slow down filtering."
 #define kParamSigmaRDefault 0.4
 
+#define kParamGridResolution "gridResolution"
+#define kParamGridResolutionLabel "Grid Resolution"
+#define kParamGridResolutionHint "Number of cells of the bilateral grid per standard deviation, along the spatial and range axes. 1 gives cells of the same size as the 'blur_bilateral' function from CImg (for intensities in [0,1]). Higher values are more accurate, but slower and use more memory. Lower values are faster."
+#define kParamGridResolutionDefault 1.
+
 #define kClipImage kOfxImageEffectSimpleSourceClipName
 #define kClipGuide "Guide"
 
@@ -145,6 +151,7 @@ struct CImgBilateralParams
 {
     double sigma_s;
     double sigma_r;
+    double gridResolution;
 };
 
 class CImgBilateralPlugin : public CImgFilterPluginHelper<CImgBilateralParams,false>
@@ -156,13 +163,15 @@ public:
     {
         _sigma_s  = fetchDoubleParam(kParamSigmaS);
         _sigma_r  = fetchDoubleParam(kParamSigmaR);
-        assert(_sigma_s && _sigma_r);
+        _gridResolution = fetchDoubleParam(kParamGridResolution);
+        assert(_sigma_s && _sigma_r && _gridResolution);
     }
 
     virtual void getValuesAtTime(double time, CImgBilateralParams& params) OVERRIDE FINAL
     {
         _sigma_s->getValueAtTime(time, params.sigma_s);
         _sigma_r->getValueAtTime(time, params.sigma_r);
+        _gridResolution->getValueAtTime(time, params.gridResolution);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
@@ -176,14 +185,16 @@ public:
         roi->y2 = rect.y2 + delta_pix;
     }
 
-    virtual void render(const OFX::RenderArguments &args, const CImgBilateralParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
+    virtual void render(const OFX::RenderArguments &args, const CImgBilateralParams& params, int x1, int y1, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
         if (params.sigma_s == 0.) {
             return;
         }
-        cimg.blur_bilateral(cimg, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r);
+        const cimg_library::CImg<float> guide(cimg, false);
+        // the grid is aligned on the full image, so that all the bands and tiles use the same grid
+        cimgBilateralGrid(cimg, guide, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r, (float)params.gridResolution, x1, y1);
     }
 
     virtual bool isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgBilateralParams& params) OVERRIDE FINAL
@@ -196,6 +207,7 @@ private:
     // params
     OFX::DoubleParam *_sigma_s;
     OFX::DoubleParam *_sigma_r;
+    OFX::DoubleParam *_gridResolution;
 };
 
 class CImgBilateralGuidedPlugin : public CImgOperatorPluginHelper<CImgBilateralParams>
@@ -207,13 +219,15 @@ public:
     {
         _sigma_s  = fetchDoubleParam(kParamSigmaS);
         _sigma_r  = fetchDoubleParam(kParamSigmaR);
-        assert(_sigma_s && _sigma_r);
+        _gridResolution = fetchDoubleParam(kParamGridResolution);
+        assert(_sigma_s && _sigma_r && _gridResolution);
     }
 
     virtual void getValuesAtTime(double time, CImgBilateralParams& params) OVERRIDE FINAL
     {
         _sigma_s->getValueAtTime(time, params.sigma_s);
         _sigma_r->getValueAtTime(time, params.sigma_r);
+        _gridResolution->getValueAtTime(time, params.gridResolution);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
@@ -227,14 +241,15 @@ public:
         roi->y2 = rect.y2 + delta_pix;
     }
 
-    virtual void render(const cimg_library::CImg<float>& srcA, const cimg_library::CImg<float>& srcB, const OFX::RenderArguments &args, const CImgBilateralParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& dst) OVERRIDE FINAL
+    virtual void render(const cimg_library::CImg<float>& /*srcA*/, const cimg_library::CImg<float>& srcB, const OFX::RenderArguments &args, const CImgBilateralParams& params, int x1, int y1, cimg_library::CImg<float>& dst) OVERRIDE FINAL
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
         if (params.sigma_s == 0.) {
             return;
         }
-        dst = srcA.get_blur_bilateral(srcB, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r);
+        // dst shares its pixels with srcA: filter it in place, with the grid aligned on the full image
+        cimgBilateralGrid(dst, srcB, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r, (float)params.gridResolution, x1, y1);
     }
 
     virtual int isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgBilateralParams& params) OVERRIDE FINAL
@@ -247,6 +262,7 @@ private:
     // params
     OFX::DoubleParam *_sigma_s;
     OFX::DoubleParam *_sigma_r;
+    OFX::DoubleParam *_gridResolution;
 };
 
 mDeclarePluginFactory(CImgBilateralPluginFactory, {}, {});
@@ -312,6 +328,18 @@ void CImgBilateralPluginFactory::describeInContext(OFX::ImageEffectDescriptor& d
             page->addChild(*param);
         }
     }
+    {
+        OFX::DoubleParamDescriptor *param = desc.defineDoubleParam(kParamGridResolution);
+        param->setLabel(kParamGridResolutionLabel);
+        param->setHint(kParamGridResolutionHint);
+        param->setRange(0.1, 10.);
+        param->setDisplayRange(0.5, 4.);
+        param->setDefault(kParamGridResolutionDefault);
+        param->setIncrement(0.1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 
     CImgBilateralPlugin::describeInContextEnd(desc, context, page);
 }
@@ -386,6 +414,18 @@ void CImgBilateralGuidedPluginFactory::describeInContext(OFX::ImageEffectDescrip
             page->addChild(*param);
         }
     }
+    {
+        OFX::DoubleParamDescriptor *param = desc.defineDoubleParam(kParamGridResolution);
+        param->setLabel(kParamGridResolutionLabel);
+        param->setHint(kParamGridResolutionHint);
+        param->setRange(0.1, 10.);
+        param->setDisplayRange(0.5, 4.);
+        param->setDefault(kParamGridResolutionDefault);
+        param->setIncrement(0.1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 
     CImgBilateralGuidedPlugin::describeInContextEnd(desc, context, page);
 }
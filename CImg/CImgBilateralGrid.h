@@ -0,0 +1,212 @@
+//
+//  CImgBilateralGrid.h
+//
+//  Joint bilateral filter computed with a bilateral grid, using all threads, shared by the CImg plugins.
+//
+//  Copyright (c) 2014 OpenFX. All rights reserved.
+//
+
+#ifndef Misc_CImgBilateralGrid_h
+#define Misc_CImgBilateralGrid_h
+
+#include "CImgFilter.h"
+#include "CImgRecursiveFilter.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+// the range cells are never smaller than this, in guide units
+#define kCImgBilateralGridMinSamplingR (1.f/256)
+// the range cells are made larger, by powers of two, if the range of the guide would need more of them
+#define kCImgBilateralGridMaxRangeCells 1024
+
+// Splats the pixels of one channel into the grid (splat), or reads the filtered values back from the grid (slice).
+// When splatting, each thread fills a separate range of grid rows, so that no two threads write to the same cell.
+// The cells are aligned on the pixel coordinates in the full image and on the guide values: the grid cell (X,Y,R)
+// is the absolute cell (X0+X-padding_s, Y0+Y-padding_s, R0+R-padding_r).
+class CImgBilateralGridProcessor : public OFX::MultiThread::Processor
+{
+public:
+	CImgBilateralGridProcessor(cimg_library::CImg<float>& img,
+	                           const cimg_library::CImg<float>& guide,
+	                           cimg_library::CImg<float>& grid,
+	                           int c,
+	                           int x0,
+	                           int y0,
+	                           int X0,
+	                           int Y0,
+	                           int R0,
+	                           float sampling_s,
+	                           float sampling_r,
+	                           int padding_s,
+	                           int padding_r)
+		: _img(img)
+		, _guide(guide)
+		, _grid(grid)
+		, _c(c)
+		, _x0(x0)
+		, _y0(y0)
+		, _X0(X0)
+		, _Y0(Y0)
+		, _R0(R0)
+		, _sampling_s(sampling_s)
+		, _sampling_r(sampling_r)
+		, _padding_s(padding_s)
+		, _padding_r(padding_r)
+		, _splat(true)
+	{
+	}
+
+	void splat() { _splat = true; process(); }
+
+	void slice() { _splat = false; process(); }
+
+private:
+	void process()
+	{
+		unsigned int nThreads = 1;
+		if (_img.width() * _img.height() >= kCImgLineFilterMinThreadedSize && !OFX::MultiThread::isSpawnedThread()) {
+			nThreads = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)_img.height());
+		}
+		multiThread(std::max(1u, nThreads));
+	}
+
+	virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+	{
+		const int gc = _c % _guide.spectrum();
+		if (_splat) {
+			// this thread fills the grid rows [Y1,Y2)
+			const int Y1 = (int)(((long)_grid.height() * threadId) / nThreads);
+			const int Y2 = (int)(((long)_grid.height() * (threadId + 1)) / nThreads);
+			for (int y = 0; y < _img.height(); ++y) {
+				const int Y = (int)cimg_library::cimg::round((_y0 + y)/_sampling_s) - _Y0 + _padding_s;
+				if (Y < Y1 || Y >= Y2) {
+					continue;
+				}
+				const float *val = _img.data(0,y,0,_c);
+				const float *edge = _guide.data(0,y,0,gc);
+				for (int x = 0; x < _img.width(); ++x) {
+					const int
+						X = (int)cimg_library::cimg::round((_x0 + x)/_sampling_s) - _X0 + _padding_s,
+						R = (int)std::floor((double)edge[x]/_sampling_r + 0.5) - _R0 + _padding_r;
+					_grid(X,Y,R,0) += val[x];
+					_grid(X,Y,R,1) += 1;
+				}
+			}
+		} else {
+			for (int y = threadId; y < _img.height(); y += nThreads) {
+				float *val = _img.data(0,y,0,_c);
+				const float *edge = _guide.data(0,y,0,gc);
+				const float Y = (_y0 + y)/_sampling_s - _Y0 + _padding_s;
+				for (int x = 0; x < _img.width(); ++x) {
+					const float
+						X = (_x0 + x)/_sampling_s - _X0 + _padding_s,
+						R = (float)((double)edge[x]/_sampling_r - _R0) + _padding_r;
+					const float bval0 = _grid.linear_atXYZ(X,Y,R,0), bval1 = _grid.linear_atXYZ(X,Y,R,1);
+					val[x] = bval0/bval1;
+				}
+			}
+		}
+	}
+
+	cimg_library::CImg<float>& _img;
+	const cimg_library::CImg<float>& _guide;
+	cimg_library::CImg<float>& _grid;
+	int _c;
+	int _x0;
+	int _y0;
+	int _X0;
+	int _Y0;
+	int _R0;
+	float _sampling_s;
+	float _sampling_r;
+	int _padding_s;
+	int _padding_r;
+	bool _splat;
+};
+
+//! Blur image with the joint bilateral filter, using a bilateral grid.
+/**
+ S. Paris and F. Durand, A Fast Approximation of the Bilateral Filter using a Signal Processing Approach,
+ European Conference on Computer Vision, 2006.
+ J. Chen, S. Paris and F. Durand, Real-time Edge-Aware Image Processing with the Bilateral Grid,
+ ACM Transactions on Graphics (SIGGRAPH), 2007.
+
+ This is the same algorithm as CImg<T>::blur_bilateral(), but splatting, blurring and slicing use all threads,
+ and the size of the grid cells can be set by resolution, the number of cells per standard deviation.
+ Unlike CImg, which starts the grid at the first pixel and at the minimum of the guide, the cells are aligned on
+ the pixel coordinates in the full image and on multiples of their size in guide units, and their size does not
+ depend on the range of the guide (except if it would need more than kCImgBilateralGridMaxRangeCells cells).
+ The padding cells of the grid are empty, so that its blur does not depend on its extent: any part of the full
+ image, with a margin of a few sigma_s, gives the same result as the full image.
+ With a resolution of 1 and a guide in [0,1], the cells have the same size as in CImg<T>::blur_bilateral().
+ The cost is linear in the number of pixels, and decreases when sigma_s increases.
+ \param guide the image used to compute the range weights (its channels are used cyclically)
+ \param sigma_s standard deviation of the spatial kernel, in pixels
+ \param sigma_r standard deviation of the range kernel, in guide units. As in CImg<T>::blur_bilateral(), the
+        image is left unchanged if it is zero.
+ \param resolution number of grid cells per standard deviation. Grid cells are never smaller than one pixel,
+        or than kCImgBilateralGridMinSamplingR.
+ \param x0 x coordinate of the first pixel of img in the full image
+ \param y0 y coordinate of the first pixel of img in the full image
+ **/
+inline void
+cimgBilateralGrid(cimg_library::CImg<float>& img, const cimg_library::CImg<float>& guide, const float sigma_s, const float sigma_r, const float resolution = 1.f,
+                  const int x0 = 0, const int y0 = 0)
+{
+	if (img.is_empty()) {
+		return;
+	}
+	if (img.depth() > 1 || !img.is_sameXYZ(guide) || sigma_s < 0 || sigma_r < 0 || resolution <= 0) {
+		img.blur_bilateral(guide, sigma_s, sigma_r);
+
+		return;
+	}
+	if (sigma_r == 0.) {
+		return;
+	}
+	float edge_min;
+	const float edge_max = guide.max_min(edge_min);
+	float sampling_r = std::max(sigma_r / resolution, kCImgBilateralGridMinSamplingR);
+	while ((edge_max - edge_min) / sampling_r > kCImgBilateralGridMaxRangeCells) {
+		sampling_r *= 2;
+	}
+	const float
+		sampling_s = std::max(std::max(sigma_s, 1.0f) / resolution, 1.0f),
+		derived_sigma_s = sigma_s / sampling_s,
+		derived_sigma_r = sigma_r / sampling_r;
+	const int
+		padding_s = (int)(2*derived_sigma_s) + 1,
+		padding_r = (int)(2*derived_sigma_r) + 1;
+	// the absolute cells of the first and last pixels, and of the guide minimum and maximum
+	const int
+		X0 = (int)cimg_library::cimg::round(x0/sampling_s),
+		Y0 = (int)cimg_library::cimg::round(y0/sampling_s),
+		R0 = (int)std::floor((double)edge_min/sampling_r + 0.5),
+		X1 = (int)cimg_library::cimg::round((x0 + img.width() - 1)/sampling_s),
+		Y1 = (int)cimg_library::cimg::round((y0 + img.height() - 1)/sampling_s),
+		R1 = (int)std::floor((double)edge_max/sampling_r + 0.5);
+	const unsigned int
+		bx = (unsigned int)(X1 - X0 + 1 + 2*padding_s),
+		by = (unsigned int)(Y1 - Y0 + 1 + 2*padding_s),
+		br = (unsigned int)(R1 - R0 + 1 + 2*padding_r);
+	cimg_library::CImg<float> grid(bx, by, br, 2);
+	cimg_forC(img, c) {
+		grid.fill(0);
+		CImgBilateralGridProcessor processor(img, guide, grid, c, x0, y0, X0, Y0, R0, sampling_s, sampling_r, padding_s, padding_r);
+		processor.splat();
+		if (grid.width() > 1) {
+			deriche(grid, derived_sigma_s, 0, 'x', true);
+		}
+		if (grid.height() > 1) {
+			deriche(grid, derived_sigma_s, 0, 'y', true);
+		}
+		if (grid.depth() > 1) {
+			deriche(grid, derived_sigma_r, 0, 'z', false);
+		}
+		processor.slice();
+	}
+}
+
+#endif
@@ -87,6 +87,8 @@
 #include "ofxsCopier.h"
 
 #include "CImgFilter.h"
+#include "CImgBoxFilter.h"
+#include "CImgRecursiveFilter.h"
 
 #if cimg_version < 161
 #error "This plugin requires CImg 1.6.1, please upgrade CImg."
@@ -180,162 +182,6 @@ enum FilterEnum
 #define kParamExpandRoDLabel "Expand RoD"
 #define kParamExpandRoDHint "Expand the source region of definition by 1.5*size (3.6*sigma)."
 
-typedef float T;
-using namespace cimg_library;
-
-
-static inline
-T get_data(T *data, const int N, const unsigned long off, const bool boundary_conditions, const int x)
-{
-    assert(N >= 1);
-    if (x < 0) {
-        return boundary_conditions ? data[0] : T();
-    }
-    if (x >= N) {
-        return boundary_conditions ? data[(N-1)*off] : T();
-    }
-    return data[x*off];
-}
-
-// [internal] Apply a box/triangle/quadratic filter (used by CImg<T>::box()).
-/**
- \param ptr the pointer of the data
- \param N size of the data
- \param width width of the box filter
- \param off the offset between two data point
- \param iter number of iterations (1 = box, 2 = triangle, 3 = quadratic)
- \param order the order of the filter 0 (smoothing), 1st derivtive, 2nd derivative, 3rd derivative
- \param boundary_conditions Boundary conditions. Can be <tt>{ 0=dirichlet | 1=neumann }</tt>.
- **/
-static void _cimg_box_apply(T *data, const double width, const int N, const unsigned long off, const int iter,
-                                  const int order, const bool boundary_conditions)
-{
-    // smooth
-    if (width > 1. && iter > 0) {
-        int w2 = (int)(width - 1)/2;
-        double frac = (width - (2*w2+1)) / 2.;
-        int winsize = 2*w2+1;
-        std::vector<T> win(winsize);
-        for (int i = 0; i < iter; ++i) {
-            // prepare for first iteration
-            double sum = 0; // window sum
-            for (int x = -w2; x <= w2; ++x) {
-                win[x+w2] = get_data(data, N, off, boundary_conditions, x);
-                sum += win[x+w2];
-            }
-            int ifirst = 0;
-            int ilast = 2*w2;
-            T prev = get_data(data, N, off, boundary_conditions, - w2 - 1);
-            T next = get_data(data, N, off, boundary_conditions, + w2 + 1);
-            // main loop
-            for (int x = 0; x < N-1; ++x) {
-                // add partial pixels
-                double sum2 = sum + frac * (prev + next);
-                // fill result
-                data[x*off] = sum2 / width;
-                // advance for next iteration
-                prev = win[ifirst];
-                sum -= prev;
-                ifirst = (ifirst + 1) % winsize;
-                ilast = (ilast + 1) % winsize;
-                assert((ilast + 1) % winsize == ifirst); // it is a circular buffer
-                win[ilast] = next;
-                sum += next;
-                next = get_data(data, N, off, boundary_conditions, x + w2 + 2);
-            }
-            // last iteration
-            // add partial pixels
-            double sum2 = sum + frac * (prev + next);
-            // fill result
-            data[(N-1)*off] = sum2 / width;
-        }
-    }
-    // derive
-    switch (order) {
-        case 0 :
-            // nothing to do
-            break;
-        case 1 : {
-            T p = get_data(data, N, off, boundary_conditions, -1);
-            T c = get_data(data, N, off, boundary_conditions, 0);
-            T n = get_data(data, N, off, boundary_conditions, +1);
-            for (int x = 0; x < N-1; ++x) {
-                data[x*off] = (n-p)/2.;
-                // advance
-                p = c;
-                c = n;
-                n = get_data(data, N, off, boundary_conditions, x+2);
-            }
-            // last pixel
-            data[(N-1)*off] = (n-p)/2.;
-        } break;
-        case 2: {
-            T p = get_data(data, N, off, boundary_conditions, -1);
-            T c = get_data(data, N, off, boundary_conditions, 0);
-            T n = get_data(data, N, off, boundary_conditions, +1);
-            for (int x = 0; x < N-1; ++x) {
-                data[x*off] = n-2*c+p;
-                // advance
-                p = c;
-                c = n;
-                n = get_data(data, N, off, boundary_conditions, x+2);
-            }
-            // last pixel
-            data[(N-1)*off] = n-2*c+p;
-        } break;
-    }
-}
-
-//! Box/Triangle/Quadratic filter.
-/**
- \param width width of the box filter
- \param iter number of iterations (1 = box, 2 = triangle, 3 = quadratic)
- \param order the order of the filter 0,1,2,3
- \param axis  Axis along which the filter is computed. Can be <tt>{ 'x' | 'y' | 'z' | 'c' }</tt>.
- \param boundary_conditions Boundary conditions. Can be <tt>{ 0=dirichlet | 1=neumann }</tt>.
- **/
-static void
-box(CImg<T>& img, const float width, const int iter, const int order, const char axis='x', const bool boundary_conditions=true)
-{
-    if (img.is_empty()) return/* *this*/;
-    const unsigned int _width = img._width, _height = img._height, _depth = img._depth, _spectrum = img._spectrum;
-    const char naxis = cimg::uncase(axis);
-    if (img.is_empty() || (width <= 1.f && !order)) return/* *this*/;
-    switch (naxis) {
-        case 'x' : {
-#ifdef cimg_use_openmp
-#pragma omp parallel for collapse(3) if (_width>=256 && _height*_depth*_spectrum>=16)
-#endif
-            cimg_forYZC(img,y,z,c)
-            _cimg_box_apply(img.data(0,y,z,c),width,img._width,1U,iter,order,boundary_conditions);
-        } break;
-        case 'y' : {
-#ifdef cimg_use_openmp
-#pragma omp parallel for collapse(3) if (_width>=256 && _height*_depth*_spectrum>=16)
-#endif
-            cimg_forXZC(img,x,z,c)
-            _cimg_box_apply(img.data(x,0,z,c),width,_height,(unsigned long)_width,iter,order,boundary_conditions);
-        } break;
-        case 'z' : {
-#ifdef cimg_use_openmp
-#pragma omp parallel for collapse(3) if (_width>=256 && _height*_depth*_spectrum>=16)
-#endif
-            cimg_forXYC(img,x,y,c)
-            _cimg_box_apply(img.data(x,y,0,c),width,_depth,(unsigned long)(_width*_height),
-                                     iter,order,boundary_conditions);
-        } break;
-        default : {
-#ifdef cimg_use_openmp
-#pragma omp parallel for collapse(3) if (_width>=256 && _height*_depth*_spectrum>=16)
-#endif
-            cimg_forXYZ(img,x,y,z)
-            _cimg_box_apply(img.data(x,y,z,0),width,_spectrum,(unsigned long)(_width*_height*_depth),
-                                     iter,order,boundary_conditions);
-        }
-    }
-    return/* *this*/;
-}
-
 using namespace OFX;
 
 /// Blur plugin
@@ -483,13 +329,13 @@ public:
             // VanVliet filter was inexistent before 1.53, and buggy before CImg.h from
             // 57ffb8393314e5102c00e5f9f8fa3dcace179608 Thu Dec 11 10:57:13 2014 +0100
             if (params.filter == eFilterGaussian) {
-                cimg.vanvliet(sigmax, params.orderX, 'x', (bool)params.boundary_i);
+                vanvliet(cimg, sigmax, params.orderX, 'x', (bool)params.boundary_i);
                 if (abort()) { return; }
-                cimg.vanvliet(sigmay, params.orderY, 'y', (bool)params.boundary_i);
+                vanvliet(cimg, sigmay, params.orderY, 'y', (bool)params.boundary_i);
             } else {
-                cimg.deriche(sigmax, params.orderX, 'x', (bool)params.boundary_i);
+                deriche(cimg, sigmax, params.orderX, 'x', (bool)params.boundary_i);
                 if (abort()) { return; }
-                cimg.deriche(sigmay, params.orderY, 'y', (bool)params.boundary_i);
+                deriche(cimg, sigmay, params.orderY, 'y', (bool)params.boundary_i);
             }
         } else if (params.filter == eFilterBox || params.filter == eFilterTriangle || params.filter == eFilterQuadratic) {
             int iter = (params.filter == eFilterBox ? 1 :
@@ -0,0 +1,143 @@
+//
+//  CImgBoxFilter.h
+//
+//  Box, triangle and quadratic filters (iterated running sums), shared by the CImg plugins.
+//
+//  Copyright (c) 2014 OpenFX. All rights reserved.
+//
+
+#ifndef Misc_CImgBoxFilter_h
+#define Misc_CImgBoxFilter_h
+
+#include "CImgLineFilter.h"
+
+#include <algorithm>
+#include <cassert>
+
+// [internal] Apply a box/triangle/quadratic filter and its derivatives on nLanes lines.
+/**
+ \param b0 the first sample of the lines. There are pad samples before and after the N samples of each line.
+ \param b1 temporary buffer of the same size as b0
+ \param N size of the data
+ \param pad number of padding samples on each side, at least (int)(width - 1)/2 + 1, and at least 1 if order > 0
+ \param nLanes number of lines, at most kCImgLineFilterLanes
+ \param width width of the box filter
+ \param iter number of iterations (1 = box, 2 = triangle, 3 = quadratic)
+ \param order the order of the filter 0 (smoothing), 1st derivtive, 2nd derivative
+ \param boundary_conditions Boundary conditions. Can be <tt>{ 0=dirichlet | 1=neumann }</tt>.
+ \return b0 or b1, whichever holds the result
+ **/
+inline float*
+_cimg_box_apply_lanes(float *b0, float *b1, const int N, const int pad, const int nLanes, const double width, const int iter,
+                      const int order, const bool boundary_conditions)
+{
+	assert(nLanes >= 1 && nLanes <= kCImgLineFilterLanes);
+	const int L = kCImgLineFilterLanes;
+	const int nl = nLanes;
+	float *src = b0;
+	float *dst = b1;
+
+	// smooth
+	if (width > 1. && iter > 0) {
+		const int w2 = (int)(width - 1)/2;
+		const double frac = (width - (2*w2+1)) / 2.;
+		assert(pad >= w2 + 1);
+		for (int i = 0; i < iter; ++i) {
+			// fill the padding, so that the main loop has no boundary tests
+			_cimg_pad_lanes(src, N, w2 + 1, nl, boundary_conditions);
+			// window sums
+			double sum[kCImgLineFilterLanes];
+			for (int l = 0; l < nl; ++l) {
+				sum[l] = 0.;
+			}
+			for (int x = -w2; x <= w2; ++x) {
+				const float *s = src + x*L;
+				for (int l = 0; l < nl; ++l) {
+					sum[l] += s[l];
+				}
+			}
+			// main loop
+			for (int x = 0; x < N; ++x) {
+				const float *prev = src + (x-w2-1)*L;
+				const float *first = src + (x-w2)*L;
+				const float *next = src + (x+w2+1)*L;
+				float *d = dst + x*L;
+				for (int l = 0; l < nl; ++l) {
+					// add partial pixels
+					d[l] = (float)((sum[l] + frac * (prev[l] + next[l])) / width);
+					// advance for next iteration
+					sum[l] -= first[l];
+					sum[l] += next[l];
+				}
+			}
+			std::swap(src, dst);
+		}
+	}
+	// derive
+	if (order == 1 || order == 2) {
+		assert(pad >= 1);
+		_cimg_pad_lanes(src, N, 1, nl, boundary_conditions);
+		for (int x = 0; x < N; ++x) {
+			const float *p = src + (x-1)*L;
+			const float *c = src + x*L;
+			const float *n = src + (x+1)*L;
+			float *d = dst + x*L;
+			if (order == 1) {
+				for (int l = 0; l < nl; ++l) {
+					d[l] = (float)((n[l]-p[l])/2.);
+				}
+			} else {
+				for (int l = 0; l < nl; ++l) {
+					d[l] = n[l]-2*c[l]+p[l];
+				}
+			}
+		}
+		std::swap(src, dst);
+	}
+
+	return src;
+}
+
+// [internal] Box filter on a batch of lines, for CImgLineFilterProcessor
+struct CImgBoxLines
+{
+	double width;
+	int iter;
+	int order;
+	bool boundary_conditions;
+
+	int pad() const
+	{
+		return (width > 1. && iter > 0) ? std::max(1, (int)(width - 1)/2 + 1) : 1;
+	}
+
+	float* operator()(float *b0, float *b1, int N, int nLanes) const
+	{
+		return _cimg_box_apply_lanes(b0, b1, N, pad(), nLanes, width, iter, order, boundary_conditions);
+	}
+};
+
+//! Box/Triangle/Quadratic filter.
+/**
+ \param width width of the box filter
+ \param iter number of iterations (1 = box, 2 = triangle, 3 = quadratic)
+ \param order the order of the filter 0,1,2
+ \param axis  Axis along which the filter is computed. Can be <tt>{ 'x' | 'y' | 'z' | 'c' }</tt>.
+ \param boundary_conditions Boundary conditions. Can be <tt>{ 0=dirichlet | 1=neumann }</tt>.
+ **/
+inline void
+box(cimg_library::CImg<float>& img, const float width, const int iter, const int order, const char axis='x', const bool boundary_conditions=true)
+{
+	if (img.is_empty() || (width <= 1.f && !order)) {
+		return;
+	}
+	CImgBoxLines f;
+	f.width = width;
+	f.iter = iter;
+	f.order = order;
+	f.boundary_conditions = boundary_conditions;
+	CImgLineFilterProcessor<CImgBoxLines> processor(img, cimg_library::cimg::uncase(axis), f);
+	processor.process();
+}
+
+#endif
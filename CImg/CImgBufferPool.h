@@ -0,0 +1,185 @@
+//
+//  CImgBufferPool.h
+//
+//  A pool of float buffers, shared by the CImg plugin helpers, which reuses the planar storage of CImg images across renders and tiles.
+//  The buffers are allocated by the host (OFX image memory), which can account for them, and they are freed when the host asks
+//  the plugins to purge their caches.
+//
+//  Copyright (c) 2014 OpenFX. All rights reserved.
+//
+
+#ifndef Misc_CImgBufferPool_h
+#define Misc_CImgBufferPool_h
+
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+
+// Free buffers are kept in the pool as long as they take less than the working set, i.e. the largest number of
+// bytes that were in use at the same time since the last purge, so that the next render of the same size finds all
+// its buffers in the pool. Up to this number of bytes are always kept.
+#define kCImgBufferPoolMinCachedBytes ((size_t)64 * 1024 * 1024)
+
+class CImgBufferPool
+{
+public:
+	CImgBufferPool()
+		: _mutex()
+		, _free()
+		, _cachedBytes(0)
+		, _usedBytes(0)
+		, _highWaterMark(0)
+	{
+	}
+
+	// get an unlocked buffer of at least size floats. The returned capacity must be given back to release().
+	OFX::ImageMemory* acquire(size_t size, size_t *capacity)
+	{
+		*capacity = bucketSize(size);
+		OFX::ImageMemory *mem = 0;
+		{
+			OFX::MultiThread::AutoMutex lock(_mutex);
+			std::multimap<size_t, OFX::ImageMemory*>::iterator it = _free.find(*capacity);
+			if (it != _free.end()) {
+				mem = it->second;
+				_free.erase(it);
+				_cachedBytes -= *capacity * sizeof(float);
+			}
+		}
+		if (!mem) {
+			// not associated to an instance, since the buffer may be reused by any instance
+			mem = new OFX::ImageMemory(*capacity * sizeof(float));
+		}
+		{
+			OFX::MultiThread::AutoMutex lock(_mutex);
+			_usedBytes += *capacity * sizeof(float);
+			if (_usedBytes > _highWaterMark) {
+				_highWaterMark = _usedBytes;
+			}
+		}
+
+		return mem;
+	}
+
+	// give back an unlocked buffer
+	void release(OFX::ImageMemory *mem, size_t capacity)
+	{
+		if (!mem) {
+			return;
+		}
+		{
+			OFX::MultiThread::AutoMutex lock(_mutex);
+			assert(_usedBytes >= capacity * sizeof(float));
+			_usedBytes -= capacity * sizeof(float);
+			if (_cachedBytes + capacity * sizeof(float) <= std::max(_highWaterMark, kCImgBufferPoolMinCachedBytes)) {
+				_free.insert(std::make_pair(capacity, mem));
+				_cachedBytes += capacity * sizeof(float);
+				return;
+			}
+		}
+		delete mem;
+	}
+
+	// free all the buffers that are not in use, and start measuring the working set again
+	void purge()
+	{
+		OFX::MultiThread::AutoMutex lock(_mutex);
+		for (std::multimap<size_t, OFX::ImageMemory*>::iterator it = _free.begin(); it != _free.end(); ++it) {
+			delete it->second;
+		}
+		_free.clear();
+		_cachedBytes = 0;
+		_highWaterMark = _usedBytes;
+	}
+
+private:
+	// Round up the size so that only its 4 most significant bits may be non-zero:
+	// buffers of similar sizes can be reused, and at most 1/8 of each buffer is wasted.
+	static size_t bucketSize(size_t size)
+	{
+		size_t step = 1;
+		while ((size - 1) / step >= 16) {
+			step *= 2;
+		}
+		return ((size + step - 1) / step) * step;
+	}
+
+	OFX::MultiThread::Mutex _mutex;
+	std::multimap<size_t, OFX::ImageMemory*> _free; //!< free buffers, by capacity
+	size_t _cachedBytes;
+	size_t _usedBytes;
+	size_t _highWaterMark; //!< the largest number of bytes that were in use at the same time since the last purge
+};
+
+// the pool shared by all CImg plugins. It is never destroyed, since the host may be gone when static objects are destroyed.
+inline CImgBufferPool&
+cimgBufferPool()
+{
+	static CImgBufferPool* pool = new CImgBufferPool;
+
+	return *pool;
+}
+
+// A buffer from the pool, which stays locked while the object holds it, and is given back when the object is destroyed
+class CImgPooledBuffer
+{
+public:
+	CImgPooledBuffer()
+		: _mem(0)
+		, _data(0)
+		, _capacity(0)
+	{
+	}
+
+	// only empty buffers can be copied, so that they can be stored in a std::vector
+	CImgPooledBuffer(const CImgPooledBuffer& other)
+		: _mem(0)
+		, _data(0)
+		, _capacity(0)
+	{
+		assert(!other._data);
+		(void)other;
+	}
+
+	~CImgPooledBuffer()
+	{
+		free();
+	}
+
+	// get a buffer of at least size floats, the previous content is lost
+	float* allocate(size_t size)
+	{
+		free();
+		if (size) {
+			_mem = cimgBufferPool().acquire(size, &_capacity);
+			_data = (float*)_mem->lock();
+		}
+
+		return _data;
+	}
+
+	float* data() const { return _data; }
+
+private:
+	CImgPooledBuffer& operator=(const CImgPooledBuffer&);
+
+	void free()
+	{
+		if (_mem) {
+			_mem->unlock();
+			cimgBufferPool().release(_mem, _capacity);
+		}
+		_mem = 0;
+		_data = 0;
+		_capacity = 0;
+	}
+
+	OFX::ImageMemory *_mem;
+	float *_data;
+	size_t _capacity;
+};
+
+#endif
@@ -86,6 +86,7 @@
 #include "ofxsCopier.h"
 
 #include "CImgFilter.h"
+#include "CImgNLMeans.h"
 
 #define kPluginName          "DenoiseCImg"
 #define kPluginGrouping      "Filter"
@@ -95,14 +96,14 @@
 "Non-Local Image Smoothing by Applying Anisotropic Diffusion PDE's in the Space of Patches " \
 "(D. Tschumperlé, L. Brun), ICIP'09. " \
 "<https://tschumperle.users.greyc.fr/publications/tschumperle_icip09.pdf>.\n" \
-"Uses the 'blur_patch' function from the CImg library.\n" \
+"Computes the same result as the 'blur_patch' function from the CImg library, using integral images of the patch distances and all threads.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
 
 #define kPluginIdentifier    "net.sf.cimg.CImgDenoise"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -188,7 +189,10 @@ public:
     // only called if mix != 0.
     virtual void getRoI(const OfxRectI& rect, const OfxPointD& renderScale, const CImgDenoiseParams& params, OfxRectI* roi) OVERRIDE FINAL
     {
-        int delta_pix = (int)std::ceil((params.sigma_s * 3.6) * renderScale.x) + std::ceil(params.psize * renderScale.x) + std::ceil(params.lsize * renderScale.x);
+        // the halo contains the lookup window, the patches around it, and the support of the smoothing
+        const int psize = (int)std::ceil(std::max(0, params.psize) * renderScale.x);
+        const int lsize = (int)std::ceil(std::max(0, params.lsize) * renderScale.x);
+        int delta_pix = lsize / 2 + psize / 2 + (int)std::ceil((params.smoothness * 3.6) * renderScale.x);
         roi->x1 = rect.x1 - delta_pix;
         roi->x2 = rect.x2 + delta_pix;
         roi->y1 = rect.y1 - delta_pix;
@@ -199,12 +203,13 @@ public:
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
-        cimg.blur_patch((float)(params.sigma_s * args.renderScale.x),
-                        (float)params.sigma_r,
-                        (unsigned int)std::ceil(std::max(0, params.psize) * args.renderScale.x),
-                        (unsigned int)std::ceil(std::max(0, params.lsize) * args.renderScale.x),
-                        (float)(params.smoothness * args.renderScale.x),
-                        params.fast_approx);
+        cimgNLMeans(cimg,
+                    (float)(params.sigma_s * args.renderScale.x),
+                    (float)params.sigma_r,
+                    (unsigned int)std::ceil(std::max(0, params.psize) * args.renderScale.x),
+                    (unsigned int)std::ceil(std::max(0, params.lsize) * args.renderScale.x),
+                    (float)(params.smoothness * args.renderScale.x),
+                    params.fast_approx);
     }
 
     virtual bool isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgDenoiseParams& params) OVERRIDE FINAL
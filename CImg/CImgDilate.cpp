@@ -86,6 +86,7 @@
 #include "ofxsCopier.h"
 
 #include "CImgFilter.h"
+#include "CImgMorphology.h"
 
 #define kPluginName          "DilateCImg"
 #define kPluginGrouping      "Filter"
@@ -93,14 +94,15 @@
 "Dilate (or erode) input stream by a rectangular structuring element of specified size and Neumann boundary conditions (pixels out of the image get the value of the nearest pixel).\n" \
 "A negative size will perform an erosion instead of a dilation.\n" \
 "Different sizes can be given for the x and y axis.\n" \
-"Uses the 'dilate' and 'erode' functions from the CImg library.\n" \
+"The structuring element can also be a diamond or a disk (an ellipse if the x and y sizes differ).\n" \
+"Uses the van Herk/Gil-Werman algorithm, whose cost does not depend on the size of the rectangular structuring element.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
 
 #define kPluginIdentifier    "net.sf.cimg.CImgDilate"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -118,6 +120,17 @@
 #define kParamSizeHint "Width/height of the rectangular structuring element is 2*size+1, in pixel units (>=0)."
 #define kParamSizeDefault 1
 
+#define kParamKernel "kernel"
+#define kParamKernelLabel "Kernel"
+#define kParamKernelHint "Shape of the structuring element. The diamond and the disk are slower than the box, especially for large sizes."
+#define kParamKernelOptionBox "Box"
+#define kParamKernelOptionBoxHint "Rectangle of width 2*size.x+1 and height 2*size.y+1."
+#define kParamKernelOptionDiamond "Diamond"
+#define kParamKernelOptionDiamondHint "Diamond inscribed in the box."
+#define kParamKernelOptionDisk "Disk"
+#define kParamKernelOptionDiskHint "Disk (or ellipse) inscribed in the box."
+#define kParamKernelDefault eCImgMorphologyKernelBox
+
 
 using namespace OFX;
 
@@ -126,6 +139,7 @@ struct CImgDilateParams
 {
     int sx;
     int sy;
+    CImgMorphologyKernelEnum kernel;
 };
 
 class CImgDilatePlugin : public CImgFilterPluginHelper<CImgDilateParams,false>
@@ -136,12 +150,16 @@ public:
     : CImgFilterPluginHelper<CImgDilateParams,false>(handle, kSupportsTiles, kSupportsMultiResolution, kSupportsRenderScale)
     {
         _size  = fetchInt2DParam(kParamSize);
-        assert(_size);
+        _kernel = fetchChoiceParam(kParamKernel);
+        assert(_size && _kernel);
     }
 
     virtual void getValuesAtTime(double time, CImgDilateParams& params) OVERRIDE FINAL
     {
         _size->getValueAtTime(time, params.sx, params.sy);
+        int kernel_i;
+        _kernel->getValueAtTime(time, kernel_i);
+        params.kernel = (CImgMorphologyKernelEnum)kernel_i;
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
@@ -161,12 +179,14 @@ public:
         // PROCESSING.
         // This is the only place where the actual processing takes place
         if (params.sx > 0 || params.sy > 0) {
-            cimg.dilate((unsigned int)std::floor(std::max(0, params.sx) * args.renderScale.x) * 2 + 1,
-                        (unsigned int)std::floor(std::max(0, params.sy) * args.renderScale.y) * 2 + 1);
+            cimgMorphology<true>(cimg, params.kernel,
+                                 (int)std::floor(std::max(0, params.sx) * args.renderScale.x),
+                                 (int)std::floor(std::max(0, params.sy) * args.renderScale.y));
         }
         if (params.sx < 0 || params.sy < 0) {
-            cimg.erode((unsigned int)std::floor(std::max(0, -params.sx) * args.renderScale.x) * 2 + 1,
-                       (unsigned int)std::floor(std::max(0, -params.sy) * args.renderScale.y) * 2 + 1);
+            cimgMorphology<false>(cimg, params.kernel,
+                                  (int)std::floor(std::max(0, -params.sx) * args.renderScale.x),
+                                  (int)std::floor(std::max(0, -params.sy) * args.renderScale.y));
         }
     }
 
@@ -179,6 +199,7 @@ private:
 
     // params
     OFX::Int2DParam *_size;
+    OFX::ChoiceParam *_kernel;
 };
 
 
@@ -232,6 +253,21 @@ void CImgDilatePluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc
             page->addChild(*param);
         }
     }
+    {
+        OFX::ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamKernel);
+        param->setLabel(kParamKernelLabel);
+        param->setHint(kParamKernelHint);
+        assert(param->getNOptions() == eCImgMorphologyKernelBox && param->getNOptions() == 0);
+        param->appendOption(kParamKernelOptionBox, kParamKernelOptionBoxHint);
+        assert(param->getNOptions() == eCImgMorphologyKernelDiamond && param->getNOptions() == 1);
+        param->appendOption(kParamKernelOptionDiamond, kParamKernelOptionDiamondHint);
+        assert(param->getNOptions() == eCImgMorphologyKernelDisk && param->getNOptions() == 2);
+        param->appendOption(kParamKernelOptionDisk, kParamKernelOptionDiskHint);
+        param->setDefault((int)kParamKernelDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 
     CImgDilatePlugin::describeInContextEnd(desc, context, page);
 }
@@ -86,20 +86,24 @@
 #include "ofxsCopier.h"
 
 #include "CImgFilter.h"
+#include "CImgHistogram.h"
 
 #define kPluginName          "EqualizeCImg"
 #define kPluginGrouping      "Color"
 #define kPluginDescription \
 "Equalize histogram of pixel values.\n" \
 "To equalize image brightness only, use the HistEQCImg plugin.\n" \
-"Uses the 'equalize' function from the CImg library.\n" \
+"With the Adaptive option, the image is divided in tiles which are equalized separately with clipped histograms " \
+"(contrast-limited adaptive histogram equalization, or CLAHE), which enhances local contrast without amplifying noise in uniform areas.\n" \
+"The histogram and the equalization are computed using all threads.\n" \
+"Without the Adaptive option, the result is the same as the 'equalize' function of the CImg library.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
 
 #define kPluginIdentifier    "net.sf.cimg.CImgEqualize"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 0 // Histogram must be computed on the whole image
 #define kSupportsMultiResolution 1
@@ -127,12 +131,30 @@
 #define kParamMaxHint "Maximum pixel value considered for the histogram computation. All pixel values higher than max_value will not be counted."
 #define kParamMaxDefault 1.0
 
+#define kParamAdaptive "adaptive"
+#define kParamAdaptiveLabel "Adaptive"
+#define kParamAdaptiveHint "Use contrast-limited adaptive histogram equalization (CLAHE): the image is divided in tiles, each tile is equalized with its own clipped histogram, and the tiles are blended bilinearly."
+#define kParamAdaptiveDefault false
+
+#define kParamTiles "tiles"
+#define kParamTilesLabel "Tiles"
+#define kParamTilesHint "Number of tiles along each direction of the image, for adaptive equalization."
+#define kParamTilesDefault 8
+
+#define kParamClipLimit "clipLimit"
+#define kParamClipLimitLabel "Clip Limit"
+#define kParamClipLimitHint "Maximum height of a histogram level of a tile, relative to the mean height of the histogram, for adaptive equalization. The excess is spread over all levels. Lower values give less contrast. 0 means no clipping."
+#define kParamClipLimitDefault 2.0
+
 using namespace OFX;
 
 /// Equalize plugin
 struct CImgEqualizeParams
 {
     int nb_levels;
+    bool adaptive;
+    int tiles;
+    double clipLimit;
     double min_value;
     double max_value;
 };
@@ -145,14 +167,20 @@ public:
     : CImgFilterPluginHelper<CImgEqualizeParams,false>(handle, kSupportsTiles, kSupportsMultiResolution, kSupportsRenderScale)
     {
         _nb_levels  = fetchIntParam(kParamNbLevels);
+        _adaptive = fetchBooleanParam(kParamAdaptive);
+        _tiles = fetchIntParam(kParamTiles);
+        _clipLimit = fetchDoubleParam(kParamClipLimit);
         _min_value  = fetchDoubleParam(kParamMin);
         _max_value  = fetchDoubleParam(kParamMax);
-        assert(_nb_levels && _min_value && _max_value);
+        assert(_nb_levels && _adaptive && _tiles && _clipLimit && _min_value && _max_value);
     }
 
     virtual void getValuesAtTime(double time, CImgEqualizeParams& params) OVERRIDE FINAL
     {
         _nb_levels->getValueAtTime(time, params.nb_levels);
+        _adaptive->getValueAtTime(time, params.adaptive);
+        _tiles->getValueAtTime(time, params.tiles);
+        _clipLimit->getValueAtTime(time, params.clipLimit);
         _min_value->getValueAtTime(time, params.min_value);
         _max_value->getValueAtTime(time, params.max_value);
     }
@@ -172,7 +200,11 @@ public:
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
-        cimg.equalize(params.nb_levels, (float)params.min_value, (float)params.max_value);
+        if (params.adaptive) {
+            cimgEqualizeAdaptive(cimg, params.nb_levels, (float)params.min_value, (float)params.max_value, params.tiles, params.tiles, (float)params.clipLimit);
+        } else {
+            cimgEqualize(cimg, params.nb_levels, (float)params.min_value, (float)params.max_value);
+        }
     }
 
     //virtual bool isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgEqualizeParams& /*params*/) OVERRIDE FINAL
@@ -184,6 +216,9 @@ private:
 
     // params
     OFX::IntParam *_nb_levels;
+    OFX::BooleanParam *_adaptive;
+    OFX::IntParam *_tiles;
+    OFX::DoubleParam *_clipLimit;
     OFX::DoubleParam *_min_value;
     OFX::DoubleParam *_max_value;
 };
@@ -258,6 +293,39 @@ void CImgEqualizePluginFactory::describeInContext(OFX::ImageEffectDescriptor& de
         }
     }
 
+    {
+        OFX::BooleanParamDescriptor *param = desc.defineBooleanParam(kParamAdaptive);
+        param->setLabel(kParamAdaptiveLabel);
+        param->setHint(kParamAdaptiveHint);
+        param->setDefault(kParamAdaptiveDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        OFX::IntParamDescriptor *param = desc.defineIntParam(kParamTiles);
+        param->setLabel(kParamTilesLabel);
+        param->setHint(kParamTilesHint);
+        param->setRange(1, 64);
+        param->setDisplayRange(1, 16);
+        param->setDefault(kParamTilesDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        OFX::DoubleParamDescriptor *param = desc.defineDoubleParam(kParamClipLimit);
+        param->setLabel(kParamClipLimitLabel);
+        param->setHint(kParamClipLimitHint);
+        param->setRange(0, 100.);
+        param->setDisplayRange(1., 10.);
+        param->setDefault(kParamClipLimitDefault);
+        param->setIncrement(0.1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     CImgEqualizePlugin::describeInContextEnd(desc, context, page);
 }
 
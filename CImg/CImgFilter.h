@@ -15,9 +15,12 @@
 #include "ofxsPixelProcessor.h"
 #include "ofxsCopier.h"
 #include "ofxsMerging.h"
+#include "ofxsMultiThread.h"
+#include "CImgBufferPool.h"
 
 #include <cassert>
 #include <memory>
+#include <vector>
 
 //#define CIMG_DEBUG
 
@@ -50,6 +53,19 @@ CLANG_DIAG_ON(shorten - 64 - to - 32)
 //RGBA checkbox are host side if true
 static bool gHostHasNativeRGBACheckbox;
 
+// If the plugin supports tiles, the processed window is split into horizontal bands that are rendered concurrently,
+// each with its own halo. A band is at least this high, and at least as high as its halo.
+#define kCImgFilterMinBandHeight 32
+
+// A part of the processed window, rendered with its own halo
+struct CImgFilterTile
+{
+	OfxRectI window; //!< the pixels that have to be computed
+	OfxRectI roi; //!< window plus halo, the area covered by cimg
+	CImgPooledBuffer buffer; //!< the storage of cimg
+	cimg_library::CImg<float> cimg;
+};
+
 template <class Params, bool sourceIsOptional>
 class CImgFilterPluginHelper : public OFX::ImageEffect
 {
@@ -111,6 +127,9 @@ public:
 
 	virtual bool isIdentity(const OFX::IsIdentityArguments &args, OFX::Clip* &identityClip, double &identityTime) OVERRIDE FINAL;
 
+	// free the buffers kept by the CImg buffer pool
+	virtual void purgeCaches() OVERRIDE FINAL { cimgBufferPool().purge(); }
+
 	virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL
 	{
 		if (clipName == kOfxImageEffectSimpleSourceClipName && _srcClip && args.reason == OFX::eChangeUserEdit) {
@@ -320,6 +339,62 @@ private:
 		OFX::BitDepthEnum dstPixelDepth,
 		int dstRowBytes);
 
+	// render one tile, from the interleaved tmp image
+	void
+		renderTile(const OFX::RenderArguments &args,
+		const Params& params,
+		const float *tmpPixelData,
+		const OfxRectI& tmpBounds,
+		int srcNComponents,
+		const std::vector<int>& srcChannel,
+		CImgFilterTile* tile);
+
+	// renders a set of tiles using all threads
+	class TileProcessor : public OFX::MultiThread::Processor
+	{
+	public:
+		TileProcessor(CImgFilterPluginHelper &effect,
+			const OFX::RenderArguments &args,
+			const Params& params,
+			const float *tmpPixelData,
+			const OfxRectI& tmpBounds,
+			int srcNComponents,
+			const std::vector<int>& srcChannel,
+			std::vector<CImgFilterTile>& tiles)
+			: _effect(effect)
+			, _args(args)
+			, _params(params)
+			, _tmpPixelData(tmpPixelData)
+			, _tmpBounds(tmpBounds)
+			, _srcNComponents(srcNComponents)
+			, _srcChannel(srcChannel)
+			, _tiles(tiles)
+		{
+		}
+
+		void process() { multiThread((unsigned int)_tiles.size()); }
+
+	private:
+		virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+		{
+			for (size_t i = threadId; i < _tiles.size(); i += nThreads) {
+				if (_effect.abort()) {
+					return;
+				}
+				_effect.renderTile(_args, _params, _tmpPixelData, _tmpBounds, _srcNComponents, _srcChannel, &_tiles[i]);
+			}
+		}
+
+		CImgFilterPluginHelper &_effect;
+		const OFX::RenderArguments &_args;
+		const Params& _params;
+		const float *_tmpPixelData;
+		const OfxRectI& _tmpBounds;
+		int _srcNComponents;
+		const std::vector<int>& _srcChannel;
+		std::vector<CImgFilterTile>& _tiles;
+	};
+
 	void
 		setupAndCopy(OFX::PixelProcessorFilterBase & processor,
 		double time,
@@ -563,6 +638,41 @@ bool maskInvert)
 }
 
 
+template <class Params, bool sourceIsOptional>
+void
+CImgFilterPluginHelper<Params, sourceIsOptional>::renderTile(const OFX::RenderArguments &args,
+const Params& params,
+const float *tmpPixelData,
+const OfxRectI& tmpBounds,
+int srcNComponents,
+const std::vector<int>& srcChannel,
+CImgFilterTile* tile)
+{
+	const int cimgSpectrum = (int)srcChannel.size();
+	const int cimgWidth = tile->roi.x2 - tile->roi.x1;
+	const int cimgHeight = tile->roi.y2 - tile->roi.y1;
+	const int tmpWidth = tmpBounds.x2 - tmpBounds.x1;
+	cimg_library::CImg<float>& cimg = tile->cimg;
+	float *cimgPixelData = tile->buffer.allocate((size_t)cimgWidth * cimgHeight * cimgSpectrum);
+	cimg.assign(cimgPixelData, cimgWidth, cimgHeight, 1, cimgSpectrum, true);
+
+	for (int c = 0; c < cimgSpectrum; ++c) {
+		float *dst = cimg.data(0, 0, 0, c);
+		for (int y = tile->roi.y1; y < tile->roi.y2; ++y) {
+			const float *src = tmpPixelData + ((size_t)(y - tmpBounds.y1) * tmpWidth + (tile->roi.x1 - tmpBounds.x1)) * srcNComponents + srcChannel[c];
+			for (int x = cimgWidth; x; --x, src += srcNComponents, ++dst) {
+				*dst = *src;
+			}
+		}
+	}
+
+	printRectI("render tile roi", tile->roi);
+	render(args, params, tile->roi.x1, tile->roi.y1, cimg);
+	// check that the dimensions didn't change
+	assert(cimg.width() == cimgWidth && cimg.height() == cimgHeight && cimg.depth() == 1 && cimg.spectrum() == cimgSpectrum);
+}
+
+
 template <class Params, bool sourceIsOptional>
 void
 CImgFilterPluginHelper<Params, sourceIsOptional>::render(const OFX::RenderArguments &args)
@@ -882,7 +992,8 @@ CImgFilterPluginHelper<Params, sourceIsOptional>::render(const OFX::RenderArgume
 	// from here on, we do the following steps:
 	// 1- copy & unpremult all channels from srcRoI, from src to a tmp image of size srcRoI
 	// 2- extract channels to be processed from tmp to a cimg of size srcRoI (and do the interleaved to coplanar conversion)
-	// 3- process the cimg
+	//    if the plugin supports tiles, the processWindow is split into bands, each with its own cimg
+	// 3- process the cimg(s), concurrently
 	// 4- copy back the processed channels from the cImg to tmp. only processWindow has to be copied
 	// 5- copy+premult+max+mix tmp to dst (only processWindow)
 
@@ -980,38 +1091,68 @@ CImgFilterPluginHelper<Params, sourceIsOptional>::render(const OFX::RenderArgume
 	}
 
 	if (cimgSize) { // may be zero if no channel is processed
-		std::auto_ptr<OFX::ImageMemory> cimgData(new OFX::ImageMemory(cimgSize, this));
-		float *cimgPixelData = (float*)cimgData->lock();
-		cimg_library::CImg<float> cimg(cimgPixelData, cimgWidth, cimgHeight, 1, cimgSpectrum, true);
-
-
-		for (int c = 0; c < cimgSpectrum; ++c) {
-			float *dst = cimg.data(0, 0, 0, c);
-			const float *src = tmpPixelData + srcChannel[c];
-			for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, src += srcNComponents, ++dst) {
-				*dst = *src;
+		// split the processWindow into tiles
+		std::vector<CImgFilterTile> tiles;
+		{
+			unsigned int nTiles = 1;
+			if (_supportsTiles) {
+				// the halo is the part of the RoI above and below the processWindow
+				OfxRectI fullRoI;
+				getRoI(processWindow, renderScale, params, &fullRoI);
+				// (the RoI may be infinite, if the filter needs the full image)
+				const long long haloHeight = std::max(0LL, (long long)processWindow.y1 - fullRoI.y1) + std::max(0LL, (long long)fullRoI.y2 - processWindow.y2);
+				const long long minBandHeight = std::max((long long)kCImgFilterMinBandHeight, haloHeight);
+				nTiles = std::max(1u, std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)((processWindow.y2 - processWindow.y1) / minBandHeight)));
+			}
+			tiles.resize(nTiles);
+			const int height = processWindow.y2 - processWindow.y1;
+			for (unsigned int i = 0; i < nTiles; ++i) {
+				CImgFilterTile& tile = tiles[i];
+				tile.window = processWindow;
+				tile.window.y1 = processWindow.y1 + (int)(((long long)height * i) / nTiles);
+				tile.window.y2 = processWindow.y1 + (int)(((long long)height * (i + 1)) / nTiles);
+				if (nTiles == 1) {
+					tile.roi = srcRoI;
+				}
+				else {
+					getRoI(tile.window, renderScale, params, &tile.roi);
+					OFX::MergeImages2D::rectIntersection(tile.roi, srcRoI, &tile.roi);
+				}
 			}
 		}
 
 		//////////////////////////////////////////////////////////////////////////////////////////
-		// 3- process the cimg
-		printRectI("render srcRoI", srcRoI);
-		render(args, params, srcRoI.x1, srcRoI.y1, cimg);
-		// check that the dimensions didn't change
-		assert(cimg.width() == cimgWidth && cimg.height() == cimgHeight && cimg.depth() == 1 && cimg.spectrum() == cimgSpectrum);
+		// 3- process the cimg (one per tile)
+		if (tiles.size() == 1) {
+			renderTile(args, params, tmpPixelData, tmpBounds, srcNComponents, srcChannel, &tiles[0]);
+		}
+		else {
+			TileProcessor processor(*this, args, params, tmpPixelData, tmpBounds, srcNComponents, srcChannel, tiles);
+			processor.process();
+		}
 
 		//////////////////////////////////////////////////////////////////////////////////////////
 		// 4- copy back the processed channels from the cImg to tmp. only processWindow has to be copied
 
-		// We copy the whole srcRoI. This could be optimized to copy only renderWindow
-		for (int c = 0; c < cimgSpectrum; ++c) {
-			const float *src = cimg.data(0, 0, 0, c);
-			float *dst = tmpPixelData + srcChannel[c];
-			for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, ++src, dst += srcNComponents) {
-				*dst = *src;
+		// tiles overlap by their halo, so that each tile only copies back its own window.
+		// The window may extend beyond the RoI (and tmp) if the renderWindow is not within the RoD:
+		// only the part within the RoI is copied, the rest is outside of tmp and is black.
+		for (size_t i = 0; i < tiles.size(); ++i) {
+			const CImgFilterTile& tile = tiles[i];
+			OfxRectI copyWindow;
+			if (tile.cimg.is_empty() || !OFX::MergeImages2D::rectIntersection(tile.window, tile.roi, &copyWindow)) {
+				continue;
+			}
+			for (int c = 0; c < cimgSpectrum; ++c) {
+				for (int y = copyWindow.y1; y < copyWindow.y2; ++y) {
+					const float *src = tile.cimg.data(copyWindow.x1 - tile.roi.x1, y - tile.roi.y1, 0, c);
+					float *dst = tmpPixelData + ((size_t)(y - tmpBounds.y1) * tmpWidth + (copyWindow.x1 - tmpBounds.x1)) * srcNComponents + srcChannel[c];
+					for (int x = copyWindow.x2 - copyWindow.x1; x; --x, ++src, dst += srcNComponents) {
+						*dst = *src;
+					}
+				}
 			}
 		}
-
 	}
 
 	//////////////////////////////////////////////////////////////////////////////////////////
@@ -1106,6 +1247,14 @@ CImgFilterPluginHelper<Params, sourceIsOptional>::getRegionsOfInterest(const OFX
 	OFX::MergeImages2D::toPixelEnclosing(regionOfInterest, args.renderScale, pixelaspectratio, &rectPixel);
 	OfxRectI srcRoIPixel;
 	getRoI(rectPixel, args.renderScale, params, &srcRoIPixel);
+	if (_srcClip) {
+		// clip the RoI (which may be infinite) to the source RoD before converting it to canonical coordinates
+		OfxRectI srcRoDPixel;
+		OFX::MergeImages2D::toPixelEnclosing(_srcClip->getRegionOfDefinition(time), args.renderScale, pixelaspectratio, &srcRoDPixel);
+		if (!OFX::MergeImages2D::rectIntersection(srcRoIPixel, srcRoDPixel, &srcRoIPixel)) {
+			srcRoIPixel.x1 = srcRoIPixel.y1 = srcRoIPixel.x2 = srcRoIPixel.y2 = 0;
+		}
+	}
 	OFX::MergeImages2D::toCanonical(srcRoIPixel, args.renderScale, pixelaspectratio, &srcRoI);
 
 	if (doMasking && mix != 1.) {
@@ -86,6 +86,8 @@
 #include "ofxsCopier.h"
 
 #include "CImgFilter.h"
+#include "CImgOperator.h"
+#include "CImgGuidedFilter.h"
 
 #if cimg_version < 161
 #error "This plugin requires CImg 1.6.1, please upgrade CImg."
@@ -98,14 +100,28 @@
 "The algorithm is described in: " \
 "He et al., \"Guided Image Filtering,\" " \
 "http://research.microsoft.com/en-us/um/people/kahe/publications/pami12guidedfilter.pdf\n" \
-"Uses the 'blur_guided' function from the CImg library.\n" \
+"The box filters are computed using running sums and all threads, and an optional subsampling of the linear coefficients speeds up large radii, as described in: " \
+"He et al., \"Fast Guided Filter,\" http://arxiv.org/abs/1505.00996\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
 
 #define kPluginIdentifier    "net.sf.cimg.CImgGuided"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
+
+#define kPluginJointName          "GuidedJointCImg"
+#define kPluginJointIdentifier    "net.sf.cimg.CImgGuidedJoint"
+#define kPluginJointDescription \
+"Blur image A with the Guided Image filter, using the intensities of image B as the guide.\n" \
+"The algorithm is described in: " \
+"He et al., \"Guided Image Filtering,\" " \
+"http://research.microsoft.com/en-us/um/people/kahe/publications/pami12guidedfilter.pdf\n" \
+"The box filters are computed using running sums and all threads, and an optional subsampling of the linear coefficients speeds up large radii, as described in: " \
+"He et al., \"Fast Guided Filter,\" http://arxiv.org/abs/1505.00996\n" \
+"CImg is a free, open-source library distributed under the CeCILL-C " \
+"(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
+"It can be used in commercial applications (see http://cimg.sourceforge.net)."
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -128,6 +144,14 @@
 #define kParamEpsilonHint "Regularization parameter. The actual guided filter parameter is epsilon^2)."
 #define kParamEpsilonDefault 0.2
 
+#define kParamSubsampling "subsampling"
+#define kParamSubsamplingLabel "Subsampling"
+#define kParamSubsamplingHint "Subsampling factor of the linear coefficients of the filter. 1 computes the exact guided filter. Larger values are faster, especially for large radii, and give a close approximation as long as the subsampling is small compared to the radius."
+#define kParamSubsamplingDefault 1
+
+#define kClipImage kOfxImageEffectSimpleSourceClipName
+#define kClipGuide "Guide"
+
 using namespace OFX;
 
 /// Guided plugin
@@ -135,6 +159,7 @@ struct CImgGuidedParams
 {
     int radius;
     double epsilon;
+    int subsampling;
 };
 
 class CImgGuidedPlugin : public CImgFilterPluginHelper<CImgGuidedParams,false>
@@ -146,35 +171,38 @@ public:
     {
         _radius  = fetchIntParam(kParamRadius);
         _epsilon  = fetchDoubleParam(kParamEpsilon);
-        assert(_radius && _epsilon);
+        _subsampling = fetchIntParam(kParamSubsampling);
+        assert(_radius && _epsilon && _subsampling);
     }
 
     virtual void getValuesAtTime(double time, CImgGuidedParams& params) OVERRIDE FINAL
     {
         _radius->getValueAtTime(time, params.radius);
         _epsilon->getValueAtTime(time, params.epsilon);
+        _subsampling->getValueAtTime(time, params.subsampling);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
     // only called if mix != 0.
     virtual void getRoI(const OfxRectI& rect, const OfxPointD& renderScale, const CImgGuidedParams& params, OfxRectI* roi) OVERRIDE FINAL
     {
-        int delta_pix = (int)std::ceil(params.radius * renderScale.x);
+        // the coefficients are the means over the radius of means over the radius, computed on blocks of subsampling pixels
+        int delta_pix = 2 * (int)std::ceil(params.radius * renderScale.x) + 2 * std::max(1, (int)(params.subsampling * renderScale.x));
         roi->x1 = rect.x1 - delta_pix;
         roi->x2 = rect.x2 + delta_pix;
         roi->y1 = rect.y1 - delta_pix;
         roi->y2 = rect.y2 + delta_pix;
     }
 
-    virtual void render(const OFX::RenderArguments &args, const CImgGuidedParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
+    virtual void render(const OFX::RenderArguments &args, const CImgGuidedParams& params, int x1, int y1, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
         if (params.radius == 0) {
             return;
         }
-        // blur_guided was introduced in CImg 1.6.0 on Thu Oct 30 11:47:06 2014 +0100
-        cimg.blur_guided(cimg, (float)(params.radius * args.renderScale.x), (float)(params.epsilon*params.epsilon));
+        cimgGuidedFilter(cimg, cimg, (float)(params.radius * args.renderScale.x), (float)(params.epsilon*params.epsilon),
+                         std::max(1, (int)(params.subsampling * args.renderScale.x)), x1, y1);
     }
 
     virtual bool isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgGuidedParams& params) OVERRIDE FINAL
@@ -187,6 +215,64 @@ private:
     // params
     OFX::IntParam *_radius;
     OFX::DoubleParam *_epsilon;
+    OFX::IntParam *_subsampling;
+};
+
+class CImgGuidedJointPlugin : public CImgOperatorPluginHelper<CImgGuidedParams>
+{
+public:
+
+    CImgGuidedJointPlugin(OfxImageEffectHandle handle)
+    : CImgOperatorPluginHelper<CImgGuidedParams>(handle, kClipImage, kClipGuide, kSupportsTiles, kSupportsMultiResolution, kSupportsRenderScale)
+    {
+        _radius  = fetchIntParam(kParamRadius);
+        _epsilon  = fetchDoubleParam(kParamEpsilon);
+        _subsampling = fetchIntParam(kParamSubsampling);
+        assert(_radius && _epsilon && _subsampling);
+    }
+
+    virtual void getValuesAtTime(double time, CImgGuidedParams& params) OVERRIDE FINAL
+    {
+        _radius->getValueAtTime(time, params.radius);
+        _epsilon->getValueAtTime(time, params.epsilon);
+        _subsampling->getValueAtTime(time, params.subsampling);
+    }
+
+    // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
+    // only called if mix != 0.
+    virtual void getRoI(const OfxRectI& rect, const OfxPointD& renderScale, const CImgGuidedParams& params, OfxRectI* roi) OVERRIDE FINAL
+    {
+        // the coefficients are the means over the radius of means over the radius, computed on blocks of subsampling pixels
+        int delta_pix = 2 * (int)std::ceil(params.radius * renderScale.x) + 2 * std::max(1, (int)(params.subsampling * renderScale.x));
+        roi->x1 = rect.x1 - delta_pix;
+        roi->x2 = rect.x2 + delta_pix;
+        roi->y1 = rect.y1 - delta_pix;
+        roi->y2 = rect.y2 + delta_pix;
+    }
+
+    virtual void render(const cimg_library::CImg<float>& /*srcA*/, const cimg_library::CImg<float>& srcB, const OFX::RenderArguments &args, const CImgGuidedParams& params, int x1, int y1, cimg_library::CImg<float>& dst) OVERRIDE FINAL
+    {
+        // PROCESSING.
+        // This is the only place where the actual processing takes place
+        if (params.radius == 0) {
+            return;
+        }
+        // dst shares its pixels with srcA: filter it in place
+        cimgGuidedFilter(dst, srcB, (float)(params.radius * args.renderScale.x), (float)(params.epsilon*params.epsilon),
+                         std::max(1, (int)(params.subsampling * args.renderScale.x)), x1, y1);
+    }
+
+    virtual int isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgGuidedParams& params) OVERRIDE FINAL
+    {
+        return (params.radius == 0);
+    };
+
+private:
+
+    // params
+    OFX::IntParam *_radius;
+    OFX::DoubleParam *_epsilon;
+    OFX::IntParam *_subsampling;
 };
 
 
@@ -252,6 +338,17 @@ void CImgGuidedPluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc
             page->addChild(*param);
         }
     }
+    {
+        OFX::IntParamDescriptor *param = desc.defineIntParam(kParamSubsampling);
+        param->setLabel(kParamSubsamplingLabel);
+        param->setHint(kParamSubsamplingHint);
+        param->setRange(1, 100);
+        param->setDisplayRange(1, 8);
+        param->setDefault(kParamSubsamplingDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 
     CImgGuidedPlugin::describeInContextEnd(desc, context, page);
 }
@@ -262,8 +359,98 @@ OFX::ImageEffect* CImgGuidedPluginFactory::createInstance(OfxImageEffectHandle h
 }
 
 
+mDeclarePluginFactory(CImgGuidedJointPluginFactory, {}, {});
+
+void CImgGuidedJointPluginFactory::describe(OFX::ImageEffectDescriptor& desc)
+{
+    // basic labels
+    desc.setLabel(kPluginJointName);
+    desc.setPluginGrouping(kPluginGrouping);
+    desc.setPluginDescription(kPluginJointDescription);
+
+    // add supported context
+    //desc.addSupportedContext(eContextFilter);
+    desc.addSupportedContext(eContextGeneral);
+
+    // add supported pixel depths
+    //desc.addSupportedBitDepth(eBitDepthUByte);
+    //desc.addSupportedBitDepth(eBitDepthUShort);
+    desc.addSupportedBitDepth(eBitDepthFloat);
+
+    // set a few flags
+    desc.setSingleInstance(false);
+    desc.setHostFrameThreading(kHostFrameThreading);
+    desc.setSupportsMultiResolution(kSupportsMultiResolution);
+    desc.setSupportsTiles(kSupportsTiles);
+    desc.setTemporalClipAccess(false);
+    desc.setRenderTwiceAlways(true);
+    desc.setSupportsMultipleClipPARs(kSupportsMultipleClipPARs);
+    desc.setSupportsMultipleClipDepths(kSupportsMultipleClipDepths);
+    desc.setRenderThreadSafety(kRenderThreadSafety);
+}
+
+void CImgGuidedJointPluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc, OFX::ContextEnum context)
+{
+    // create the clips and params
+    OFX::PageParamDescriptor *page = CImgGuidedJointPlugin::describeInContextBegin(desc, context,
+                                                                                   kClipImage,
+                                                                                   kClipGuide,
+                                                                                   kSupportsRGBA,
+                                                                                   kSupportsRGB,
+                                                                                   kSupportsAlpha,
+                                                                                   kSupportsTiles);
+
+    {
+        OFX::IntParamDescriptor *param = desc.defineIntParam(kParamRadius);
+        param->setLabel(kParamRadiusLabel);
+        param->setHint(kParamRadiusHint);
+        param->setRange(0, 100);
+        param->setDisplayRange(1, 10);
+        param->setDefault(kParamRadiusDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        OFX::DoubleParamDescriptor *param = desc.defineDoubleParam(kParamEpsilon);
+        param->setLabel(kParamEpsilonLabel);
+        param->setHint(kParamEpsilonHint);
+        param->setRange(0, 1.);
+        param->setDisplayRange(0., 0.4);
+        param->setDefault(kParamEpsilonDefault);
+        param->setIncrement(0.005);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        OFX::IntParamDescriptor *param = desc.defineIntParam(kParamSubsampling);
+        param->setLabel(kParamSubsamplingLabel);
+        param->setHint(kParamSubsamplingHint);
+        param->setRange(1, 100);
+        param->setDisplayRange(1, 8);
+        param->setDefault(kParamSubsamplingDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    CImgGuidedJointPlugin::describeInContextEnd(desc, context, page);
+}
+
+OFX::ImageEffect* CImgGuidedJointPluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
+{
+    return new CImgGuidedJointPlugin(handle);
+}
+
 void getCImgGuidedPluginID(OFX::PluginFactoryArray &ids)
 {
-    static CImgGuidedPluginFactory p(kPluginIdentifier, kPluginVersionMajor, kPluginVersionMinor);
-    ids.push_back(&p);
+    {
+        static CImgGuidedPluginFactory p(kPluginIdentifier, kPluginVersionMajor, kPluginVersionMinor);
+        ids.push_back(&p);
+    }
+    {
+        static CImgGuidedJointPluginFactory p(kPluginJointIdentifier, kPluginVersionMajor, kPluginVersionMinor);
+        ids.push_back(&p);
+    }
 }
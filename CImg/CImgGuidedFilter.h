@@ -0,0 +1,276 @@
+//
+//  CImgGuidedFilter.h
+//
+//  Guided image filter computed with running-sum box filters, and its subsampled variant, using all threads.
+//
+//  Copyright (c) 2014 OpenFX. All rights reserved.
+//
+
+#ifndef Misc_CImgGuidedFilter_h
+#define Misc_CImgGuidedFilter_h
+
+#include "CImgLineFilter.h"
+#include "CImgBufferPool.h"
+
+#include <algorithm>
+#include <cassert>
+
+// [internal] Mean over the window [x-r,x+r] clipped to the line, on nLanes lines.
+// This is a box filter with dirichlet boundary conditions, divided by the number of samples of the window inside the line.
+inline float*
+_cimg_box_mean_apply_lanes(float *b0, float *b1, const int N, const int r, const int nLanes)
+{
+	assert(nLanes >= 1 && nLanes <= kCImgLineFilterLanes);
+	const int L = kCImgLineFilterLanes;
+	const int nl = nLanes;
+	double sum[kCImgLineFilterLanes];
+	for (int l = 0; l < nl; ++l) {
+		sum[l] = 0.;
+	}
+	for (int x = 0; x <= std::min(r, N - 1); ++x) {
+		const float *s = b0 + x*L;
+		for (int l = 0; l < nl; ++l) {
+			sum[l] += s[l];
+		}
+	}
+	for (int x = 0; x < N; ++x) {
+		const double count = std::min(N - 1, x + r) - std::max(0, x - r) + 1;
+		float *d = b1 + x*L;
+		for (int l = 0; l < nl; ++l) {
+			d[l] = (float)(sum[l] / count);
+		}
+		if (x + r + 1 < N) {
+			const float *next = b0 + (x + r + 1)*L;
+			for (int l = 0; l < nl; ++l) {
+				sum[l] += next[l];
+			}
+		}
+		if (x - r >= 0) {
+			const float *first = b0 + (x - r)*L;
+			for (int l = 0; l < nl; ++l) {
+				sum[l] -= first[l];
+			}
+		}
+	}
+
+	return b1;
+}
+
+// [internal] Clipped box mean on a batch of lines, for CImgLineFilterProcessor
+struct CImgBoxMeanLines
+{
+	int r;
+
+	int pad() const
+	{
+		return 0;
+	}
+
+	float* operator()(float *b0, float *b1, int N, int nLanes) const
+	{
+		return _cimg_box_mean_apply_lanes(b0, b1, N, r, nLanes);
+	}
+};
+
+// [internal] Mean over the (2*r+1)x(2*r+1) window clipped to the image, as in CImg<T>::get_blur_guided().
+inline void
+_cimg_box_mean(cimg_library::CImg<float>& img, const int r)
+{
+	if (r <= 0) {
+		return;
+	}
+	CImgBoxMeanLines f;
+	f.r = r;
+	if (img.width() > 1) {
+		CImgLineFilterProcessor<CImgBoxMeanLines> processor(img, 'x', f);
+		processor.process();
+	}
+	if (img.height() > 1) {
+		CImgLineFilterProcessor<CImgBoxMeanLines> processor(img, 'y', f);
+		processor.process();
+	}
+}
+
+// The pixelwise steps of the guided filter, each computed on ranges of rows by all threads:
+// - correlations: average the guide I and the image p over blocks of sxs pixels, and compute I, p, I*p, I*I.
+//   The blocks are aligned on multiples of s in the full image: the first block starts at (-ox,-oy) in img.
+// - coefficients: from the means of the above, compute the linear coefficients a = cov(I,p)/(var(I)+eps) and b,
+// - output: interpolate the means of a and b at full resolution, and compute a*I + b.
+// Channel c of the image is guided by channel c of the guide, modulo the number of channels of the guide.
+class CImgGuidedFilterProcessor : public OFX::MultiThread::Processor
+{
+public:
+	enum StepEnum
+	{
+		eStepCorrelations = 0,
+		eStepCoefficients,
+		eStepOutput
+	};
+
+	CImgGuidedFilterProcessor(cimg_library::CImg<float>& img,
+	                          const cimg_library::CImg<float>& guide,
+	                          cimg_library::CImg<float>& corr,
+	                          cimg_library::CImg<float>& coef,
+	                          float regularization,
+	                          int s,
+	                          int ox,
+	                          int oy)
+		: _img(img)
+		, _guide(guide)
+		, _corr(corr)
+		, _coef(coef)
+		, _regularization(regularization)
+		, _s(s)
+		, _ox(ox)
+		, _oy(oy)
+		, _step(eStepCorrelations)
+	{
+	}
+
+	void process(StepEnum step)
+	{
+		_step = step;
+		const int nRows = (step == eStepOutput) ? _img.height() : _corr.height();
+		unsigned int nThreads = 1;
+		if (_img.width() * _img.height() >= kCImgLineFilterMinThreadedSize && !OFX::MultiThread::isSpawnedThread()) {
+			nThreads = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)nRows);
+		}
+		multiThread(std::max(1u, nThreads));
+	}
+
+private:
+	virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+	{
+		const int nRows = (_step == eStepOutput) ? _img.height() : _corr.height();
+		const int y1 = (int)(((long)nRows * threadId) / nThreads);
+		const int y2 = (int)(((long)nRows * (threadId + 1)) / nThreads);
+		const int C = _img.spectrum();
+		const int G = _guide.spectrum();
+		switch (_step) {
+			case eStepCorrelations:
+				for (int y = y1; y < y2; ++y) {
+					const int py1 = std::max(0, y*_s - _oy), py2 = std::min(_img.height(), y*_s - _oy + _s);
+					for (int x = 0; x < _corr.width(); ++x) {
+						const int px1 = std::max(0, x*_s - _ox), px2 = std::min(_img.width(), x*_s - _ox + _s);
+						const float norm = 1.f / ((px2 - px1) * (py2 - py1));
+						for (int c = 0; c < C; ++c) {
+							float I = 0.f, p = 0.f;
+							for (int py = py1; py < py2; ++py) {
+								for (int px = px1; px < px2; ++px) {
+									I += _guide(px, py, 0, c % G);
+									p += _img(px, py, 0, c);
+								}
+							}
+							I *= norm;
+							p *= norm;
+							_corr(x, y, 0, 4*c) = I;
+							_corr(x, y, 0, 4*c + 1) = p;
+							_corr(x, y, 0, 4*c + 2) = I*p;
+							_corr(x, y, 0, 4*c + 3) = I*I;
+						}
+					}
+				}
+				break;
+			case eStepCoefficients:
+				for (int y = y1; y < y2; ++y) {
+					for (int x = 0; x < _corr.width(); ++x) {
+						for (int c = 0; c < C; ++c) {
+							const float mean_I = _corr(x, y, 0, 4*c);
+							const float mean_p = _corr(x, y, 0, 4*c + 1);
+							const float cov_Ip = _corr(x, y, 0, 4*c + 2) - mean_p*mean_I;
+							const float var_I = _corr(x, y, 0, 4*c + 3) - mean_I*mean_I;
+							const float a = cov_Ip / (var_I + _regularization);
+							_coef(x, y, 0, 2*c) = a;
+							_coef(x, y, 0, 2*c + 1) = mean_p - a*mean_I;
+						}
+					}
+				}
+				break;
+			case eStepOutput:
+				for (int y = y1; y < y2; ++y) {
+					const float fy = (y + _oy + 0.5f) / _s - 0.5f;
+					for (int x = 0; x < _img.width(); ++x) {
+						const float fx = (x + _ox + 0.5f) / _s - 0.5f;
+						for (int c = 0; c < C; ++c) {
+							float a, b;
+							if (_s == 1) {
+								a = _coef(x, y, 0, 2*c);
+								b = _coef(x, y, 0, 2*c + 1);
+							} else {
+								a = _coef._linear_atXY(fx, fy, 0, 2*c);
+								b = _coef._linear_atXY(fx, fy, 0, 2*c + 1);
+							}
+							// the guide may be the image itself: read it before writing the result
+							const float I = _guide(x, y, 0, c % G);
+							_img(x, y, 0, c) = a*I + b;
+						}
+					}
+				}
+				break;
+		}
+	}
+
+	cimg_library::CImg<float>& _img;
+	const cimg_library::CImg<float>& _guide;
+	cimg_library::CImg<float>& _corr;
+	cimg_library::CImg<float>& _coef;
+	float _regularization;
+	int _s;
+	int _ox;
+	int _oy;
+	StepEnum _step;
+};
+
+//! Blur image with the guided image filter.
+/**
+ K. He, J. Sun and X. Tang, Guided Image Filtering, IEEE Trans. PAMI, vol. 35, pp. 1397-1409, 2013.
+ K. He and J. Sun, Fast Guided Filter, arXiv:1505.00996, 2015.
+
+ With subsampling = 1, this computes the same result as CImg<T>::blur_guided(guide, radius, regularization), with box
+ filters computed by running sums, so that the cost does not depend on the radius. The only difference is near the
+ top and left borders, where the box filters of CImg 1.6.1 skip the first row and column (and divide by zero if the
+ radius is less than 1).
+ With subsampling = s > 1, the linear coefficients are computed on the image and the guide averaged over blocks of
+ sxs pixels, with a radius divided by s, and interpolated back at full resolution, which is about s^2 times faster.
+ \param guide the guide image, of the same size as img. It may be img itself.
+ \param radius radius of the box filters, in pixels (or in percent of the image size if negative)
+ \param regularization the epsilon^2 of the guided filter
+ \param subsampling the subsampling factor s. It is reduced so that the subsampled radius is at least 1.
+ \param x0 x coordinate of the first pixel of img in the full image
+ \param y0 y coordinate of the first pixel of img in the full image. The subsampling blocks are aligned on multiples
+        of s in the full image, so that tiles of the same image give the same result.
+ **/
+inline void
+cimgGuidedFilter(cimg_library::CImg<float>& img, const cimg_library::CImg<float>& guide, const float radius,
+                 const float regularization, const int subsampling = 1, const int x0 = 0, const int y0 = 0)
+{
+	if (img.is_empty() || !radius) {
+		return;
+	}
+	if (img.depth() > 1 || !img.is_sameXYZ(guide)) {
+		img.blur_guided(guide, radius, regularization);
+
+		return;
+	}
+	const int r = radius >= 0 ? (int)radius : (int)(-radius*std::max(img.width(), img.height())/100);
+	const int s = std::max(1, std::min(subsampling, r));
+	// offset of the first pixel of img in its block
+	const int ox = ((x0 % s) + s) % s;
+	const int oy = ((y0 % s) + s) % s;
+	const int w = (img.width() + ox + s - 1) / s;
+	const int h = (img.height() + oy + s - 1) / s;
+	const int C = img.spectrum();
+	CImgPooledBuffer corrBuffer;
+	CImgPooledBuffer coefBuffer;
+	cimg_library::CImg<float> corr(corrBuffer.allocate((size_t)w*h*4*C), w, h, 1, 4*C, true);
+	cimg_library::CImg<float> coef(coefBuffer.allocate((size_t)w*h*2*C), w, h, 1, 2*C, true);
+	CImgGuidedFilterProcessor processor(img, guide, corr, coef, regularization, s, ox, oy);
+
+	processor.process(CImgGuidedFilterProcessor::eStepCorrelations);
+	_cimg_box_mean(corr, r / s);
+	processor.process(CImgGuidedFilterProcessor::eStepCoefficients);
+	_cimg_box_mean(coef, r / s);
+	processor.process(CImgGuidedFilterProcessor::eStepOutput);
+}
+
+#endif
@@ -75,6 +75,9 @@
 #include <memory>
 #include <cmath>
 #include <cstring>
+#include <algorithm>
+#include <limits>
+#include <vector>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -87,19 +90,23 @@
 #include "ofxsLut.h"
 
 #include "CImgFilter.h"
+#include "CImgHistogram.h"
 
 #define kPluginName          "HistEQCImg"
 #define kPluginGrouping      "Color"
 #define kPluginDescription \
 "Equalize histogram of brightness values.\n" \
-"Uses the 'equalize' function from the CImg library on the 'V' channel of the HSV decomposition of the image.\n" \
+"With the Adaptive option, the image is divided in tiles which are equalized separately with clipped histograms " \
+"(contrast-limited adaptive histogram equalization, or CLAHE), which enhances local contrast without amplifying noise in uniform areas.\n" \
+"The color conversions, the histogram and the equalization are computed using all threads.\n" \
+"The equalization is applied to the 'V' channel of the HSV decomposition of the image. Without the Adaptive option, the result is the same as the 'equalize' function of the CImg library on that channel.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
 
 #define kPluginIdentifier    "net.sf.cimg.CImgHistEQ"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 0 // Histogram must be computed on the whole image
 #define kSupportsMultiResolution 1
@@ -117,12 +124,101 @@
 #define kParamNbLevelsHint "Number of histogram levels used for the equalization."
 #define kParamNbLevelsDefault 4096
 
+#define kParamAdaptive "adaptive"
+#define kParamAdaptiveLabel "Adaptive"
+#define kParamAdaptiveHint "Use contrast-limited adaptive histogram equalization (CLAHE): the image is divided in tiles, each tile is equalized with its own clipped histogram, and the tiles are blended bilinearly."
+#define kParamAdaptiveDefault false
+
+#define kParamTiles "tiles"
+#define kParamTilesLabel "Tiles"
+#define kParamTilesHint "Number of tiles along each direction of the image, for adaptive equalization."
+#define kParamTilesDefault 8
+
+#define kParamClipLimit "clipLimit"
+#define kParamClipLimitLabel "Clip Limit"
+#define kParamClipLimitHint "Maximum height of a histogram level of a tile, relative to the mean height of the histogram, for adaptive equalization. The excess is spread over all levels. Lower values give less contrast. 0 means no clipping."
+#define kParamClipLimitDefault 2.0
+
 using namespace OFX;
 
+// Converts the image from RGB to HSV, and computes the range of the V channel in the same pass, or converts it back
+// from HSV to RGB, on ranges of rows.
+class CImgHistEQHSVProcessor : public OFX::MultiThread::Processor
+{
+public:
+    CImgHistEQHSVProcessor(cimg_library::CImg<float>& cimg)
+    : _cimg(cimg)
+    , _toHSV(true)
+    , _threadMin()
+    , _threadMax()
+    {
+    }
+
+    // convert to HSV, and return the range of V
+    void toHSV(float* vmin, float* vmax)
+    {
+        _toHSV = true;
+        process();
+        *vmin = *std::min_element(_threadMin.begin(), _threadMin.end());
+        *vmax = *std::max_element(_threadMax.begin(), _threadMax.end());
+    }
+
+    void toRGB()
+    {
+        _toHSV = false;
+        process();
+    }
+
+private:
+    void process()
+    {
+        unsigned int nThreads = 1;
+        if (_cimg.width() * _cimg.height() >= kCImgLineFilterMinThreadedSize && !OFX::MultiThread::isSpawnedThread()) {
+            nThreads = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)_cimg.height());
+        }
+        nThreads = std::max(1u, nThreads);
+        _threadMin.assign(nThreads, std::numeric_limits<float>::max());
+        _threadMax.assign(nThreads, -std::numeric_limits<float>::max());
+        multiThread(nThreads);
+    }
+
+    virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int y1 = (int)(((long)_cimg.height() * threadId) / nThreads);
+        const int y2 = (int)(((long)_cimg.height() * (threadId + 1)) / nThreads);
+        float vmin = _threadMin[threadId];
+        float vmax = _threadMax[threadId];
+        for (int y = y1; y < y2; ++y) {
+            float *r = _cimg.data(0, y, 0, 0);
+            float *g = _cimg.data(0, y, 0, 1);
+            float *b = _cimg.data(0, y, 0, 2);
+            for (int x = 0; x < _cimg.width(); ++x) {
+                if (_toHSV) {
+                    OFX::Color::rgb_to_hsv(r[x], g[x], b[x], &r[x], &g[x], &b[x]);
+                    vmin = std::min(vmin, b[x]);
+                    vmax = std::max(vmax, b[x]);
+                } else {
+                    OFX::Color::hsv_to_rgb(r[x], g[x], b[x], &r[x], &g[x], &b[x]);
+                }
+            }
+        }
+        _threadMin[threadId] = vmin;
+        _threadMax[threadId] = vmax;
+    }
+
+    cimg_library::CImg<float>& _cimg;
+    bool _toHSV;
+    std::vector<float> _threadMin; //!< smallest V found by each thread
+    std::vector<float> _threadMax; //!< largest V found by each thread
+};
+
 /// HistEQ plugin
 struct CImgHistEQParams
 {
     int nb_levels;
+    bool adaptive;
+    int tiles;
+    double clipLimit;
 };
 
 class CImgHistEQPlugin : public CImgFilterPluginHelper<CImgHistEQParams,false>
@@ -133,12 +229,18 @@ public:
     : CImgFilterPluginHelper<CImgHistEQParams,false>(handle, kSupportsTiles, kSupportsMultiResolution, kSupportsRenderScale)
     {
         _nb_levels  = fetchIntParam(kParamNbLevels);
-        assert(_nb_levels);
+        _adaptive = fetchBooleanParam(kParamAdaptive);
+        _tiles = fetchIntParam(kParamTiles);
+        _clipLimit = fetchDoubleParam(kParamClipLimit);
+        assert(_nb_levels && _adaptive && _tiles && _clipLimit);
     }
 
     virtual void getValuesAtTime(double time, CImgHistEQParams& params) OVERRIDE FINAL
     {
         _nb_levels->getValueAtTime(time, params.nb_levels);
+        _adaptive->getValueAtTime(time, params.adaptive);
+        _tiles->getValueAtTime(time, params.tiles);
+        _clipLimit->getValueAtTime(time, params.clipLimit);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
@@ -159,22 +261,16 @@ public:
         if (cimg.spectrum() < 3) {
             assert(cimg.spectrum() == 1); // Alpha image
             float vmin, vmax;
-            vmin = cimg.min_max(vmax);
-            cimg.equalize(params.nb_levels, vmin, vmax);
+            cimgMinMax(cimg, &vmin, &vmax);
+            equalize(params, cimg, vmin, vmax);
         } else {
-#ifdef cimg_use_openmp
-#pragma omp parallel for if (cimg.size()>=1048576)
-#endif
-            cimg_forXY(cimg, x, y) {
-                OFX::Color::rgb_to_hsv(cimg(x,y,0,0), cimg(x,y,0,1), cimg(x,y,0,2), &cimg(x,y,0,0), &cimg(x,y,0,1), &cimg(x,y,0,2));
-            }
-            cimg_library::CImg<float> vchannel = cimg.get_shared_channel(2);
+            // the range of V is computed while converting to HSV
+            CImgHistEQHSVProcessor processor(cimg);
             float vmin, vmax;
-            vmin = vchannel.min_max(vmax);
-            vchannel.equalize(params.nb_levels, vmin, vmax);
-            cimg_forXY(cimg, x, y) {
-                OFX::Color::hsv_to_rgb(cimg(x,y,0,0), cimg(x,y,0,1), cimg(x,y,0,2), &cimg(x,y,0,0), &cimg(x,y,0,1), &cimg(x,y,0,2));
-            }
+            processor.toHSV(&vmin, &vmax);
+            cimg_library::CImg<float> vchannel = cimg.get_shared_channel(2);
+            equalize(params, vchannel, vmin, vmax);
+            processor.toRGB();
         }
     }
 
@@ -185,8 +281,20 @@ public:
 
 private:
 
+    static void equalize(const CImgHistEQParams& params, cimg_library::CImg<float>& cimg, float vmin, float vmax)
+    {
+        if (params.adaptive) {
+            cimgEqualizeAdaptive(cimg, params.nb_levels, vmin, vmax, params.tiles, params.tiles, (float)params.clipLimit);
+        } else {
+            cimgEqualize(cimg, params.nb_levels, vmin, vmax);
+        }
+    }
+
     // params
     OFX::IntParam *_nb_levels;
+    OFX::BooleanParam *_adaptive;
+    OFX::IntParam *_tiles;
+    OFX::DoubleParam *_clipLimit;
 };
 
 
@@ -242,6 +350,39 @@ void CImgHistEQPluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc
         }
     }
 
+    {
+        OFX::BooleanParamDescriptor *param = desc.defineBooleanParam(kParamAdaptive);
+        param->setLabel(kParamAdaptiveLabel);
+        param->setHint(kParamAdaptiveHint);
+        param->setDefault(kParamAdaptiveDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        OFX::IntParamDescriptor *param = desc.defineIntParam(kParamTiles);
+        param->setLabel(kParamTilesLabel);
+        param->setHint(kParamTilesHint);
+        param->setRange(1, 64);
+        param->setDisplayRange(1, 16);
+        param->setDefault(kParamTilesDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        OFX::DoubleParamDescriptor *param = desc.defineDoubleParam(kParamClipLimit);
+        param->setLabel(kParamClipLimitLabel);
+        param->setHint(kParamClipLimitHint);
+        param->setRange(0, 100.);
+        param->setDisplayRange(1., 10.);
+        param->setDefault(kParamClipLimitDefault);
+        param->setIncrement(0.1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     CImgHistEQPlugin::describeInContextEnd(desc, context, page);
 }
 
@@ -0,0 +1,387 @@
+//
+//  CImgHistogram.h
+//
+//  Histogram equalization, global or contrast-limited adaptive (CLAHE), using all threads.
+//
+//  Copyright (c) 2014 OpenFX. All rights reserved.
+//
+
+#ifndef Misc_CImgHistogram_h
+#define Misc_CImgHistogram_h
+
+#include "CImgLineFilter.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+// The steps of the histogram equalization:
+// - minmax: the range of the image, reduced from the range of the rows of each thread,
+// - histogram: the histogram of the image, reduced from the histograms of the rows of each thread,
+// - tile histograms: with adaptive equalization, the clipped histogram of each tile, one tile at a time per thread,
+// - remap: map each value through the lookup table of the image (or the lookup tables of the four nearest tiles,
+//   blended bilinearly), on ranges of rows.
+// The histograms and the lookup tables use the same bins as CImg<T>::get_histogram() and CImg<T>::equalize().
+// All the channels share the same histogram.
+class CImgHistogramProcessor : public OFX::MultiThread::Processor
+{
+public:
+	enum StepEnum
+	{
+		eStepMinMax = 0,
+		eStepHistogram,
+		eStepTileHistograms,
+		eStepRemap
+	};
+
+	CImgHistogramProcessor(cimg_library::CImg<float>& img, unsigned int nb_levels)
+		: _img(img)
+		, _nb_levels(nb_levels)
+		, _vmin(0)
+		, _vmax(0)
+		, _binRange(0)
+		, _posRange(0)
+		, _step(eStepMinMax)
+		, _tilesX(1)
+		, _tilesY(1)
+		, _clipLimit(0)
+		, _threadMin()
+		, _threadMax()
+		, _threadHist()
+		, _hist()
+		, _lut()
+	{
+	}
+
+	// compute the range of the image
+	void minMax(float* vmin, float* vmax)
+	{
+		process(eStepMinMax, _img.height());
+		*vmin = *std::min_element(_threadMin.begin(), _threadMin.end());
+		*vmax = *std::max_element(_threadMax.begin(), _threadMax.end());
+	}
+
+	// compute the lookup table of the image, that equalizes values in [vmin,vmax].
+	// returns false if the histogram is empty, or if the range is empty.
+	bool histogram(float vmin, float vmax)
+	{
+		setRange(vmin, vmax);
+		if (!(_vmin < _vmax)) {
+			return false;
+		}
+		process(eStepHistogram, _img.height());
+		_hist.assign(_nb_levels, 0);
+		for (size_t t = 0; t < _threadHist.size(); ++t) {
+			const unsigned long *h = &_threadHist[t][0];
+			for (unsigned int i = 0; i < _nb_levels; ++i) {
+				_hist[i] += h[i];
+			}
+		}
+		_tilesX = _tilesY = 1;
+		_lut.resize(_nb_levels);
+		cumulate(&_hist[0], &_lut[0]);
+
+		return true;
+	}
+
+	// compute the lookup tables of tilesX x tilesY tiles, from histograms clipped at clipLimit times their mean
+	bool tileHistograms(float vmin, float vmax, int tilesX, int tilesY, float clipLimit)
+	{
+		setRange(vmin, vmax);
+		if (!(_vmin < _vmax)) {
+			return false;
+		}
+		_tilesX = std::max(1, std::min(tilesX, _img.width()));
+		_tilesY = std::max(1, std::min(tilesY, _img.height()));
+		_clipLimit = clipLimit;
+		_lut.resize((size_t)_tilesX * _tilesY * _nb_levels);
+		process(eStepTileHistograms, _tilesX * _tilesY);
+
+		return true;
+	}
+
+	// apply the lookup tables to the image
+	void remap()
+	{
+		process(eStepRemap, _img.height());
+	}
+
+private:
+	void process(StepEnum step, int nItems)
+	{
+		_step = step;
+		unsigned int nThreads = 1;
+		if (_img.width() * _img.height() >= kCImgLineFilterMinThreadedSize && !OFX::MultiThread::isSpawnedThread()) {
+			nThreads = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)nItems);
+		}
+		nThreads = std::max(1u, nThreads);
+		if (step == eStepMinMax) {
+			_threadMin.assign(nThreads, _img[0]);
+			_threadMax.assign(nThreads, _img[0]);
+		} else if (step == eStepHistogram) {
+			_threadHist.assign(nThreads, std::vector<unsigned long>(_nb_levels, 0));
+		}
+		multiThread(nThreads);
+	}
+
+	// set the range of the histogram
+	void setRange(float vmin, float vmax)
+	{
+		_vmin = std::min(vmin, vmax);
+		_vmax = std::max(vmin, vmax);
+		// same types as in CImg<T>::get_histogram() and CImg<T>::equalize()
+		_binRange = (double)_vmax - _vmin;
+		_posRange = _vmax - _vmin;
+	}
+
+	// the bin of a value in [vmin,vmax] for the histogram, as in CImg<T>::get_histogram() (vmax goes to the last bin)
+	unsigned int bin(float val) const
+	{
+		return (unsigned int)std::min(_nb_levels - 1., (val - (double)_vmin) * _nb_levels / _binRange);
+	}
+
+	// The remapping uses the same quotient as CImg<T>::equalize(). These are written without branches, so that the
+	// remapping loops are vectorizable: the table is always read at a valid index, and the result is selected.
+	double posQuotient(float val) const
+	{
+		return (val - _vmin) * (_nb_levels - 1.) / _posRange;
+	}
+
+	// CImg<T>::equalize() only remaps values whose quotient, truncated toward zero, is a valid bin (NaNs are not remapped)
+	bool posInRange(double q) const
+	{
+		return q > -1. && q < _nb_levels;
+	}
+
+	// the bin of a quotient, clamped to the table (NaNs give 0)
+	int posClamped(double q) const
+	{
+		return (int)std::min(_nb_levels - 1., std::max(0., q));
+	}
+
+	// the cumulated histogram, normalized to [vmin,vmax], as in CImg<T>::equalize()
+	void cumulate(const unsigned long *hist, float *lut) const
+	{
+		std::vector<unsigned long> cumul(_nb_levels);
+		unsigned long c = 0;
+		for (unsigned int i = 0; i < _nb_levels; ++i) {
+			c += hist[i];
+			cumul[i] = c;
+		}
+		if (!c) {
+			c = 1;
+		}
+		for (unsigned int i = 0; i < _nb_levels; ++i) {
+			lut[i] = (float)(_vmin + (_vmax - _vmin) * cumul[i] / c);
+		}
+	}
+
+	// the clipped histogram of a tile, with the excess redistributed uniformly
+	void tileLut(int tx, int ty, float *lut) const
+	{
+		const int x1 = (int)(((long)_img.width() * tx) / _tilesX), x2 = (int)(((long)_img.width() * (tx + 1)) / _tilesX);
+		const int y1 = (int)(((long)_img.height() * ty) / _tilesY), y2 = (int)(((long)_img.height() * (ty + 1)) / _tilesY);
+		std::vector<unsigned long> hist(_nb_levels, 0);
+		unsigned long count = 0;
+		for (int c = 0; c < _img.spectrum(); ++c) {
+			for (int y = y1; y < y2; ++y) {
+				const float *p = _img.data(0, y, 0, c);
+				for (int x = x1; x < x2; ++x) {
+					const float val = p[x];
+					if (val >= _vmin && val <= _vmax) {
+						++hist[bin(val)];
+						++count;
+					}
+				}
+			}
+		}
+		if (_clipLimit > 0) {
+			const unsigned long limit = std::max(1ul, (unsigned long)(_clipLimit * count / _nb_levels));
+			unsigned long excess = 0;
+			for (unsigned int i = 0; i < _nb_levels; ++i) {
+				if (hist[i] > limit) {
+					excess += hist[i] - limit;
+					hist[i] = limit;
+				}
+			}
+			const unsigned long uniform = excess / _nb_levels;
+			const unsigned long remainder = excess % _nb_levels;
+			for (unsigned int i = 0; i < _nb_levels; ++i) {
+				hist[i] += uniform;
+			}
+			// spread the remainder evenly over the range
+			for (unsigned long i = 0; i < remainder; ++i) {
+				++hist[(size_t)((i * _nb_levels) / remainder)];
+			}
+		}
+		cumulate(&hist[0], lut);
+	}
+
+	virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+	{
+		const int W = _img.width();
+		const int H = _img.height();
+		const int y1 = (int)(((long)H * threadId) / nThreads);
+		const int y2 = (int)(((long)H * (threadId + 1)) / nThreads);
+		switch (_step) {
+			case eStepMinMax: {
+				float vmin = _threadMin[threadId], vmax = _threadMax[threadId];
+				for (int c = 0; c < _img.spectrum(); ++c) {
+					for (int y = y1; y < y2; ++y) {
+						const float *p = _img.data(0, y, 0, c);
+						for (int x = 0; x < W; ++x) {
+							vmin = std::min(vmin, p[x]);
+							vmax = std::max(vmax, p[x]);
+						}
+					}
+				}
+				_threadMin[threadId] = vmin;
+				_threadMax[threadId] = vmax;
+			}   break;
+			case eStepHistogram: {
+				unsigned long *hist = &_threadHist[threadId][0];
+				for (int c = 0; c < _img.spectrum(); ++c) {
+					for (int y = y1; y < y2; ++y) {
+						const float *p = _img.data(0, y, 0, c);
+						for (int x = 0; x < W; ++x) {
+							const float val = p[x];
+							if (val >= _vmin && val <= _vmax) {
+								++hist[bin(val)];
+							}
+						}
+					}
+				}
+			}   break;
+			case eStepTileHistograms:
+				for (int t = threadId; t < _tilesX * _tilesY; t += nThreads) {
+					tileLut(t % _tilesX, t / _tilesX, &_lut[(size_t)t * _nb_levels]);
+				}
+				break;
+			case eStepRemap:
+				if (_tilesX == 1 && _tilesY == 1) {
+					const float *lut = &_lut[0];
+					for (int c = 0; c < _img.spectrum(); ++c) {
+						for (int y = y1; y < y2; ++y) {
+							float *p = _img.data(0, y, 0, c);
+							for (int x = 0; x < W; ++x) {
+								const double q = posQuotient(p[x]);
+								const float v = lut[posClamped(q)];
+								p[x] = posInRange(q) ? v : p[x];
+							}
+						}
+					}
+				} else {
+					// each pixel is blended from the tables of the four tiles whose centers surround it
+					std::vector<int> tx0(W), tx1(W);
+					std::vector<float> wx(W);
+					for (int x = 0; x < W; ++x) {
+						const float fx = (x + 0.5f) * _tilesX / W - 0.5f;
+						const int t = (int)std::floor(fx);
+						tx0[x] = std::max(0, std::min(_tilesX - 1, t));
+						tx1[x] = std::max(0, std::min(_tilesX - 1, t + 1));
+						wx[x] = std::max(0.f, std::min(1.f, fx - t));
+					}
+					const size_t rowStride = (size_t)_tilesX * _nb_levels;
+					for (int y = y1; y < y2; ++y) {
+						const float fy = (y + 0.5f) * _tilesY / H - 0.5f;
+						const int t = (int)std::floor(fy);
+						const float *lut0 = &_lut[std::max(0, std::min(_tilesY - 1, t)) * rowStride];
+						const float *lut1 = &_lut[std::max(0, std::min(_tilesY - 1, t + 1)) * rowStride];
+						const float wy = std::max(0.f, std::min(1.f, fy - t));
+						for (int c = 0; c < _img.spectrum(); ++c) {
+							float *p = _img.data(0, y, 0, c);
+							for (int x = 0; x < W; ++x) {
+								const double q = posQuotient(p[x]);
+								const int i = posClamped(q);
+								const size_t i0 = (size_t)tx0[x] * _nb_levels + i, i1 = (size_t)tx1[x] * _nb_levels + i;
+								const float v0 = lut0[i0] + wx[x] * (lut0[i1] - lut0[i0]);
+								const float v1 = lut1[i0] + wx[x] * (lut1[i1] - lut1[i0]);
+								const float v = v0 + wy * (v1 - v0);
+								p[x] = posInRange(q) ? v : p[x];
+							}
+						}
+					}
+				}
+				break;
+		}
+	}
+
+	cimg_library::CImg<float>& _img;
+	unsigned int _nb_levels;
+	float _vmin;
+	float _vmax;
+	double _binRange;
+	double _posRange;
+	StepEnum _step;
+	int _tilesX;
+	int _tilesY;
+	float _clipLimit;
+	std::vector<float> _threadMin; //!< smallest value found by each thread
+	std::vector<float> _threadMax; //!< largest value found by each thread
+	std::vector<std::vector<unsigned long> > _threadHist; //!< histogram computed by each thread
+	std::vector<unsigned long> _hist;
+	std::vector<float> _lut; //!< the lookup table of the image, or of each tile
+};
+
+//! Compute the minimum and maximum values of an image, using all threads.
+inline void
+cimgMinMax(cimg_library::CImg<float>& img, float* vmin, float* vmax)
+{
+	if (img.is_empty()) {
+		*vmin = *vmax = 0.f;
+
+		return;
+	}
+	CImgHistogramProcessor processor(img, 1);
+	processor.minMax(vmin, vmax);
+}
+
+//! Equalize histogram of pixel values.
+/**
+ This computes the same result as CImg<T>::equalize(nb_levels, min_value, max_value), with the histogram and the
+ remapping computed by all threads.
+ \param nb_levels number of histogram levels used for the equalization
+ \param min_value minimum pixel value considered for the histogram computation
+ \param max_value maximum pixel value considered for the histogram computation
+ **/
+inline void
+cimgEqualize(cimg_library::CImg<float>& img, const unsigned int nb_levels, const float min_value, const float max_value)
+{
+	if (!nb_levels || img.is_empty()) {
+		return;
+	}
+	CImgHistogramProcessor processor(img, nb_levels);
+	if (processor.histogram(min_value, max_value)) {
+		processor.remap();
+	}
+}
+
+//! Equalize histogram of pixel values, with contrast-limited adaptive histogram equalization (CLAHE).
+/**
+ K. Zuiderveld, Contrast Limited Adaptive Histogram Equalization, Graphics Gems IV, pp. 474-485, 1994.
+
+ The image is divided in tilesX x tilesY tiles, and each tile is equalized with its own histogram, clipped so that
+ no level holds more than clipLimit times the mean number of values per level. The excess is spread over all levels.
+ Each pixel is mapped through the tables of the four tiles whose centers surround it, blended bilinearly.
+ \param nb_levels number of histogram levels used for the equalization
+ \param min_value minimum pixel value considered for the histogram computation
+ \param max_value maximum pixel value considered for the histogram computation
+ \param tilesX number of tiles along X
+ \param tilesY number of tiles along Y
+ \param clipLimit maximum height of a level, relative to the mean height of the histogram (0 means no clipping)
+ **/
+inline void
+cimgEqualizeAdaptive(cimg_library::CImg<float>& img, const unsigned int nb_levels, const float min_value, const float max_value,
+                     const int tilesX, const int tilesY, const float clipLimit)
+{
+	if (!nb_levels || img.is_empty()) {
+		return;
+	}
+	CImgHistogramProcessor processor(img, nb_levels);
+	if (processor.tileHistograms(min_value, max_value, tilesX, tilesY, clipLimit)) {
+		processor.remap();
+	}
+}
+
+#endif
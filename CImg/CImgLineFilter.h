@@ -0,0 +1,167 @@
+//
+//  CImgLineFilter.h
+//
+//  Applies a 1D filter on all the lines of a CImg image along one axis, by batches of adjacent lines, using all threads.
+//
+//  Copyright (c) 2014 OpenFX. All rights reserved.
+//
+
+#ifndef Misc_CImgLineFilter_h
+#define Misc_CImgLineFilter_h
+
+#include "CImgFilter.h"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+// Number of lines filtered together: lane l of sample n is stored at n*kCImgLineFilterLanes + l in the line buffers,
+// so that all inner loops run over contiguous memory and can be vectorized by the compiler.
+#define kCImgLineFilterLanes 16
+
+// images with less samples than this are filtered by the calling thread
+#define kCImgLineFilterMinThreadedSize 65536
+
+// Applies a LinesFilter on all lines of an image along one axis, using all threads.
+// Along 'x', the rows are copied by transposed batches of kCImgLineFilterLanes rows.
+// Along the other axes, batches of kCImgLineFilterLanes adjacent lines are copied row by row.
+//
+// LinesFilter must provide:
+// - int pad() const, the number of padding samples needed on each side of the lines,
+// - float* operator()(float *b0, float *b1, int N, int nLanes) const, which filters the nLanes lines of N samples
+//   stored in b0 (sample n of line l is b0[n*kCImgLineFilterLanes + l], and there are pad() samples before and after),
+//   using b1 as a temporary buffer of the same size, and returns b0 or b1, whichever holds the result.
+// It is called concurrently from several threads.
+template <class LinesFilter>
+class CImgLineFilterProcessor : public OFX::MultiThread::Processor
+{
+public:
+	CImgLineFilterProcessor(cimg_library::CImg<float>& img, const char axis, const LinesFilter& filter)
+		: _img(img)
+		, _axis(axis)
+		, _filter(filter)
+		, _N(0)
+		, _off(0)
+		, _nLines(0)
+		, _planeSize(0)
+		, _nBlocksPerPlane(0)
+		, _nBlocks(0)
+		, _pad(filter.pad())
+	{
+		const unsigned long w = img._width, h = img._height, d = img._depth, s = img._spectrum;
+		switch (axis) {
+			case 'x':
+				// lines are the rows, _off is the offset between two lines
+				_N = img._width;
+				_off = w;
+				_nLines = h*d*s;
+				_planeSize = 0;
+				break;
+			case 'y':
+				_N = img._height;
+				_off = w;
+				_nLines = w;
+				_planeSize = w*h;
+				break;
+			case 'z':
+				_N = img._depth;
+				_off = w*h;
+				_nLines = w*h;
+				_planeSize = w*h*d;
+				break;
+			default:
+				_N = img._spectrum;
+				_off = w*h*d;
+				_nLines = w*h*d;
+				_planeSize = w*h*d*s;
+				break;
+		}
+		_nBlocksPerPlane = (_nLines + kCImgLineFilterLanes - 1) / kCImgLineFilterLanes;
+		_nBlocks = _nBlocksPerPlane * (_planeSize ? (unsigned long)img.size() / _planeSize : 1);
+	}
+
+	void process()
+	{
+		if (_img.is_empty()) {
+			return;
+		}
+		unsigned int nThreads = 1;
+		if (_img.size() >= kCImgLineFilterMinThreadedSize && !OFX::MultiThread::isSpawnedThread()) {
+			nThreads = (unsigned int)std::min((unsigned long)OFX::MultiThread::getNumCPUs(), _nBlocks);
+		}
+		multiThread(std::max(1u, nThreads));
+	}
+
+private:
+	virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+	{
+		const int L = kCImgLineFilterLanes;
+		const size_t bufSize = (size_t)(_N + 2*_pad) * L;
+		std::vector<float> buf0(bufSize), buf1(bufSize);
+		float *b0 = &buf0[_pad*L];
+		float *b1 = &buf1[_pad*L];
+		for (unsigned long block = threadId; block < _nBlocks; block += nThreads) {
+			const unsigned long line0 = (block % _nBlocksPerPlane) * L;
+			const int nLanes = (int)std::min((unsigned long)L, _nLines - line0);
+			if (_axis == 'x') {
+				// transposed copy of nLanes rows
+				float *data = _img._data + line0 * _off;
+				for (int l = 0; l < nLanes; ++l) {
+					const float *s = data + l*_off;
+					float *d = b0 + l;
+					for (int n = 0; n < _N; ++n, d += L) {
+						*d = s[n];
+					}
+				}
+				const float *res = _filter(b0, b1, _N, nLanes);
+				for (int l = 0; l < nLanes; ++l) {
+					float *d = data + l*_off;
+					const float *s = res + l;
+					for (int n = 0; n < _N; ++n, s += L) {
+						d[n] = *s;
+					}
+				}
+			} else {
+				float *data = _img._data + (block / _nBlocksPerPlane) * _planeSize + line0;
+				for (int n = 0; n < _N; ++n) {
+					std::copy(data + n*_off, data + n*_off + nLanes, b0 + n*L);
+				}
+				const float *res = _filter(b0, b1, _N, nLanes);
+				for (int n = 0; n < _N; ++n) {
+					std::copy(res + n*L, res + n*L + nLanes, data + n*_off);
+				}
+			}
+		}
+	}
+
+	cimg_library::CImg<float>& _img;
+	char _axis;
+	const LinesFilter& _filter;
+	int _N; // number of samples in each line
+	unsigned long _off; // offset between two samples of a line, or between two rows along 'x'
+	unsigned long _nLines; // number of lines in each plane
+	unsigned long _planeSize; // offset between two planes of lines (0 along 'x', where all rows are one plane)
+	unsigned long _nBlocksPerPlane;
+	unsigned long _nBlocks;
+	int _pad;
+};
+
+// [internal] Fill the pad samples before and after the N samples of nLanes lines with the nearest sample (neumann)
+// or with zero (dirichlet).
+inline void
+_cimg_pad_lanes(float *b, const int N, const int pad, const int nLanes, const bool boundary_conditions)
+{
+	const int L = kCImgLineFilterLanes;
+	const float *first = b;
+	const float *last = b + (N-1)*L;
+	for (int k = 1; k <= pad; ++k) {
+		float *before = b - k*L;
+		float *after = b + (N-1+k)*L;
+		for (int l = 0; l < nLanes; ++l) {
+			before[l] = boundary_conditions ? first[l] : 0.f;
+			after[l] = boundary_conditions ? last[l] : 0.f;
+		}
+	}
+}
+
+#endif
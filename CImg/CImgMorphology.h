@@ -0,0 +1,198 @@
+//
+//  CImgMorphology.h
+//
+//  Dilation and erosion by rectangles, diamonds and disks, with a cost per pixel which does not depend on the size of
+//  the rectangles (van Herk/Gil-Werman algorithm), shared by the CImg plugins.
+//
+//  Copyright (c) 2014 OpenFX. All rights reserved.
+//
+
+#ifndef Misc_CImgMorphology_h
+#define Misc_CImgMorphology_h
+
+#include "CImgLineFilter.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+enum CImgMorphologyKernelEnum
+{
+	eCImgMorphologyKernelBox = 0,
+	eCImgMorphologyKernelDiamond,
+	eCImgMorphologyKernelDisk
+};
+
+// [internal] Running max (or min) over a window of 2*r+1 samples, on nLanes lines, using the van Herk/Gil-Werman algorithm.
+/**
+ M. van Herk, A fast algorithm for local minimum and maximum filters on rectangular and octagonal kernels,
+ Pattern Recognition Letters, vol. 13, pp. 517-521, 1992.
+ J. Gil and M. Werman, Computing 2-D min, median, and max filters, IEEE Trans. PAMI, vol. 15, pp. 504-507, 1993.
+
+ The line is cut in blocks of 2*r+1 samples. The result for a window is the max of the suffix max (from the beginning
+ of the window to the end of its block) and of the prefix max (from the beginning of the next block to the end of the
+ window), which costs 3 comparisons per sample, whatever the size of the window.
+ Samples out of the line take the value of the nearest sample (neumann boundary conditions).
+ \param b0 the first sample of the lines. There are at least r samples before and after the N samples of each line.
+ \param b1 temporary buffer of the same size as b0
+ \return b0 or b1, whichever holds the result
+ **/
+template <bool dilate>
+float*
+_cimg_vhgw_apply_lanes(float *b0, float *b1, const int N, const int r, const int nLanes)
+{
+	assert(nLanes >= 1 && nLanes <= kCImgLineFilterLanes);
+	if (r <= 0) {
+		return b0;
+	}
+	const int L = kCImgLineFilterLanes;
+	const int nl = nLanes;
+	const int k = 2*r + 1;
+	_cimg_pad_lanes(b0, N, r, nl, true);
+
+	// the blocks start at sample -r. g (prefix max) goes in b1, h (suffix max) replaces the samples in b0.
+	for (int start = -r; start < N + r; start += k) {
+		const int end = std::min(start + k, N + r); // one past the last sample of the block
+		{
+			const float *s = b0 + start*L;
+			float *g = b1 + start*L;
+			for (int l = 0; l < nl; ++l) {
+				g[l] = s[l];
+			}
+		}
+		for (int x = start + 1; x < end; ++x) {
+			const float *s = b0 + x*L;
+			const float *gp = b1 + (x-1)*L;
+			float *g = b1 + x*L;
+			for (int l = 0; l < nl; ++l) {
+				g[l] = dilate ? std::max(gp[l], s[l]) : std::min(gp[l], s[l]);
+			}
+		}
+		for (int x = end - 2; x >= start; --x) {
+			const float *hn = b0 + (x+1)*L;
+			float *h = b0 + x*L;
+			for (int l = 0; l < nl; ++l) {
+				h[l] = dilate ? std::max(hn[l], h[l]) : std::min(hn[l], h[l]);
+			}
+		}
+	}
+	// the window of sample x is [x-r,x+r]. The result replaces g, which is not used anymore for samples before x+r.
+	for (int x = 0; x < N; ++x) {
+		const float *h = b0 + (x-r)*L;
+		const float *g = b1 + (x+r)*L;
+		float *d = b1 + x*L;
+		for (int l = 0; l < nl; ++l) {
+			d[l] = dilate ? std::max(h[l], g[l]) : std::min(h[l], g[l]);
+		}
+	}
+
+	return b1;
+}
+
+// [internal] van Herk/Gil-Werman filter on a batch of lines, for CImgLineFilterProcessor
+template <bool dilate>
+struct CImgVHGWLines
+{
+	int r;
+
+	int pad() const
+	{
+		return std::max(r, 1);
+	}
+
+	float* operator()(float *b0, float *b1, int N, int nLanes) const
+	{
+		return _cimg_vhgw_apply_lanes<dilate>(b0, b1, N, r, nLanes);
+	}
+};
+
+// [internal] Dilate or erode by the rectangle [-rx,rx]x[-ry,ry].
+template <bool dilate>
+void
+_cimg_morphology_rectangle(cimg_library::CImg<float>& img, const int rx, const int ry)
+{
+	if (rx > 0 && img.width() > 1) {
+		CImgVHGWLines<dilate> f;
+		f.r = rx;
+		CImgLineFilterProcessor<CImgVHGWLines<dilate> > processor(img, 'x', f);
+		processor.process();
+	}
+	if (ry > 0 && img.height() > 1) {
+		CImgVHGWLines<dilate> f;
+		f.r = ry;
+		CImgLineFilterProcessor<CImgVHGWLines<dilate> > processor(img, 'y', f);
+		processor.process();
+	}
+}
+
+// Decompose a symmetric kernel of half-sizes (rx,ry) as a union of rectangles [-w,w]x[-h,h], returned as (w,h) pairs.
+// Each row dy of the kernel is the segment [-w(dy),w(dy)], and w(dy) does not increase with |dy|, so that there is one
+// rectangle per distinct segment length.
+inline void
+cimgMorphologyKernelRectangles(CImgMorphologyKernelEnum kernel, int rx, int ry, std::vector<std::pair<int, int> >* rects)
+{
+	rects->clear();
+	if (kernel == eCImgMorphologyKernelBox || rx <= 0 || ry <= 0) {
+		rects->push_back(std::make_pair(std::max(rx, 0), std::max(ry, 0)));
+		return;
+	}
+	// the kernel contains the pixel centers in the ellipse (or diamond) of half-axes (rx+0.5,ry+0.5)
+	const double ax = rx + 0.5;
+	const double ay = ry + 0.5;
+	int wprev = -1;
+	for (int dy = ry; dy >= 0; --dy) {
+		const double t = dy / ay;
+		const double wf = (kernel == eCImgMorphologyKernelDisk) ? ax * std::sqrt(1. - t * t) : ax * (1. - t);
+		const int w = std::min(rx, (int)std::floor(wf));
+		if (w > wprev) {
+			// dy is the largest row where the segment is at least this long
+			rects->push_back(std::make_pair(w, dy));
+			wprev = w;
+		}
+	}
+}
+
+//! Dilate (or erode) by a box, diamond or disk of half-sizes (rx,ry), with neumann boundary conditions.
+/**
+ The box is separable, and costs the same for any size. The diamond and the disk are unions of boxes,
+ and their cost is proportional to the number of distinct segment lengths in the kernel.
+ The box of half-sizes (rx,ry) gives the same result as CImg<T>::dilate(2*rx+1,2*ry+1) or CImg<T>::erode(2*rx+1,2*ry+1).
+ **/
+template <bool dilate>
+void
+cimgMorphology(cimg_library::CImg<float>& img, CImgMorphologyKernelEnum kernel, int rx, int ry)
+{
+	if (img.is_empty() || (rx <= 0 && ry <= 0)) {
+		return;
+	}
+	std::vector<std::pair<int, int> > rects;
+	cimgMorphologyKernelRectangles(kernel, rx, ry, &rects);
+	if (rects.size() == 1) {
+		_cimg_morphology_rectangle<dilate>(img, rects[0].first, rects[0].second);
+
+		return;
+	}
+	CImgPooledBuffer srcBuffer;
+	CImgPooledBuffer tmpBuffer;
+	cimg_library::CImg<float> src(srcBuffer.allocate(img.size()), img.width(), img.height(), img.depth(), img.spectrum(), true);
+	cimg_library::CImg<float> tmp(tmpBuffer.allocate(img.size()), img.width(), img.height(), img.depth(), img.spectrum(), true);
+	std::copy(img.begin(), img.end(), src.begin());
+	for (size_t i = 0; i < rects.size(); ++i) {
+		cimg_library::CImg<float>& dst = (i == 0) ? img : tmp;
+		if (i != 0) {
+			std::copy(src.begin(), src.end(), tmp.begin());
+		}
+		_cimg_morphology_rectangle<dilate>(dst, rects[i].first, rects[i].second);
+		if (i != 0) {
+			float *d = img.data();
+			const float *s = tmp.data();
+			const size_t n = img.size();
+			for (size_t j = 0; j < n; ++j) {
+				d[j] = dilate ? std::max(d[j], s[j]) : std::min(d[j], s[j]);
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,236 @@
+//
+//  CImgNLMeans.h
+//
+//  Non-local patch averaging, with patch distances computed from integral images, using all threads.
+//
+//  Copyright (c) 2014 OpenFX. All rights reserved.
+//
+
+#ifndef Misc_CImgNLMeans_h
+#define Misc_CImgNLMeans_h
+
+#include "CImgFilter.h"
+#include "CImgBufferPool.h"
+#include "CImgRecursiveFilter.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+// the image is processed by horizontal bands of this height (or of the patch size, if it is larger)
+#define kCImgNLMeansBandHeight 32
+
+// Computes the non-local patch average of one band of rows at a time. The bands are distributed over the threads.
+// For each offset in the lookup window, the squared differences between the image and the image shifted by this
+// offset are summed in an integral image over the band and its halo, so that the distance between two patches costs
+// four lookups, whatever the patch size.
+class CImgNLMeansProcessor : public OFX::MultiThread::Processor
+{
+public:
+	CImgNLMeansProcessor(const cimg_library::CImg<float>& src,
+	                     const cimg_library::CImg<float>& img,
+	                     cimg_library::CImg<float>& res,
+	                     float sigma_s2,
+	                     float sigma_p,
+	                     int patch_size,
+	                     int lookup_size,
+	                     bool is_fast_approx)
+		: _src(src)
+		, _img(img)
+		, _res(res)
+		, _sigma_s2(sigma_s2)
+		, _sigma_p3(3*sigma_p)
+		, _Pnorm(patch_size*patch_size*src.spectrum()*sigma_p*sigma_p)
+		, _psize1(patch_size - patch_size/2 - 1)
+		, _psize2(patch_size/2)
+		, _rsize1(lookup_size - lookup_size/2 - 1)
+		, _rsize2(lookup_size/2)
+		, _bandHeight(std::max(kCImgNLMeansBandHeight, patch_size))
+		, _nBands((src.height() + _bandHeight - 1) / _bandHeight)
+		, _fast(is_fast_approx)
+	{
+	}
+
+	void process()
+	{
+		unsigned int nThreads = 1;
+		if (_src.width() * _src.height() >= kCImgLineFilterMinThreadedSize && !OFX::MultiThread::isSpawnedThread()) {
+			nThreads = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)_nBands);
+		}
+		multiThread(std::max(1u, nThreads));
+	}
+
+private:
+	virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+	{
+		const int W = _src.width();
+		const int H = _src.height();
+		const int C = _src.spectrum();
+		const int P = _psize1 + _psize2 + 1;
+		const int satWidth = W + P;
+		std::vector<double> sat((size_t)(satWidth + 1) * (_bandHeight + P + 1), 0.);
+		std::vector<float> sumWeights((size_t)W * _bandHeight);
+		std::vector<float> maxWeights((size_t)W * _bandHeight);
+		std::vector<float> acc((size_t)W * _bandHeight * C);
+		std::vector<int> col(satWidth), colShifted(satWidth);
+
+		for (int band = threadId; band < _nBands; band += nThreads) {
+			const int y0 = band * _bandHeight;
+			const int y1 = std::min(H, y0 + _bandHeight);
+			std::fill(sumWeights.begin(), sumWeights.end(), 0.f);
+			std::fill(maxWeights.begin(), maxWeights.end(), 0.f);
+			std::fill(acc.begin(), acc.end(), 0.f);
+			for (int dy = -_rsize1; dy <= _rsize2; ++dy) {
+				for (int dx = -_rsize1; dx <= _rsize2; ++dx) {
+					const float spatial = ((float)dx*dx + (float)dy*dy)/_sigma_s2;
+					if ((_fast && spatial > 3) || (!_fast && dx == 0 && dy == 0)) {
+						continue;
+					}
+					// pixels (x,y) of the band whose neighbour (x+dx,y+dy) is in the image
+					const int xa = std::max(0, -dx), xb = std::min(W, W - dx);
+					const int ya = std::max(y0, -dy), yb = std::min(y1, H - dy);
+					if (xa >= xb || ya >= yb) {
+						continue;
+					}
+					// integral image of the squared differences over the patches of these pixels,
+					// with the same neumann boundary conditions as the patches of CImg<T>::blur_patch()
+					const int ew = (xb - xa) + P - 1;
+					const int eh = (yb - ya) + P - 1;
+					for (int i = 0; i < ew; ++i) {
+						const int u = xa - _psize1 + i;
+						col[i] = std::max(0, std::min(W - 1, u));
+						colShifted[i] = std::max(0, std::min(W - 1, u + dx));
+					}
+					for (int j = 0; j < eh; ++j) {
+						const int v = ya - _psize1 + j;
+						const int row = std::max(0, std::min(H - 1, v));
+						const int rowShifted = std::max(0, std::min(H - 1, v + dy));
+						const double *sprev = &sat[(size_t)j * (satWidth + 1)];
+						double *s = &sat[(size_t)(j + 1) * (satWidth + 1)];
+						double rowSum = 0.;
+						for (int i = 0; i < ew; ++i) {
+							float e = 0.f;
+							for (int c = 0; c < C; ++c) {
+								const float dI = _img(col[i], row, 0, c) - _img(colShifted[i], rowShifted, 0, c);
+								e += dI*dI;
+							}
+							rowSum += e;
+							s[i + 1] = sprev[i + 1] + rowSum;
+						}
+					}
+					// accumulate the weighted neighbours
+					for (int y = ya; y < yb; ++y) {
+						const double *s0 = &sat[(size_t)(y - ya) * (satWidth + 1)];
+						const double *s1 = &sat[(size_t)(y - ya + P) * (satWidth + 1)];
+						const float *i0 = _img.data(0, y, 0, 0);
+						const float *i1 = _img.data(0, y + dy, 0, 0);
+						const int bandOffset = (y - y0) * W;
+						for (int x = xa; x < xb; ++x) {
+							if (_fast && !(std::abs(i0[x] - i1[x + dx]) < _sigma_p3)) {
+								continue;
+							}
+							const int i = x - xa;
+							const float distance2 = (float)(s1[i + P] - s1[i] - s0[i + P] + s0[i]) / _Pnorm;
+							const float alldist = distance2 + spatial;
+							float weight;
+							if (_fast) {
+								weight = alldist > 3 ? 0.f : 1.f;
+							} else {
+								weight = (float)std::exp(-alldist);
+								if (weight > maxWeights[bandOffset + x]) {
+									maxWeights[bandOffset + x] = weight;
+								}
+							}
+							sumWeights[bandOffset + x] += weight;
+							for (int c = 0; c < C; ++c) {
+								acc[(size_t)c * W * _bandHeight + bandOffset + x] += weight * _src(x + dx, y + dy, 0, c);
+							}
+						}
+					}
+				}
+			}
+			// normalize. In the exact version, the weight of the pixel itself is the largest weight of its neighbours.
+			for (int y = y0; y < y1; ++y) {
+				const int bandOffset = (y - y0) * W;
+				for (int x = 0; x < W; ++x) {
+					float sum = sumWeights[bandOffset + x];
+					const float wmax = maxWeights[bandOffset + x];
+					if (!_fast) {
+						sum += wmax;
+					}
+					for (int c = 0; c < C; ++c) {
+						float a = acc[(size_t)c * W * _bandHeight + bandOffset + x];
+						if (!_fast) {
+							a += wmax * _src(x, y, 0, c);
+						}
+						_res(x, y, 0, c) = (sum > 0) ? a / sum : _src(x, y, 0, c);
+					}
+				}
+			}
+		}
+	}
+
+	const cimg_library::CImg<float>& _src;
+	const cimg_library::CImg<float>& _img;
+	cimg_library::CImg<float>& _res;
+	float _sigma_s2;
+	float _sigma_p3;
+	float _Pnorm;
+	int _psize1;
+	int _psize2;
+	int _rsize1;
+	int _rsize2;
+	int _bandHeight;
+	int _nBands;
+	bool _fast;
+};
+
+//! Blur image using patch-based space (non-local means).
+/**
+ This computes the same result as CImg<T>::blur_patch() on 2D images, up to rounding errors: the squared differences
+ between patches are summed in integral images, one per offset in the lookup window, so that the cost does not depend
+ on the patch size, and the image is processed by bands of rows, using all threads.
+ \param sigma_s standard deviation of the spatial kernel, in pixels (or in percent of the image size if negative)
+ \param sigma_p standard deviation of the patch distance
+ \param patch_size size of the patches
+ \param lookup_size size of the window to search similar patches
+ \param smoothness standard deviation of the blur applied to the image before comparing patches
+ \param is_fast_approx use a box kernel instead of a gaussian kernel, and only compare pixels whose values are close
+ **/
+inline void
+cimgNLMeans(cimg_library::CImg<float>& img, const float sigma_s, const float sigma_p, const unsigned int patch_size,
+            const unsigned int lookup_size, const float smoothness, const bool is_fast_approx)
+{
+	if (img.is_empty() || !patch_size || !lookup_size) {
+		return;
+	}
+	if (img.depth() > 1) {
+		img.blur_patch(sigma_s, sigma_p, patch_size, lookup_size, smoothness, is_fast_approx);
+
+		return;
+	}
+	const float nsigma_s = sigma_s >= 0 ? sigma_s : -sigma_s*std::max(img.width(), img.height())/100;
+
+	// the patches are compared on a smoothed copy of the image
+	CImgPooledBuffer smoothBuffer;
+	cimg_library::CImg<float> smooth;
+	if (smoothness > 0) {
+		smooth.assign(smoothBuffer.allocate(img.size()), img.width(), img.height(), img.depth(), img.spectrum(), true);
+		std::copy(img.begin(), img.end(), smooth.begin());
+		if (smooth.width() > 1) {
+			deriche(smooth, smoothness, 0, 'x', true);
+		}
+		if (smooth.height() > 1) {
+			deriche(smooth, smoothness, 0, 'y', true);
+		}
+	}
+	CImgPooledBuffer resBuffer;
+	cimg_library::CImg<float> res(resBuffer.allocate(img.size()), img.width(), img.height(), img.depth(), img.spectrum(), true);
+	CImgNLMeansProcessor processor(img, smoothness > 0 ? smooth : img, res, nsigma_s*nsigma_s, sigma_p,
+	                               (int)patch_size, (int)lookup_size, is_fast_approx);
+	processor.process();
+	std::copy(res.begin(), res.end(), img.begin());
+}
+
+#endif
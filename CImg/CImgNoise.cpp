@@ -86,20 +86,23 @@
 #include "ofxsCopier.h"
 
 #include "CImgFilter.h"
+#include "CImgRandom.h"
 
 #define kPluginName          "NoiseCImg"
 #define kPluginGrouping      "Draw"
 #define kPluginDescription \
 "Add random noise to input stream.\n" \
-"Note that each render gives a different noise.\n" \
-"Uses the 'noise' function from the CImg library.\n" \
+"The noise depends on the seed, the frame and the pixel position, so that any part of the image, rendered in any order, " \
+"by any number of threads or computers, always gives the same result.\n" \
+"Salt & pepper noise sets pixels to 0 or 1.\n" \
+"Based on the 'noise' function from the CImg library.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
 
 #define kPluginIdentifier    "net.sf.cimg.CImgNoise"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -140,6 +143,11 @@ enum TypeEnum
     eTypeRice,
 };
 
+#define kParamSeed "seed"
+#define kParamSeedLabel "Seed"
+#define kParamSeedHint "Random seed: change this if you want different instances to have different noise."
+#define kParamSeedDefault 2000
+
 
 using namespace OFX;
 
@@ -148,6 +156,7 @@ struct CImgNoiseParams
 {
     double sigma;
     int type_i;
+    int seed;
 };
 
 class CImgNoisePlugin : public CImgFilterPluginHelper<CImgNoiseParams,true>
@@ -159,13 +168,15 @@ public:
     {
         _sigma  = fetchDoubleParam(kParamSigma);
         _type = fetchChoiceParam(kParamType);
-        assert(_sigma && _type);
+        _seed = fetchIntParam(kParamSeed);
+        assert(_sigma && _type && _seed);
     }
 
     virtual void getValuesAtTime(double time, CImgNoiseParams& params) OVERRIDE FINAL
     {
         _sigma->getValueAtTime(time, params.sigma);
         _type->getValueAtTime(time, params.type_i);
+        _seed->getValueAtTime(time, params.seed);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
@@ -178,7 +189,7 @@ public:
         roi->y2 = rect.y2;
     }
 
-    virtual void render(const OFX::RenderArguments &args, const CImgNoiseParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
+    virtual void render(const OFX::RenderArguments &args, const CImgNoiseParams& params, int x1, int y1, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
@@ -186,7 +197,8 @@ public:
         if (params.type_i == eTypePoisson) {
             cimg /= params.sigma;
         }
-        cimg.noise(params.sigma * std::sqrt(args.renderScale.x), params.type_i);
+        // the noise only depends on the seed, the time and the pixel position, so that tiles are seamless
+        cimgNoise(cimg, (float)(params.sigma * std::sqrt(args.renderScale.x)), params.type_i, cimgRandomSeed(params.seed, args.time), x1, y1);
         if (params.type_i == eTypePoisson) {
             cimg *= params.sigma;
         }
@@ -208,6 +220,7 @@ private:
     // params
     OFX::DoubleParam *_sigma;
     OFX::ChoiceParam *_type;
+    OFX::IntParam *_seed;
 };
 
 
@@ -283,6 +296,17 @@ void CImgNoisePluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc,
         }
     }
 
+    {
+        OFX::IntParamDescriptor *param = desc.defineIntParam(kParamSeed);
+        param->setLabel(kParamSeedLabel);
+        param->setHint(kParamSeedHint);
+        param->setDefault(kParamSeedDefault);
+        param->setAnimates(true); // can animate
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     CImgNoisePlugin::describeInContextEnd(desc, context, page);
 }
 
@@ -14,10 +14,16 @@
 #include "ofxsMacros.h"
 #include "ofxsPixelProcessor.h"
 #include "ofxsCopier.h"
+#include "ofxsMaskMix.h"
 #include "ofxsMerging.h"
+#include "ofxsMultiThread.h"
+#include "CImgBufferPool.h"
 
 #include <cassert>
+#include <algorithm>
+#include <cstddef>
 #include <memory>
+#include <vector>
 
 //#define CIMG_DEBUG
 
@@ -34,6 +40,30 @@ CLANG_DIAG_OFF(shorten-64-to-32)
 #include "CImg.h"
 CLANG_DIAG_ON(shorten-64-to-32)
 
+// If the plugin supports tiles, the render window is split into horizontal bands that are rendered concurrently,
+// each with its own halo. A band is at least this high, and at least as high as its halo.
+#define kCImgOperatorMinBandHeight 32
+
+// An interleaved float image the tiles are extracted from: either the image given by the host,
+// or a copy of it with boundary conditions and unpremultiplied colors.
+struct CImgOperatorSource
+{
+    const void *pixelData; //!< NULL if the input is black and transparent
+    OfxRectI bounds;
+    int rowBytes;
+    bool unpremult; //!< the image is premultiplied RGBA, and colors are unpremultiplied when the tiles are extracted
+    int premultChannel;
+};
+
+// A part of the render window, rendered with its own halo
+struct CImgOperatorTile
+{
+    OfxRectI window; //!< the pixels that have to be computed
+    OfxRectI roi; //!< window plus halo, the area covered by the cimgs
+    CImgPooledBuffer bufferA; //!< the storage of srcA, which is also the storage of dst
+    CImgPooledBuffer bufferB; //!< the storage of srcB
+};
+
 template <class Params>
 class CImgOperatorPluginHelper : public OFX::ImageEffect
 {
@@ -83,6 +113,9 @@ public:
 
     virtual bool isIdentity(const OFX::IsIdentityArguments &args, OFX::Clip* &identityClip, double &identityTime) OVERRIDE FINAL;
 
+    // free the buffers kept by the CImg buffer pool
+    virtual void purgeCaches() OVERRIDE FINAL { cimgBufferPool().purge(); }
+
     virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL
     {
         if (clipName == _srcAClipName && _srcAClip && args.reason == OFX::eChangeUserEdit) {
@@ -126,6 +159,10 @@ public:
 
     virtual bool getRoD(const OfxRectI& /*srcARoD*/, const OfxRectI& /*srcBRoD*/, const OfxPointD& /*renderScale*/, const Params& /*params*/, OfxRectI* /*dstRoD*/) { return false; };
 
+    // compute dst from srcA and srcB, which cover the same area, with (x1,y1) as the origin.
+    // On input, dst shares its pixels with srcA, so that filters that process srcA in place need no copy:
+    // a plugin that reads srcA after writing to dst must make a copy of srcA first.
+    // If the plugin supports tiles, this may be called concurrently on several bands of the render window.
     virtual void render(const cimg_library::CImg<float>& srcA, const cimg_library::CImg<float>& srcB, const OFX::RenderArguments &args, const Params& params, int x1, int y1, cimg_library::CImg<float>& dst) = 0;
 
     // returns 0 (no identity), 1 (dst:=dstA) or 2 (dst:=srcB)
@@ -237,8 +274,86 @@ private:
                  bool premult,
                  int premultChannel);
 
+    // make the pixels of an input over srcRoI available as an interleaved float image: the image given by the host
+    // is used directly if it covers srcRoI and does not need to be unpremultiplied, else it is copied to tmpData
+    void
+    setupSource(double time,
+                const OfxRectI &srcRoI,
+                const void *srcPixelData,
+                const OfxRectI& srcBounds,
+                OFX::PixelComponentEnum srcPixelComponents,
+                int srcPixelComponentCount,
+                OFX::BitDepthEnum srcBitDepth,
+                int srcRowBytes,
+                int srcBoundary,
+                bool premult,
+                int premultChannel,
+                std::auto_ptr<OFX::ImageMemory>& tmpData,
+                CImgOperatorSource* source);
+
+    // render one tile: extract srcA and srcB from the sources, process them, and copy the window of the result to tmp
+    void
+    renderTile(const OFX::RenderArguments &args,
+               const Params& params,
+               const CImgOperatorSource& sourceA,
+               const CImgOperatorSource& sourceB,
+               int srcNComponents,
+               float *tmpPixelData,
+               const OfxRectI& tmpBounds,
+               CImgOperatorTile* tile);
+
+    // renders a set of tiles using all threads
+    class TileProcessor : public OFX::MultiThread::Processor
+    {
+    public:
+        TileProcessor(CImgOperatorPluginHelper &effect,
+                      const OFX::RenderArguments &args,
+                      const Params& params,
+                      const CImgOperatorSource& sourceA,
+                      const CImgOperatorSource& sourceB,
+                      int srcNComponents,
+                      float *tmpPixelData,
+                      const OfxRectI& tmpBounds,
+                      std::vector<CImgOperatorTile>& tiles)
+        : _effect(effect)
+        , _args(args)
+        , _params(params)
+        , _sourceA(sourceA)
+        , _sourceB(sourceB)
+        , _srcNComponents(srcNComponents)
+        , _tmpPixelData(tmpPixelData)
+        , _tmpBounds(tmpBounds)
+        , _tiles(tiles)
+        {
+        }
+
+        void process() { multiThread((unsigned int)_tiles.size()); }
+
+    private:
+        virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+        {
+            for (size_t i = threadId; i < _tiles.size(); i += nThreads) {
+                if (_effect.abort()) {
+                    return;
+                }
+                _effect.renderTile(_args, _params, _sourceA, _sourceB, _srcNComponents, _tmpPixelData, _tmpBounds, &_tiles[i]);
+            }
+        }
+
+        CImgOperatorPluginHelper &_effect;
+        const OFX::RenderArguments &_args;
+        const Params& _params;
+        const CImgOperatorSource& _sourceA;
+        const CImgOperatorSource& _sourceB;
+        int _srcNComponents;
+        float *_tmpPixelData;
+        const OfxRectI& _tmpBounds;
+        std::vector<CImgOperatorTile>& _tiles;
+    };
 
     // utility functions
+    static void
+    extractTile(const CImgOperatorSource& source, const OfxRectI& roi, int srcNComponents, cimg_library::CImg<float>& cimg);
 
 
 private:
@@ -342,6 +457,163 @@ CImgOperatorPluginHelper<Params>::setupAndCopy(OFX::PixelProcessorFilterBase & p
 }
 
 
+template <class Params>
+void
+CImgOperatorPluginHelper<Params>::setupSource(double time,
+                                              const OfxRectI &srcRoI,
+                                              const void *srcPixelData,
+                                              const OfxRectI& srcBounds,
+                                              OFX::PixelComponentEnum srcPixelComponents,
+                                              int srcPixelComponentCount,
+                                              OFX::BitDepthEnum srcBitDepth,
+                                              int srcRowBytes,
+                                              int srcBoundary,
+                                              bool premult,
+                                              int premultChannel,
+                                              std::auto_ptr<OFX::ImageMemory>& tmpData,
+                                              CImgOperatorSource* source)
+{
+    source->unpremult = false;
+    source->premultChannel = premultChannel;
+    if (!srcPixelData || isEmpty(srcRoI)) {
+        // no src, black & transparent
+        source->pixelData = NULL;
+        source->bounds = srcRoI;
+        source->rowBytes = 0;
+
+        return;
+    }
+    if (srcBounds.x1 <= srcRoI.x1 && srcRoI.x2 <= srcBounds.x2 &&
+        srcBounds.y1 <= srcRoI.y1 && srcRoI.y2 <= srcBounds.y2) {
+        // no boundary conditions: the tiles are extracted directly from src, and unpremultiplied on the fly
+        source->pixelData = srcPixelData;
+        source->bounds = srcBounds;
+        source->rowBytes = srcRowBytes;
+        source->unpremult = premult && srcPixelComponents == OFX::ePixelComponentRGBA;
+
+        return;
+    }
+
+    // copy & unpremult all channels from srcRoI, from src to a tmp image of size srcRoI
+    const OFX::BitDepthEnum tmpBitDepth = OFX::eBitDepthFloat;
+    const int tmpRowBytes = srcPixelComponentCount * getComponentBytes(tmpBitDepth) * (srcRoI.x2 - srcRoI.x1);
+    const size_t tmpSize = (size_t)tmpRowBytes * (srcRoI.y2 - srcRoI.y1);
+    assert(tmpSize > 0);
+    tmpData.reset(new OFX::ImageMemory(tmpSize, this));
+    float *tmpPixelData = (float*)tmpData->lock();
+
+    std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
+    if (srcPixelComponents == OFX::ePixelComponentRGBA) {
+        fred.reset(new OFX::PixelCopierUnPremult<float, 4, 1, float, 4, 1>(*this));
+    } else if (srcPixelComponentCount == 4) {
+        // just copy, no premult
+        fred.reset(new OFX::PixelCopier<float, 4>(*this));
+    } else if (srcPixelComponentCount == 3) {
+        // just copy, no premult
+        fred.reset(new OFX::PixelCopier<float, 3>(*this));
+    } else if (srcPixelComponentCount == 2) {
+        // just copy, no premult
+        fred.reset(new OFX::PixelCopier<float, 2>(*this));
+    }  else if (srcPixelComponentCount == 1) {
+        // just copy, no premult
+        fred.reset(new OFX::PixelCopier<float, 1>(*this));
+    }
+    setupAndCopy(*fred, time, srcRoI,
+                 srcPixelData, srcBounds, srcPixelComponents, srcPixelComponentCount, srcBitDepth, srcRowBytes, srcBoundary,
+                 tmpPixelData, srcRoI, srcPixelComponents, srcPixelComponentCount, tmpBitDepth, tmpRowBytes,
+                 premult, premultChannel);
+    source->pixelData = tmpPixelData;
+    source->bounds = srcRoI;
+    source->rowBytes = tmpRowBytes;
+}
+
+
+template <class Params>
+void
+CImgOperatorPluginHelper<Params>::extractTile(const CImgOperatorSource& source,
+                                              const OfxRectI& roi,
+                                              int srcNComponents,
+                                              cimg_library::CImg<float>& cimg)
+{
+    if (!source.pixelData) {
+        cimg.fill(0.f);
+
+        return;
+    }
+    if (source.unpremult) {
+        // interleaved to coplanar conversion, and unpremult
+        assert(srcNComponents == 4 && cimg.spectrum() == 4);
+        const size_t planeSize = (size_t)cimg.width() * cimg.height();
+        float *dst = cimg.data();
+        for (int y = roi.y1; y < roi.y2; ++y) {
+            const float *src = (const float*)((const char*)source.pixelData + (ptrdiff_t)(y - source.bounds.y1) * source.rowBytes) + (size_t)(roi.x1 - source.bounds.x1) * 4;
+            for (int x = roi.x2 - roi.x1; x; --x, src += 4, ++dst) {
+                float unpPix[4];
+                ofxsUnPremult<float, 4, 1>(src, unpPix, true, source.premultChannel);
+                dst[0] = unpPix[0];
+                dst[planeSize] = unpPix[1];
+                dst[2 * planeSize] = unpPix[2];
+                dst[3 * planeSize] = unpPix[3];
+            }
+        }
+
+        return;
+    }
+    // interleaved to coplanar conversion
+    for (int c = 0; c < cimg.spectrum(); ++c) {
+        float *dst = cimg.data(0, 0, 0, c);
+        for (int y = roi.y1; y < roi.y2; ++y) {
+            const float *src = (const float*)((const char*)source.pixelData + (ptrdiff_t)(y - source.bounds.y1) * source.rowBytes) + (size_t)(roi.x1 - source.bounds.x1) * srcNComponents + c;
+            for (int x = roi.x2 - roi.x1; x; --x, src += srcNComponents, ++dst) {
+                *dst = *src;
+            }
+        }
+    }
+}
+
+
+template <class Params>
+void
+CImgOperatorPluginHelper<Params>::renderTile(const OFX::RenderArguments &args,
+                                             const Params& params,
+                                             const CImgOperatorSource& sourceA,
+                                             const CImgOperatorSource& sourceB,
+                                             int srcNComponents,
+                                             float *tmpPixelData,
+                                             const OfxRectI& tmpBounds,
+                                             CImgOperatorTile* tile)
+{
+    const int cimgSpectrum = srcNComponents;
+    const int cimgWidth = tile->roi.x2 - tile->roi.x1;
+    const int cimgHeight = tile->roi.y2 - tile->roi.y1;
+    const size_t cimgSize = (size_t)cimgWidth * cimgHeight * cimgSpectrum;
+
+    cimg_library::CImg<float> cimgA(tile->bufferA.allocate(cimgSize), cimgWidth, cimgHeight, 1, cimgSpectrum, true);
+    extractTile(sourceA, tile->roi, srcNComponents, cimgA);
+    cimg_library::CImg<float> cimgB(tile->bufferB.allocate(cimgSize), cimgWidth, cimgHeight, 1, cimgSpectrum, true);
+    extractTile(sourceB, tile->roi, srcNComponents, cimgB);
+
+    // the result is computed in place, in the buffer of srcA
+    cimg_library::CImg<float> cimg(cimgA.data(), cimgWidth, cimgHeight, 1, cimgSpectrum, true);
+    printRectI("render tile roi", tile->roi);
+    render(cimgA, cimgB, args, params, tile->roi.x1, tile->roi.y1, cimg);
+    // check that the dimensions didn't change
+    assert(cimg.width() == cimgWidth && cimg.height() == cimgHeight && cimg.depth() == 1 && cimg.spectrum() == cimgSpectrum);
+
+    // copy back the window of the tile to tmp (the windows of the tiles do not overlap)
+    const int tmpWidth = tmpBounds.x2 - tmpBounds.x1;
+    for (int c = 0; c < cimgSpectrum; ++c) {
+        for (int y = tile->window.y1; y < tile->window.y2; ++y) {
+            const float *src = cimg.data(tile->window.x1 - tile->roi.x1, y - tile->roi.y1, 0, c);
+            float *dst = tmpPixelData + ((size_t)(y - tmpBounds.y1) * tmpWidth + (tile->window.x1 - tmpBounds.x1)) * srcNComponents + c;
+            for (int x = tile->window.x2 - tile->window.x1; x; --x, ++src, dst += srcNComponents) {
+                *dst = *src;
+            }
+        }
+    }
+}
+
+
 template <class Params>
 void
 CImgOperatorPluginHelper<Params>::render(const OFX::RenderArguments &args)
@@ -515,9 +787,20 @@ CImgOperatorPluginHelper<Params>::render(const OFX::RenderArguments &args)
     printRectI("dstBounds",dstBounds);
     printRectI("renderWindow",renderWindow);
 
+    // the host may ask for pixels outside of the output RoD, which are black and transparent:
+    // only the intersection of the renderWindow with the RoD is processed
+    OfxRectI processWindow;
+    if (!OFX::MergeImages2D::rectIntersection(renderWindow, dstRoD, &processWindow)) {
+        processWindow.x1 = processWindow.x2 = renderWindow.x1;
+        processWindow.y1 = processWindow.y2 = renderWindow.y1;
+    }
+    printRectI("processWindow",processWindow);
+
     // compute the src ROI (should be consistent with getRegionsOfInterest())
-    OfxRectI srcRoI;
-    getRoI(renderWindow, renderScale, params, &srcRoI);
+    OfxRectI srcRoI = processWindow;
+    if (!isEmpty(processWindow)) {
+        getRoI(processWindow, renderScale, params, &srcRoI);
+    }
 
     // intersect against the destination RoD
     OFX::MergeImages2D::rectIntersection(srcRoI, dstRoD, &srcRoI);
@@ -542,157 +825,95 @@ CImgOperatorPluginHelper<Params>::render(const OFX::RenderArguments &args)
                           ((srcAPixelComponents == OFX::ePixelComponentRGB) ? 3 : 4));
 
     // from here on, we do the following steps:
-    // 1- copy & unpremult all channels from srcRoI, from src to a tmp image of size srcRoI
-    // 2- extract channels to be processed from tmp to a cimg of size srcRoI (and do the interleaved to coplanar conversion)
-    // 3- process the cimg
-    // 4- copy back the processed channels from the cImg to tmp. only processWindow has to be copied
-    // 5- copy+premult+max+mix tmp to dst (only processWindow)
+    // 1- make srcA and srcB available over srcRoI as interleaved images (copy & unpremult them only if necessary)
+    // 2- split the processWindow into bands if the plugin supports tiles, each with its own halo
+    // 3- for each band, concurrently: extract the channels from the srcA and srcB images to cimgs (and do the
+    //    interleaved to coplanar conversion), process them, and copy back the band to a tmp image of size renderWindow
+    //    (the part of tmp outside of processWindow is black)
+    // 4- copy+premult tmp to dst
 
     //////////////////////////////////////////////////////////////////////////////////////////
-    // 1- copy & unpremult all channels from srcRoI, from src to a tmp image of size srcRoI
+    // 1- make srcA and srcB available over srcRoI as interleaved images (copy & unpremult them only if necessary)
+
+    CImgOperatorSource sourceA;
+    std::auto_ptr<OFX::ImageMemory> tmpAData;
+    setupSource(time, srcRoI,
+                srcAPixelData, srcABounds, srcAPixelComponents, srcAPixelComponentCount, srcABitDepth, srcARowBytes, srcBoundary,
+                premult, premultChannel, tmpAData, &sourceA);
 
-    const OfxRectI tmpBounds = srcRoI;
+    CImgOperatorSource sourceB;
+    std::auto_ptr<OFX::ImageMemory> tmpBData;
+    setupSource(time, srcRoI,
+                srcBPixelData, srcBBounds, srcBPixelComponents, srcBPixelComponentCount, srcBBitDepth, srcBRowBytes, srcBoundary,
+                premult, premultChannel, tmpBData, &sourceB);
+
+    const OfxRectI tmpBounds = renderWindow;
     const OFX::PixelComponentEnum tmpPixelComponents = dstPixelComponents;
     const int tmpPixelComponentCount = dstPixelComponentCount;
     const OFX::BitDepthEnum tmpBitDepth = OFX::eBitDepthFloat;
     const int tmpWidth = tmpBounds.x2 - tmpBounds.x1;
     const int tmpHeight = tmpBounds.y2 - tmpBounds.y1;
     const int tmpRowBytes = tmpPixelComponentCount * getComponentBytes(tmpBitDepth) * tmpWidth;
-    size_t tmpSize = tmpRowBytes * tmpHeight;
+    size_t tmpSize = (size_t)tmpRowBytes * tmpHeight;
 
     assert(tmpSize > 0);
-    std::auto_ptr<OFX::ImageMemory> tmpAData(new OFX::ImageMemory(tmpSize, this));
-    float *tmpAPixelData = (float*)tmpAData->lock();
-
-    {
-        std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
-        if (!srcA.get()) {
-            // no src, fill with black & transparent
-                fred.reset(new OFX::BlackFiller<float>(*this, dstPixelComponentCount));
-        } else {
-            if (dstPixelComponents == OFX::ePixelComponentRGBA) {
-                fred.reset(new OFX::PixelCopierUnPremult<float, 4, 1, float, 4, 1>(*this));
-            } else if (dstPixelComponentCount == 4) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 4>(*this));
-            } else if (dstPixelComponentCount == 3) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 3>(*this));
-            } else if (dstPixelComponentCount == 2) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 2>(*this));
-            }  else if (dstPixelComponentCount == 1) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 1>(*this));
-            }
-        }
-        setupAndCopy(*fred, time, srcRoI,
-                     srcAPixelData, srcABounds, srcAPixelComponents, srcAPixelComponentCount, srcABitDepth, srcARowBytes, srcBoundary,
-                     tmpAPixelData, tmpBounds, tmpPixelComponents, tmpPixelComponentCount, tmpBitDepth, tmpRowBytes,
-                     premult, premultChannel);
-    }
-    
-    std::auto_ptr<OFX::ImageMemory> tmpBData(new OFX::ImageMemory(tmpSize, this));
-    float *tmpBPixelData = (float*)tmpBData->lock();
-
-    {
-        std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
-        if (!srcB.get()) {
-            // no src, fill with black & transparent
-            if (dstPixelComponentCount == 4) {
-                fred.reset(new OFX::BlackFiller<float>(*this, 4));
-            } else if (dstPixelComponentCount == 3) {
-                fred.reset(new OFX::BlackFiller<float>(*this, 3));
-            } else if (dstPixelComponentCount == 2) {
-                fred.reset(new OFX::BlackFiller<float>(*this, 2));
-            } else if (dstPixelComponentCount == 1) {
-                fred.reset(new OFX::BlackFiller<float>(*this, 1));
-            }
-        } else {
-            if (dstPixelComponents == OFX::ePixelComponentRGBA) {
-                fred.reset(new OFX::PixelCopierUnPremult<float, 4, 1, float, 4, 1>(*this));
-            } else if (dstPixelComponentCount == 4) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 4>(*this));
-           } else if (dstPixelComponentCount == 3) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 3>(*this));
-            } else if (dstPixelComponentCount == 2) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 2>(*this));
-            }  else if (dstPixelComponentCount == 1) {
-                // just copy, no premult
-                fred.reset(new OFX::PixelCopier<float, 1>(*this));
-            }
-        }
-        setupAndCopy(*fred, time, srcRoI,
-                     srcBPixelData, srcBBounds, srcBPixelComponents, srcBPixelComponentCount, srcBBitDepth, srcBRowBytes, srcBoundary,
-                     tmpBPixelData, tmpBounds, tmpPixelComponents, tmpPixelComponentCount, tmpBitDepth, tmpRowBytes,
-                     premult, premultChannel);
-    }
-
     std::auto_ptr<OFX::ImageMemory> tmpData(new OFX::ImageMemory(tmpSize, this));
     float *tmpPixelData = (float*)tmpData->lock();
+    if (processWindow.x1 != renderWindow.x1 || processWindow.x2 != renderWindow.x2 ||
+        processWindow.y1 != renderWindow.y1 || processWindow.y2 != renderWindow.y2) {
+        std::fill(tmpPixelData, tmpPixelData + tmpSize / sizeof(float), 0.f);
+    }
 
-    //////////////////////////////////////////////////////////////////////////////////////////
-    // 2- extract channels to be processed from tmp to a cimg of size srcRoI (and do the interleaved to coplanar conversion)
-
-    // allocate the cimg data to hold the src ROI
-    const int cimgSpectrum = srcNComponents;
     const int cimgWidth = srcRoI.x2 - srcRoI.x1;
     const int cimgHeight = srcRoI.y2 - srcRoI.y1;
-    const size_t cimgSize = cimgWidth * cimgHeight * cimgSpectrum * sizeof(float);
+    const size_t cimgSize = cimgWidth * cimgHeight * srcNComponents * sizeof(float);
 
-
-    if (cimgSize) { // may be zero if no channel is processed
-        std::auto_ptr<OFX::ImageMemory> cimgAData(new OFX::ImageMemory(cimgSize, this));
-        float *cimgAPixelData = (float*)cimgAData->lock();
-        cimg_library::CImg<float> cimgA(cimgAPixelData, cimgWidth, cimgHeight, 1, cimgSpectrum, true);
-
-        for (int c=0; c < cimgSpectrum; ++c) {
-            float *dst = cimgA.data(0,0,0,c);
-            const float *src = tmpAPixelData + c;
-            for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, src += srcNComponents, ++dst) {
-                *dst = *src;
+    if (cimgSize && !isEmpty(processWindow)) { // may be zero if no channel is processed
+        //////////////////////////////////////////////////////////////////////////////////////////
+        // 2- split the processWindow into bands if the plugin supports tiles, each with its own halo
+        std::vector<CImgOperatorTile> tiles;
+        {
+            unsigned int nTiles = 1;
+            if (_supportsTiles) {
+                // the halo is the part of the RoI above and below the processWindow
+                OfxRectI fullRoI;
+                getRoI(processWindow, renderScale, params, &fullRoI);
+                const long long haloHeight = std::max(0LL, (long long)processWindow.y1 - fullRoI.y1) + std::max(0LL, (long long)fullRoI.y2 - processWindow.y2);
+                const long long minBandHeight = std::max((long long)kCImgOperatorMinBandHeight, haloHeight);
+                nTiles = std::max(1u, std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)((processWindow.y2 - processWindow.y1) / minBandHeight)));
             }
-        }
-
-        std::auto_ptr<OFX::ImageMemory> cimgBData(new OFX::ImageMemory(cimgSize, this));
-        float *cimgBPixelData = (float*)cimgBData->lock();
-        cimg_library::CImg<float> cimgB(cimgBPixelData, cimgWidth, cimgHeight, 1, cimgSpectrum, true);
-
-        for (int c=0; c < cimgSpectrum; ++c) {
-            float *dst = cimgB.data(0,0,0,c);
-            const float *src = tmpBPixelData + c;
-            for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, src += srcNComponents, ++dst) {
-                *dst = *src;
+            tiles.resize(nTiles);
+            const int height = processWindow.y2 - processWindow.y1;
+            for (unsigned int i = 0; i < nTiles; ++i) {
+                CImgOperatorTile& tile = tiles[i];
+                tile.window = processWindow;
+                tile.window.y1 = processWindow.y1 + (int)(((long long)height * i) / nTiles);
+                tile.window.y2 = processWindow.y1 + (int)(((long long)height * (i + 1)) / nTiles);
+                if (nTiles == 1) {
+                    tile.roi = srcRoI;
+                } else {
+                    getRoI(tile.window, renderScale, params, &tile.roi);
+                    OFX::MergeImages2D::rectIntersection(tile.roi, srcRoI, &tile.roi);
+                }
+                // the window is within the RoD, and the RoI of a window contains it
+                assert(tile.roi.x1 <= tile.window.x1 && tile.window.x2 <= tile.roi.x2 &&
+                       tile.roi.y1 <= tile.window.y1 && tile.window.y2 <= tile.roi.y2);
             }
         }
-        
-        //////////////////////////////////////////////////////////////////////////////////////////
-        // 3- process the cimg
-        printRectI("render srcRoI", srcRoI);
-        cimg_library::CImg<float> cimg;
-        render(cimgA, cimgB, args, params, srcRoI.x1, srcRoI.y1, cimg);
-        // check that the dimensions didn't change
-        assert(cimg.width() == cimgWidth && cimg.height() == cimgHeight && cimg.depth() == 1 && cimg.spectrum() == cimgSpectrum);
 
         //////////////////////////////////////////////////////////////////////////////////////////
-        // 4- copy back the processed channels from the cImg to tmp. only processWindow has to be copied
-
-        // We copy the whole srcRoI. This could be optimized to copy only renderWindow
-        for (int c=0; c < cimgSpectrum; ++c) {
-            const float *src = cimg.data(0,0,0,c);
-            float *dst = tmpPixelData + c;
-            for (unsigned int siz = cimgWidth * cimgHeight; siz; --siz, ++src, dst += srcNComponents) {
-                *dst = *src;
-            }
+        // 3- process the cimgs (one pair per tile), and copy back the tiles to tmp
+        printRectI("render srcRoI", srcRoI);
+        if (tiles.size() == 1) {
+            renderTile(args, params, sourceA, sourceB, srcNComponents, tmpPixelData, tmpBounds, &tiles[0]);
+        } else {
+            TileProcessor processor(*this, args, params, sourceA, sourceB, srcNComponents, tmpPixelData, tmpBounds, tiles);
+            processor.process();
         }
-
     }
 
     //////////////////////////////////////////////////////////////////////////////////////////
-    // 5- copy+premult+max+mix tmp to dst (only processWindow)
+    // 4- copy+premult tmp to dst
 
     {
         std::auto_ptr<OFX::PixelProcessorFilterBase> fred;
@@ -73,6 +73,7 @@
 #include "CImgPlasma.h"
 
 #include <memory>
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #ifdef _WINDOWS
@@ -86,22 +87,24 @@
 #include "ofxsCopier.h"
 
 #include "CImgFilter.h"
+#include "CImgRandom.h"
 
 #define kPluginName          "PlasmaCImg"
 #define kPluginGrouping      "Draw"
 #define kPluginDescription \
 "Draw a random plasma texture (using the mid-point algorithm).\n" \
-"Note that each render gives a different noise.\n" \
-"Uses the 'draw_plasma' function from the CImg library.\n" \
+"The texture depends on the seed, the frame and the pixel position, so that any part of the image, rendered in any order, " \
+"by any number of threads or computers, always gives the same result. The texture is added to the input image.\n" \
+"Based on the 'draw_plasma' function from the CImg library.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
 
 #define kPluginIdentifier    "net.sf.cimg.CImgPlasma"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0 // Plasma effect can only be computed on the whole image
+#define kSupportsTiles 1
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
 #define kSupportsMultipleClipPARs false
@@ -114,7 +117,7 @@
 
 #define kParamAlpha "alpha"
 #define kParamAlphaLabel "Alpha"
-#define kParamAlphaHint "Alpha-parameter, in intensity units (>=0)."
+#define kParamAlphaHint "Alpha-parameter, in intensity units per pixel of the cell size (>=0)."
 #define kParamAlphaDefault 0.002 // 0.5/255
 #define kParamAlphaMin 0.
 #define kParamAlphaMax 0.02 // 5./255
@@ -130,11 +133,16 @@
 
 #define kParamScale "scale"
 #define kParamScaleLabel "Scale"
-#define kParamScaleHint "Scale, in pixels (>=0)."
+#define kParamScaleHint "Scale: the coarsest cells of the plasma are 2^scale pixels wide (>=0)."
 #define kParamScaleDefault 8
 #define kParamScaleMin 2
 #define kParamScaleMax 10
 
+#define kParamSeed "seed"
+#define kParamSeedLabel "Seed"
+#define kParamSeedHint "Random seed: change this if you want different instances to have different noise."
+#define kParamSeedDefault 2000
+
 
 using namespace OFX;
 
@@ -144,6 +152,7 @@ struct CImgPlasmaParams
     double alpha;
     double beta;
     int scale;
+    int seed;
 };
 
 class CImgPlasmaPlugin : public CImgFilterPluginHelper<CImgPlasmaParams,true>
@@ -156,7 +165,8 @@ public:
         _alpha  = fetchDoubleParam(kParamAlpha);
         _beta  = fetchDoubleParam(kParamBeta);
         _scale = fetchIntParam(kParamScale);
-        assert(_alpha && _beta && _scale);
+        _seed = fetchIntParam(kParamSeed);
+        assert(_alpha && _beta && _scale && _seed);
     }
 
     virtual void getValuesAtTime(double time, CImgPlasmaParams& params) OVERRIDE FINAL
@@ -164,29 +174,31 @@ public:
         _alpha->getValueAtTime(time, params.alpha);
         _beta->getValueAtTime(time, params.beta);
         _scale->getValueAtTime(time, params.scale);
+        _seed->getValueAtTime(time, params.seed);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
     // only called if mix != 0.
-    virtual void getRoI(const OfxRectI& rect, const OfxPointD& renderScale, const CImgPlasmaParams& params, OfxRectI* roi) OVERRIDE FINAL
+    virtual void getRoI(const OfxRectI& rect, const OfxPointD& /*renderScale*/, const CImgPlasmaParams& /*params*/, OfxRectI* roi) OVERRIDE FINAL
     {
-        int delta_pix = (int)std::ceil((params.scale) * renderScale.x);
-        roi->x1 = rect.x1 - delta_pix;
-        roi->x2 = rect.x2 + delta_pix;
-        roi->y1 = rect.y1 - delta_pix;
-        roi->y2 = rect.y2 + delta_pix;
+        // the texture only depends on the pixel positions: each pixel only needs the same input pixel
+        *roi = rect;
     }
 
-    virtual void render(const OFX::RenderArguments &args, const CImgPlasmaParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
+    virtual void render(const OFX::RenderArguments &args, const CImgPlasmaParams& params, int x1, int y1, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
-      cimg.draw_plasma((float)params.alpha, (float)params.beta, (unsigned int)std::floor(params.scale * args.renderScale.x));
+        // the cimg may be a band of the render window, at (x1,y1) in the full image
+        // the proxies are keyed on the full-resolution positions, so that they show the same texture, except for the
+        // levels finer than a proxy pixel
+        cimgPlasma(cimg, (float)params.alpha, (float)params.beta, renderedScale(params, args.renderScale),
+                   cimgRandomSeed(params.seed, args.time), x1, y1, (unsigned int)std::max(0, -renderScaleLevel(args.renderScale)));
     }
 
     virtual bool isIdentity(const OFX::IsIdentityArguments &args, const CImgPlasmaParams& params) OVERRIDE FINAL
     {
-        return (std::floor(params.scale * args.renderScale.x) == 0);
+        return (renderedScale(params, args.renderScale) == 0);
     };
 
     /* Override the clip preferences, we need to say we are setting the frame varying flag */
@@ -197,10 +209,25 @@ public:
 
 private:
 
+    // the render scale, rounded to a power of two
+    static int renderScaleLevel(const OfxPointD& renderScale)
+    {
+        return (int)std::floor(std::log(renderScale.x) / std::log(2.) + 0.5);
+    }
+
+    // the scale at the render scale, so that the cells have the same size in the full-resolution image
+    static unsigned int renderedScale(const CImgPlasmaParams& params, const OfxPointD& renderScale)
+    {
+        const int scale = params.scale + renderScaleLevel(renderScale);
+
+        return (unsigned int)std::max(0, std::min(scale, kCImgPlasmaMaxScale));
+    }
+
     // params
     OFX::DoubleParam *_alpha;
     OFX::DoubleParam *_beta;
     OFX::IntParam *_scale;
+    OFX::IntParam *_seed;
 };
 
 
@@ -281,6 +308,17 @@ void CImgPlasmaPluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc
         }
     }
 
+    {
+        OFX::IntParamDescriptor *param = desc.defineIntParam(kParamSeed);
+        param->setLabel(kParamSeedLabel);
+        param->setHint(kParamSeedHint);
+        param->setDefault(kParamSeedDefault);
+        param->setAnimates(true); // can animate
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     CImgPlasmaPlugin::describeInContextEnd(desc, context, page);
 }
 
@@ -0,0 +1,414 @@
+//
+//  CImgRandom.h
+//
+//  Random noise and plasma textures computed from a counter-based generator keyed on the pixel position, using all threads.
+//
+//  Copyright (c) 2014 OpenFX. All rights reserved.
+//
+
+#ifndef Misc_CImgRandom_h
+#define Misc_CImgRandom_h
+
+#include "CImgLineFilter.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+// [internal] A 32-bit integer hash with good avalanche (lowbias32, by C. Wellons).
+inline unsigned int
+_cimg_hash(unsigned int x)
+{
+	x &= 0xffffffffu;
+	x ^= x >> 16;
+	x = (x * 0x7feb352du) & 0xffffffffu;
+	x ^= x >> 15;
+	x = (x * 0x846ca68bu) & 0xffffffffu;
+	x ^= x >> 16;
+
+	return x;
+}
+
+//! Combine the seed parameter and the time into the seed of the generator, so that each frame gets a different noise.
+inline unsigned int
+cimgRandomSeed(int seed, double time)
+{
+	const float t = (float)time;
+	unsigned int bits = 0;
+	std::memcpy(&bits, &t, std::min(sizeof(bits), sizeof(t)));
+
+	return _cimg_hash(_cimg_hash((unsigned int)seed) ^ bits);
+}
+
+// A counter-based random generator: the n-th number of the sequence is a hash of the key and n, where the key is a
+// hash of the seed, the position, the channel and the stream. Any pixel can thus draw its numbers independently of
+// the others, in any order, and the result does not depend on the tiles or threads that compute it.
+// The distributions are computed as in cimg::rand(), cimg::crand(), cimg::grand() and cimg::prand().
+class CImgRandomGenerator
+{
+public:
+	CImgRandomGenerator(unsigned int seed, int x, int y, int c, unsigned int stream = 0)
+		: _key(_cimg_hash(seed ^ _cimg_hash((unsigned int)x ^ _cimg_hash((unsigned int)y ^ _cimg_hash((unsigned int)c ^ _cimg_hash(stream))))))
+		, _counter(0)
+	{
+	}
+
+	//! Return a random variable uniformely distributed in [0,1).
+	double rand()
+	{
+		++_counter;
+		const unsigned int h = _cimg_hash(_key ^ _cimg_hash(_counter));
+
+		return h * (1. / 4294967296.);
+	}
+
+	//! Return a random variable uniformely distributed in [-1,1).
+	double crand()
+	{
+		return 1 - 2 * rand();
+	}
+
+	//! Return a random variable following a gaussian distribution and a standard deviation of 1.
+	double grand()
+	{
+		double x1, w;
+		do {
+			const double x2 = 2 * rand() - 1.0;
+			x1 = 2 * rand() - 1.0;
+			w = x1 * x1 + x2 * x2;
+		} while (w <= 0 || w >= 1.0);
+
+		return x1 * std::sqrt((-2 * std::log(w)) / w);
+	}
+
+	//! Return a random variable following a Poisson distribution of parameter z.
+	unsigned int prand(double z)
+	{
+		if (z <= 1.0e-10) {
+			return 0;
+		}
+		if (z > 100) {
+			return (unsigned int)((std::sqrt(z) * grand()) + z);
+		}
+		unsigned int k = 0;
+		const double y = std::exp(-z);
+		for (double s = 1.0; s >= y; ++k) {
+			s *= rand();
+		}
+
+		return k - 1;
+	}
+
+private:
+	unsigned int _key;
+	unsigned int _counter;
+};
+
+// Adds noise to the rows of the image, each pixel drawing from a generator keyed on its position in the full image.
+class CImgNoiseProcessor : public OFX::MultiThread::Processor
+{
+public:
+	CImgNoiseProcessor(cimg_library::CImg<float>& img, float sigma, unsigned int noise_type, unsigned int seed, int x0, int y0)
+		: _img(img)
+		, _sigma(sigma)
+		, _noise_type(noise_type)
+		, _seed(seed)
+		, _x0(x0)
+		, _y0(y0)
+	{
+	}
+
+	void process()
+	{
+		unsigned int nThreads = 1;
+		if (_img.width() * _img.height() >= kCImgLineFilterMinThreadedSize && !OFX::MultiThread::isSpawnedThread()) {
+			nThreads = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)_img.height());
+		}
+		multiThread(std::max(1u, nThreads));
+	}
+
+private:
+	virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+	{
+		const int y1 = (int)(((long)_img.height() * threadId) / nThreads);
+		const int y2 = (int)(((long)_img.height() * (threadId + 1)) / nThreads);
+		const float sqrt2 = (float)std::sqrt(2.0);
+		for (int c = 0; c < _img.spectrum(); ++c) {
+			for (int y = y1; y < y2; ++y) {
+				float *p = _img.data(0, y, 0, c);
+				for (int x = 0; x < _img.width(); ++x) {
+					CImgRandomGenerator rng(_seed, _x0 + x, _y0 + y, c);
+					switch (_noise_type) {
+						case 0: // Gaussian noise
+							p[x] = (float)(p[x] + _sigma * rng.grand());
+							break;
+						case 1: // Uniform noise
+							p[x] = (float)(p[x] + _sigma * rng.crand());
+							break;
+						case 2: // Salt & Pepper noise
+							if (rng.rand() * 100 < _sigma) {
+								p[x] = rng.rand() < 0.5 ? 1.f : 0.f;
+							}
+							break;
+						case 3: // Poisson noise
+							p[x] = (float)rng.prand(p[x]);
+							break;
+						case 4: { // Rice noise
+							const float val0 = p[x] / sqrt2;
+							const float re = (float)(val0 + _sigma * rng.grand());
+							const float im = (float)(val0 + _sigma * rng.grand());
+							p[x] = std::sqrt(re * re + im * im);
+						}   break;
+					}
+				}
+			}
+		}
+	}
+
+	cimg_library::CImg<float>& _img;
+	float _sigma;
+	unsigned int _noise_type;
+	unsigned int _seed;
+	int _x0;
+	int _y0;
+};
+
+//! Add random noise to pixel values.
+/**
+ This is the same as CImg<T>::noise(sigma, noise_type), but the random numbers are drawn from generators keyed on the
+ seed and on the pixel position in the full image, so that the result does not depend on the tiles or threads.
+ Salt & pepper noise sets the pixels to 0 or 1, instead of the minimum and maximum of the image, which depend on the tile.
+ \param sigma amplitude of the random additive noise (>=0)
+ \param noise_type 0=gaussian, 1=uniform, 2=salt&pepper, 3=poisson, 4=rician
+ \param seed the seed of the generators, see cimgRandomSeed()
+ \param x0 x coordinate of the first pixel of img in the full image
+ \param y0 y coordinate of the first pixel of img in the full image
+ **/
+inline void
+cimgNoise(cimg_library::CImg<float>& img, const float sigma, const unsigned int noise_type, const unsigned int seed,
+          const int x0 = 0, const int y0 = 0)
+{
+	if (img.is_empty() || (sigma == 0 && noise_type != 3) || noise_type > 4) {
+		return;
+	}
+	CImgNoiseProcessor processor(img, sigma, noise_type, seed, x0, y0);
+	processor.process();
+}
+
+// the coarsest cells of the plasma are at most 2^kCImgPlasmaMaxScale pixels wide
+#define kCImgPlasmaMaxScale 20
+
+// [internal] floor(a/b) and ceil(a/b) for b > 0
+inline int
+_cimg_floordiv(int a, int b)
+{
+	return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+inline int
+_cimg_ceildiv(int a, int b)
+{
+	return -_cimg_floordiv(-a, b);
+}
+
+// One level of the mid-point algorithm, on a grid of points spaced by delta/2 in the full image.
+// The image may be subsampled by 2^subsampling: the points are then keyed on their position and level in the
+// full-resolution image.
+// The first point of the grid is at (gx0,gy0), a multiple of delta, so that the points of even indices are the
+// corners of the cells of size delta, the points of odd indices along both axes are their centers, and the others
+// their edge midpoints.
+// The steps of a level are:
+// - centers: the mean of the four corners of the cell,
+// - midpoints: the mean of the two corners and the two centers around them,
+// - corners: the mean of the four midpoints around them,
+// each plus a random displacement. Each step only reads points written by the previous steps, so that the points
+// of a step can be computed in any order, on ranges of grid rows. Points whose neighbours are outside of the grid are
+// left unchanged: the error spreads inwards by delta/2 at each step, which is accounted for in the grid margins.
+class CImgPlasmaProcessor : public OFX::MultiThread::Processor
+{
+public:
+	enum StepEnum
+	{
+		eStepCenters = 0,
+		eStepMidpoints,
+		eStepCorners
+	};
+
+	CImgPlasmaProcessor(std::vector<float>& grid, int gw, int gh, int gx0, int gy0, int delta, int level,
+	                    float amplitude, unsigned int seed, int c, unsigned int subsampling)
+		: _grid(grid)
+		, _gw(gw)
+		, _gh(gh)
+		, _gx0(gx0)
+		, _gy0(gy0)
+		, _delta(delta)
+		, _level(level)
+		, _amplitude(amplitude)
+		, _seed(seed)
+		, _c(c)
+		, _subsampling(subsampling)
+		, _step(eStepCenters)
+	{
+	}
+
+	void process(StepEnum step)
+	{
+		_step = step;
+		unsigned int nThreads = 1;
+		if (_gw * _gh >= kCImgLineFilterMinThreadedSize && !OFX::MultiThread::isSpawnedThread()) {
+			nThreads = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)_gh);
+		}
+		multiThread(std::max(1u, nThreads));
+	}
+
+private:
+	virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+	{
+		const int j1 = (int)(((long)_gh * threadId) / nThreads);
+		const int j2 = (int)(((long)_gh * (threadId + 1)) / nThreads);
+		const int delta2 = _delta / 2;
+		const unsigned int stream = 3 * (_level + _subsampling) + _step;
+		float *g = &_grid[0];
+		for (int j = j1; j < j2; ++j) {
+			const int y = _gy0 + j * delta2;
+			// first index of the points of this step on row j
+			int i0;
+			switch (_step) {
+				case eStepCenters:
+					if (!(j & 1)) {
+						continue;
+					}
+					i0 = 1;
+					break;
+				case eStepMidpoints:
+					i0 = (j & 1) ? 0 : 1;
+					break;
+				case eStepCorners:
+				default:
+					if (j & 1) {
+						continue;
+					}
+					i0 = 0;
+					break;
+			}
+			for (int i = i0; i < _gw; i += 2) {
+				float mean;
+				if (_step == eStepCenters) {
+					// the grid starts and ends on corners, so that the four corners always exist
+					mean = 0.25f * (g[(j - 1) * _gw + i - 1] + g[(j - 1) * _gw + i + 1] + g[(j + 1) * _gw + i - 1] + g[(j + 1) * _gw + i + 1]);
+				} else {
+					if (i == 0 || i == _gw - 1 || j == 0 || j == _gh - 1) {
+						continue;
+					}
+					mean = 0.25f * (g[(j - 1) * _gw + i] + g[j * _gw + i - 1] + g[(j + 1) * _gw + i] + g[j * _gw + i + 1]);
+				}
+				CImgRandomGenerator rng(_seed, (_gx0 + i * delta2) << _subsampling, y << _subsampling, _c, stream);
+				g[j * _gw + i] = (float)(mean + _amplitude * rng.crand());
+			}
+		}
+	}
+
+	std::vector<float>& _grid;
+	int _gw;
+	int _gh;
+	int _gx0;
+	int _gy0;
+	int _delta;
+	int _level;
+	float _amplitude;
+	unsigned int _seed;
+	int _c;
+	unsigned int _subsampling;
+	StepEnum _step;
+};
+
+//! Draw a random plasma texture, using the mid-point algorithm.
+/**
+ This is the algorithm of CImg<T>::draw_plasma(), without wrapping around the image borders, and with the random
+ displacements drawn from generators keyed on the seed and the position in the full image. The lattice of the
+ mid-point algorithm is aligned on the full image, and each level is computed on a grid that only covers the points
+ that the next levels need, so that any part of the full image can be computed independently, with the same result.
+ The texture only depends on the seed and the pixel positions: the corners of the coarsest cells, of size 2^scale,
+ start at zero, and the texture is added to the image values. Thus no pixel around img is needed to compute it.
+ If img is subsampled by 2^subsampling, the points of the lattice draw the same displacements as in the
+ full-resolution image, so that the texture has the same coarse structure. The levels finer than a pixel of img are
+ not computed, and they still smooth and displace the lattice of the full-resolution image: the result is an
+ approximation of the full-resolution texture, not a subsampling of it.
+ \param alpha amplitude of the displacements, per full-resolution pixel of the cell size
+ \param beta constant amplitude of the displacements
+ \param scale the coarsest cells are 2^scale pixels of img wide
+ \param seed the seed of the generators, see cimgRandomSeed()
+ \param x0 x coordinate of the first pixel of img in the full image
+ \param y0 y coordinate of the first pixel of img in the full image
+ \param subsampling img is subsampled by 2^subsampling from the full-resolution image
+ **/
+inline void
+cimgPlasma(cimg_library::CImg<float>& img, const float alpha, const float beta, const unsigned int scale, const unsigned int seed,
+           const int x0, const int y0, const unsigned int subsampling = 0)
+{
+	if (img.is_empty() || scale == 0) {
+		return;
+	}
+	const int levels = (int)std::min(scale, (unsigned int)kCImgPlasmaMaxScale);
+	// from the finest to the coarsest level, the bounds of the grid (both included) of each level, that are needed to
+	// compute img, or the grid of the next finer level
+	std::vector<OfxRectI> bounds(levels + 1);
+	{
+		OfxRectI needed = { x0, y0, x0 + img.width() - 1, y0 + img.height() - 1 };
+		for (int level = 1; level <= levels; ++level) {
+			const int delta = 1 << level;
+			const int margin = 3 * (delta / 2);
+			OfxRectI& b = bounds[level];
+			b.x1 = _cimg_floordiv(needed.x1 - margin, delta) * delta;
+			b.y1 = _cimg_floordiv(needed.y1 - margin, delta) * delta;
+			b.x2 = _cimg_ceildiv(needed.x2 + margin, delta) * delta;
+			b.y2 = _cimg_ceildiv(needed.y2 + margin, delta) * delta;
+			needed = b;
+		}
+	}
+	std::vector<float> grid, coarse;
+	cimg_forC(img, c) {
+		// the corners of the coarsest cells start at zero
+		{
+			const OfxRectI& b = bounds[levels];
+			const int delta = 1 << levels;
+			coarse.assign((size_t)((b.x2 - b.x1) / delta + 1) * ((b.y2 - b.y1) / delta + 1), 0.f);
+		}
+		for (int level = levels; level >= 1; --level) {
+			const int delta = 1 << level, delta2 = delta / 2;
+			const OfxRectI& b = bounds[level];
+			const int gw = (b.x2 - b.x1) / delta2 + 1, gh = (b.y2 - b.y1) / delta2 + 1;
+			// the corners come from the grid of the previous level (spaced by delta), which covers this one
+			const OfxRectI& pb = bounds[std::min(level + 1, levels)];
+			const int pw = (level == levels) ? (b.x2 - b.x1) / delta + 1 : (pb.x2 - pb.x1) / delta + 1;
+			const int pi0 = (level == levels) ? 0 : (b.x1 - pb.x1) / delta;
+			const int pj0 = (level == levels) ? 0 : (b.y1 - pb.y1) / delta;
+			grid.assign((size_t)gw * gh, 0.f);
+			for (int j = 0; j < gh; j += 2) {
+				for (int i = 0; i < gw; i += 2) {
+					grid[(size_t)j * gw + i] = coarse[(size_t)(pj0 + j / 2) * pw + pi0 + i / 2];
+				}
+			}
+			const float amplitude = alpha * (delta << subsampling) + beta;
+			CImgPlasmaProcessor processor(grid, gw, gh, b.x1, b.y1, delta, level, amplitude, seed, c, subsampling);
+			processor.process(CImgPlasmaProcessor::eStepCenters);
+			processor.process(CImgPlasmaProcessor::eStepMidpoints);
+			processor.process(CImgPlasmaProcessor::eStepCorners);
+			coarse.swap(grid);
+		}
+		// the finest grid is spaced by one pixel
+		const OfxRectI& b = bounds[1];
+		const int gw = b.x2 - b.x1 + 1;
+		cimg_forY(img, y) {
+			const float *g = &coarse[(size_t)(y0 + y - b.y1) * gw + (x0 - b.x1)];
+			float *p = img.data(0, y, 0, c);
+			for (int x = 0; x < img.width(); ++x) {
+				p[x] += g[x];
+			}
+		}
+	}
+}
+
+#endif
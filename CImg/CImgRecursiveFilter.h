@@ -0,0 +1,355 @@
+//
+//  CImgRecursiveFilter.h
+//
+//  Recursive (IIR) Gaussian filters which process batches of adjacent lines, giving contiguous memory accesses along all axes.
+//
+//  Copyright (c) 2014 OpenFX. All rights reserved.
+//
+
+#ifndef Misc_CImgRecursiveFilter_h
+#define Misc_CImgRecursiveFilter_h
+
+#include "CImgLineFilter.h"
+
+#include <cassert>
+#include <cmath>
+
+// [internal] Van Vliet recursive filter on nLanes adjacent lines.
+// This is the same algorithm as CImg<T>::_cimg_recursive_apply(), with the same boundary conditions.
+/**
+ \param data the first sample of the first line. Sample n of line l is data[n*off + l].
+ \param filter the coefficients of the filter in the following order [n,n-1,n-2,n-3].
+ \param N number of samples of each line
+ \param off the offset between two samples of a line
+ \param nLanes the number of lines, at most kCImgLineFilterLanes
+ \param order the order of the filter 0 (smoothing), 1st derivative, 2nd derivative, 3rd derivative
+ \param boundary_conditions Boundary conditions. Can be <tt>{ 0=dirichlet | 1=neumann }</tt>.
+ **/
+inline void
+_cimg_recursive_apply_lanes(float *data, const double filter[], const int N, const unsigned long off, const int nLanes,
+                            const int order, const bool boundary_conditions)
+{
+	assert(nLanes >= 1 && nLanes <= kCImgLineFilterLanes);
+	const int L = nLanes;
+	if (N < 2 && order != 0) {
+		// no derivative can be computed
+		for (int l = 0; l < L; ++l) {
+			data[l] = 0.f;
+		}
+		return;
+	}
+	const double
+		sumsq = filter[0], sum = sumsq * sumsq,
+		a1 = filter[1], a2 = filter[2], a3 = filter[3],
+		scaleM = 1.0 / ( (1.0 + a1 - a2 + a3) * (1.0 - a1 - a2 - a3) * (1.0 + a2 + (a1 - a3) * a3) );
+	double M[9]; // Triggs matrix
+	M[0] = scaleM * (-a3 * a1 + 1.0 - a3 * a3 - a2);
+	M[1] = scaleM * (a3 + a1) * (a2 + a3 * a1);
+	M[2] = scaleM * a3 * (a1 + a3 * a2);
+	M[3] = scaleM * (a1 + a3 * a2);
+	M[4] = -scaleM * (a2 - 1.0) * (a2 + a3 * a1);
+	M[5] = -scaleM * a3 * (a3 * a1 + a3 * a3 + a2 - 1.0);
+	M[6] = scaleM * (a3 * a1 + a2 + a1 * a1 - a2 * a2);
+	M[7] = scaleM * (a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3);
+	M[8] = scaleM * a3 * (a1 + a3 * a2);
+
+	// previous results res[n-1,n-2,n-3] (or res[n+1,n+2,n+3] on the backward pass) of each line
+	double p1[kCImgLineFilterLanes], p2[kCImgLineFilterLanes], p3[kCImgLineFilterLanes];
+	// input samples [front,center,back] of each line, for the derivative filters
+	double x0[kCImgLineFilterLanes], x1[kCImgLineFilterLanes], x2[kCImgLineFilterLanes];
+
+	if (order == 0) {
+		double uplus[kCImgLineFilterLanes];
+		const float *last = data + (N-1)*off;
+		for (int l = 0; l < L; ++l) {
+			uplus[l] = (boundary_conditions ? last[l] : 0.) / (1.0 - a1 - a2 - a3);
+			p1[l] = p2[l] = p3[l] = (boundary_conditions ? data[l] / sumsq : 0.);
+		}
+		// forward pass
+		for (int n = 0; n < N; ++n) {
+			float *d = data + n*off;
+			for (int l = 0; l < L; ++l) {
+				const double v = d[l] + p1[l] * a1 + p2[l] * a2 + p3[l] * a3;
+				d[l] = (float)v;
+				p3[l] = p2[l]; p2[l] = p1[l]; p1[l] = v;
+			}
+		}
+		// backward pass, starting with the Triggs border condition
+		{
+			float *d = data + (N-1)*off;
+			for (int l = 0; l < L; ++l) {
+				const double
+					vplus = uplus[l] / (1.0 - a1 - a2 - a3),
+					unp = p1[l] - uplus[l], unp1 = p2[l] - uplus[l], unp2 = p3[l] - uplus[l],
+					v0 = (M[0] * unp + M[1] * unp1 + M[2] * unp2 + vplus) * sum,
+					v1 = (M[3] * unp + M[4] * unp1 + M[5] * unp2 + vplus) * sum,
+					v2 = (M[6] * unp + M[7] * unp1 + M[8] * unp2 + vplus) * sum;
+				d[l] = (float)v0;
+				p1[l] = v0; p2[l] = v1; p3[l] = v2;
+			}
+		}
+		for (int n = N-2; n >= 0; --n) {
+			float *d = data + n*off;
+			for (int l = 0; l < L; ++l) {
+				const double v = d[l] * sum + p1[l] * a1 + p2[l] * a2 + p3[l] * a3;
+				d[l] = (float)v;
+				p3[l] = p2[l]; p2[l] = p1[l]; p1[l] = v;
+			}
+		}
+
+		return;
+	}
+
+	// derivative filters: forward pass
+	for (int l = 0; l < L; ++l) {
+		x0[l] = x1[l] = x2[l] = (boundary_conditions ? data[l] : 0.);
+		p1[l] = p2[l] = p3[l] = 0.;
+	}
+	for (int n = 0; n < N-1; ++n) {
+		float *d = data + n*off;
+		const float *dn = d + off;
+		for (int l = 0; l < L; ++l) {
+			x0[l] = dn[l];
+			double v;
+			if (order == 1) {
+				v = 0.5f * (x0[l] - x2[l]);
+			} else if (order == 2) {
+				v = x1[l] - x2[l];
+			} else {
+				v = x0[l] - 2*x1[l] + x2[l];
+			}
+			v += p1[l] * a1 + p2[l] * a2 + p3[l] * a3;
+			d[l] = (float)v;
+			x2[l] = x1[l]; x1[l] = x0[l];
+			p3[l] = p2[l]; p2[l] = p1[l]; p1[l] = v;
+		}
+	}
+	// backward pass, starting with the Triggs border condition
+	{
+		float *d = data + (N-1)*off;
+		for (int l = 0; l < L; ++l) {
+			const double
+				unp = p1[l], unp1 = p2[l], unp2 = p3[l],
+				v0 = (M[0] * unp + M[1] * unp1 + M[2] * unp2) * sum,
+				v1 = (M[3] * unp + M[4] * unp1 + M[5] * unp2) * sum,
+				v2 = (M[6] * unp + M[7] * unp1 + M[8] * unp2) * sum;
+			d[l] = (float)v0;
+			p1[l] = v0; p2[l] = v1; p3[l] = v2;
+		}
+	}
+	for (int n = N-2; n >= 1; --n) {
+		float *d = data + n*off;
+		const float *dp = d - off;
+		for (int l = 0; l < L; ++l) {
+			double v;
+			if (order == 1) {
+				v = d[l] * sum;
+			} else {
+				x0[l] = dp[l];
+				if (order == 2) {
+					v = (x2[l] - x1[l]) * sum;
+				} else {
+					v = 0.5f * (x2[l] - x0[l]) * sum;
+				}
+				x2[l] = x1[l]; x1[l] = x0[l];
+			}
+			v += p1[l] * a1 + p2[l] * a2 + p3[l] * a3;
+			d[l] = (float)v;
+			p3[l] = p2[l]; p2[l] = p1[l]; p1[l] = v;
+		}
+	}
+	for (int l = 0; l < L; ++l) {
+		data[l] = 0.f;
+	}
+}
+
+// [internal] Deriche recursive filter on nLanes adjacent lines (same algorithm as CImg<T>::deriche()).
+/**
+ \param data the first sample of the first line. Sample n of line l is data[n*off + l].
+ \param coefs the coefficients of the filter: a0, a1, a2, a3, b1, b2, coefp, coefn
+ \param N number of samples of each line
+ \param off the offset between two samples of a line
+ \param nLanes the number of lines, at most kCImgLineFilterLanes
+ \param boundary_conditions Boundary conditions. Can be <tt>{ 0=dirichlet | 1=neumann }</tt>.
+ \param Y temporary storage for the causal part of the result, of size N*nLanes
+ **/
+inline void
+_cimg_deriche_apply_lanes(float *data, const float coefs[], const int N, const unsigned long off, const int nLanes,
+                          const bool boundary_conditions, float *Y)
+{
+	assert(nLanes >= 1 && nLanes <= kCImgLineFilterLanes);
+	const int L = nLanes;
+	const float
+		a0 = coefs[0], a1 = coefs[1], a2 = coefs[2], a3 = coefs[3],
+		b1 = coefs[4], b2 = coefs[5], coefp = coefs[6], coefn = coefs[7];
+	float xp[kCImgLineFilterLanes], yp[kCImgLineFilterLanes], yb[kCImgLineFilterLanes];
+	float xa[kCImgLineFilterLanes], ya[kCImgLineFilterLanes];
+
+	// causal part
+	for (int l = 0; l < L; ++l) {
+		xp[l] = boundary_conditions ? data[l] : 0.f;
+		yb[l] = yp[l] = boundary_conditions ? coefp*xp[l] : 0.f;
+	}
+	for (int n = 0; n < N; ++n) {
+		const float *d = data + n*off;
+		float *y = Y + (size_t)n * L;
+		for (int l = 0; l < L; ++l) {
+			const float xc = d[l];
+			const float yc = y[l] = a0*xc + a1*xp[l] - b1*yp[l] - b2*yb[l];
+			xp[l] = xc; yb[l] = yp[l]; yp[l] = yc;
+		}
+	}
+	// anti-causal part, added to the causal part
+	{
+		const float *d = data + (N-1)*off;
+		for (int l = 0; l < L; ++l) {
+			xp[l] = xa[l] = boundary_conditions ? d[l] : 0.f;
+			yp[l] = ya[l] = boundary_conditions ? coefn*xp[l] : 0.f;
+		}
+	}
+	for (int n = N-1; n >= 0; --n) {
+		float *d = data + n*off;
+		const float *y = Y + (size_t)n * L;
+		for (int l = 0; l < L; ++l) {
+			const float xc = d[l];
+			const float yc = a2*xp[l] + a3*xa[l] - b1*yp[l] - b2*ya[l];
+			xa[l] = xp[l]; xp[l] = xc; ya[l] = yp[l]; yp[l] = yc;
+			d[l] = y[l] + yc;
+		}
+	}
+}
+
+// [internal] Van Vliet filter on a batch of lines, for CImgLineFilterProcessor
+struct CImgVanVlietLines
+{
+	double filter[4];
+	int order;
+	bool boundary_conditions;
+
+	int pad() const { return 0; }
+
+	float* operator()(float *b0, float * /*b1*/, int N, int nLanes) const
+	{
+		_cimg_recursive_apply_lanes(b0, filter, N, kCImgLineFilterLanes, nLanes, order, boundary_conditions);
+
+		return b0;
+	}
+};
+
+// [internal] Deriche filter on a batch of lines, for CImgLineFilterProcessor
+struct CImgDericheLines
+{
+	float coefs[8];
+	bool boundary_conditions;
+
+	int pad() const { return 0; }
+
+	float* operator()(float *b0, float *b1, int N, int nLanes) const
+	{
+		_cimg_deriche_apply_lanes(b0, coefs, N, kCImgLineFilterLanes, nLanes, boundary_conditions, b1);
+
+		return b0;
+	}
+};
+
+//! Van Vliet recursive Gaussian filter.
+/**
+ Gives the same result as CImg<T>::vanvliet(), but the lines are processed by batches, using all threads.
+ \param sigma standard deviation of the Gaussian filter
+ \param order the order of the filter 0,1,2,3
+ \param axis  Axis along which the filter is computed. Can be <tt>{ 'x' | 'y' | 'z' | 'c' }</tt>.
+ \param boundary_conditions Boundary conditions. Can be <tt>{ 0=dirichlet | 1=neumann }</tt>.
+ **/
+inline void
+vanvliet(cimg_library::CImg<float>& img, const float sigma, const int order, const char axis='x', const bool boundary_conditions=true)
+{
+	const char naxis = cimg_library::cimg::uncase(axis);
+	if (img.is_empty() || sigma < 0 || order < 0 || order > 3) {
+		img.vanvliet(sigma, order, axis, boundary_conditions);
+		return;
+	}
+	if (sigma < 0.1f && !order) {
+		return;
+	}
+	const double
+		nnsigma = sigma < 0.1f ? 0.1f : sigma,
+		m0 = 1.16680, m1 = 1.10783, m2 = 1.40586,
+		m1sq = m1 * m1, m2sq = m2 * m2,
+		q = (nnsigma < 3.556 ? -0.2568 + 0.5784 * nnsigma + 0.0561 * nnsigma * nnsigma : 2.5091 + 0.9804 * (nnsigma - 3.556)),
+		qsq = q * q,
+		scale = (m0 + q) * (m1sq + m2sq + 2 * m1 * q + qsq),
+		b1 = -q * (2 * m0 * m1 + m1sq + m2sq + (2 * m0 + 4 * m1) * q + 3 * qsq) / scale,
+		b2 = qsq * (m0 + 2 * m1 + 3 * q) / scale,
+		b3 = -qsq * q / scale,
+		B = ( m0 * (m1sq + m2sq) ) / scale;
+	CImgVanVlietLines f;
+	f.filter[0] = B; f.filter[1] = -b1; f.filter[2] = -b2; f.filter[3] = -b3;
+	f.order = order;
+	f.boundary_conditions = boundary_conditions;
+	CImgLineFilterProcessor<CImgVanVlietLines> processor(img, naxis, f);
+	processor.process();
+}
+
+//! Recursive Deriche filter.
+/**
+ Gives the same result as CImg<T>::deriche(), but the lines are processed by batches, using all threads.
+ \param sigma Standard deviation of the filter.
+ \param order Order of the filter. Can be <tt>{ 0=smooth-filter | 1=1st-derivative | 2=2nd-derivative }</tt>.
+ \param axis Axis along which the filter is computed. Can be <tt>{ 'x' | 'y' | 'z' | 'c' }</tt>.
+ \param boundary_conditions Boundary conditions. Can be <tt>{ 0=dirichlet | 1=neumann }</tt>.
+ **/
+inline void
+deriche(cimg_library::CImg<float>& img, const float sigma, const int order=0, const char axis='x', const bool boundary_conditions=true)
+{
+	const char naxis = cimg_library::cimg::uncase(axis);
+	if (img.is_empty() || sigma < 0 || order < 0 || order > 2) {
+		img.deriche(sigma, order, axis, boundary_conditions);
+		return;
+	}
+	if (sigma < 0.1f && !order) {
+		return;
+	}
+	const float
+		nnsigma = sigma < 0.1f ? 0.1f : sigma,
+		alpha = 1.695f/nnsigma,
+		ema = (float)std::exp(-alpha),
+		ema2 = (float)std::exp(-2*alpha),
+		b1 = -2*ema,
+		b2 = ema2;
+	float a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+	switch (order) {
+		case 0: {
+			const float k = (1-ema)*(1-ema)/(1+2*alpha*ema-ema2);
+			a0 = k;
+			a1 = k*(alpha-1)*ema;
+			a2 = k*(alpha+1)*ema;
+			a3 = -k*ema2;
+		} break;
+		case 1: {
+			const float k = -(1-ema)*(1-ema)*(1-ema)/(2*(ema+1)*ema);
+			a0 = a3 = 0;
+			a1 = k*ema;
+			a2 = -a1;
+		} break;
+		default: {
+			const float
+				ea = (float)std::exp(-alpha),
+				k = -(ema2-1)/(2*alpha*ema),
+				kn = (-2*(-1+3*ea-3*ea*ea+ea*ea*ea)/(3*ea+1+3*ea*ea+ea*ea*ea));
+			a0 = kn;
+			a1 = -kn*(1+k*alpha)*ema;
+			a2 = kn*(1-k*alpha)*ema;
+			a3 = -kn*ema2;
+		} break;
+	}
+	CImgDericheLines f;
+	f.coefs[0] = a0; f.coefs[1] = a1; f.coefs[2] = a2; f.coefs[3] = a3;
+	f.coefs[4] = b1; f.coefs[5] = b2;
+	f.coefs[6] = (a0+a1)/(1+b1+b2);
+	f.coefs[7] = (a2+a3)/(1+b1+b2);
+	f.boundary_conditions = boundary_conditions;
+	CImgLineFilterProcessor<CImgDericheLines> processor(img, naxis, f);
+	processor.process();
+}
+
+#endif
@@ -87,6 +87,7 @@
 #include "ofxsCopier.h"
 
 #include "CImgFilter.h"
+#include "CImgBilateralGrid.h"
 
 #if cimg_version < 161
 #error "This plugin requires CImg 1.6.1, please upgrade CImg."
@@ -97,14 +98,14 @@
 #define kPluginDescription \
 "Filter out details under a given scale using the Rolling Guidance filter.\n" \
 "Rolling Guidance is described fully in http://www.cse.cuhk.edu.hk/~leojia/projects/rollguidance/\n" \
-"Iterates the 'blur_bilateral' function from the CImg library.\n" \
+"Iterates a bilateral filter, computed using a bilateral grid as in the 'blur_bilateral' function from the CImg library.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
 
 #define kPluginIdentifier    "net.sf.cimg.CImgRollingGuidance"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 0 // The Rolling Guidance filter gives a global result, tiling is impossible
 #define kSupportsMultiResolution 1
@@ -132,6 +133,11 @@
 #define kParamIterationsHint "Number of iterations of the rolling guidance filter. 1 corresponds to Gaussian smoothing. A reasonable value is 4."
 #define kParamIterationsDefault 4
 
+#define kParamGridResolution "gridResolution"
+#define kParamGridResolutionLabel "Grid Resolution"
+#define kParamGridResolutionHint "Number of cells of the bilateral grid per standard deviation, along the spatial and range axes. 1 gives cells of the same size as the 'blur_bilateral' function from CImg (for intensities in [0,1]). Higher values are more accurate, but slower and use more memory. Lower values are faster."
+#define kParamGridResolutionDefault 1.
+
 using namespace OFX;
 
 /// RollingGuidance plugin
@@ -140,6 +146,7 @@ struct CImgRollingGuidanceParams
     double sigma_s;
     double sigma_r;
     int iterations;
+    double gridResolution;
 };
 
 class CImgRollingGuidancePlugin : public CImgFilterPluginHelper<CImgRollingGuidanceParams,false>
@@ -152,7 +159,8 @@ public:
         _sigma_s  = fetchDoubleParam(kParamSigmaS);
         _sigma_r  = fetchDoubleParam(kParamSigmaR);
         _iterations = fetchIntParam(kParamIterations);
-        assert(_sigma_s && _sigma_r && _iterations);
+        _gridResolution = fetchDoubleParam(kParamGridResolution);
+        assert(_sigma_s && _sigma_r && _iterations && _gridResolution);
     }
 
     virtual void getValuesAtTime(double time, CImgRollingGuidanceParams& params) OVERRIDE FINAL
@@ -160,6 +168,7 @@ public:
         _sigma_s->getValueAtTime(time, params.sigma_s);
         _sigma_r->getValueAtTime(time, params.sigma_r);
         _iterations->getValueAtTime(time, params.iterations);
+        _gridResolution->getValueAtTime(time, params.gridResolution);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
@@ -185,18 +194,24 @@ public:
         // http://www.cse.cuhk.edu.hk/~leojia/projects/rollguidance/
         if (params.iterations == 1) {
             // Gaussian filter
-            cimg.blur((float)(params.sigma_s * args.renderScale.x), true, true);
+            vanvliet(cimg, (float)(params.sigma_s * args.renderScale.x), 0, 'x');
+            vanvliet(cimg, (float)(params.sigma_s * args.renderScale.x), 0, 'y');
             return;
         }
         // first iteration is Gaussian blur (equivalent to a bilateral filter with a constant image as the guide)
-        cimg_library::CImg<float> guide = cimg.get_blur((float)(params.sigma_s * args.renderScale.x), true, true);
+        cimg_library::CImg<float> guide(cimg);
+        vanvliet(guide, (float)(params.sigma_s * args.renderScale.x), 0, 'x');
+        vanvliet(guide, (float)(params.sigma_s * args.renderScale.x), 0, 'y');
         // next iterations use the bilateral filter
+        cimg_library::CImg<float> tmp;
         for (int i = 1; i < params.iterations; ++i) {
             if (abort()) {
                 return;
             }
             // filter the original image using the updated guide
-            guide = cimg.get_blur_bilateral(guide, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r);
+            tmp = cimg;
+            cimgBilateralGrid(tmp, guide, (float)(params.sigma_s * args.renderScale.x), (float)params.sigma_r, (float)params.gridResolution);
+            guide.swap(tmp);
         }
         cimg = guide;
     }
@@ -212,6 +227,7 @@ private:
     OFX::DoubleParam *_sigma_s;
     OFX::DoubleParam *_sigma_r;
     OFX::IntParam *_iterations;
+    OFX::DoubleParam *_gridResolution;
 };
 
 
@@ -289,6 +305,18 @@ void CImgRollingGuidancePluginFactory::describeInContext(OFX::ImageEffectDescrip
             page->addChild(*param);
         }
     }
+    {
+        OFX::DoubleParamDescriptor *param = desc.defineDoubleParam(kParamGridResolution);
+        param->setLabel(kParamGridResolutionLabel);
+        param->setHint(kParamGridResolutionHint);
+        param->setRange(0.1, 10.);
+        param->setDisplayRange(0.5, 4.);
+        param->setDefault(kParamGridResolutionDefault);
+        param->setIncrement(0.1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 
     CImgRollingGuidancePlugin::describeInContextEnd(desc, context, page);
 }
@@ -0,0 +1,288 @@
+//
+//  CImgSharpen.h
+//
+//  Sharpening by inverse diffusion or shock filters, with a global or a fixed normalization, using all threads.
+//
+//  Copyright (c) 2014 OpenFX. All rights reserved.
+//
+
+#ifndef Misc_CImgSharpen_h
+#define Misc_CImgSharpen_h
+
+#include "CImgFilter.h"
+#include "CImgBufferPool.h"
+#include "CImgRecursiveFilter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// The steps of one sharpening iteration, each computed on ranges of rows by all threads:
+// - tensors: the structure tensors of the (smoothed) image, for shock filters,
+// - eigen: the direction of the largest eigenvector of the tensors, and the amplitude of the shock,
+// - velocity: the velocity of the PDE at each pixel, the largest velocity, and the range of the image. With a fixed
+//   normalization, the velocity is applied directly, and the result is stored in the velocity image.
+// - update: apply the velocity normalized by the largest velocity of the image, and clamp to the range of the image.
+class CImgSharpenProcessor : public OFX::MultiThread::Processor
+{
+public:
+	enum StepEnum
+	{
+		eStepTensors = 0,
+		eStepEigen,
+		eStepVelocity,
+		eStepUpdate
+	};
+
+	CImgSharpenProcessor(cimg_library::CImg<float>& img,
+	                     cimg_library::CImg<float>& G,
+	                     cimg_library::CImg<float>& velocity,
+	                     const float amplitude,
+	                     const bool sharpen_type,
+	                     const float edge,
+	                     const float velocity_max)
+		: _img(img)
+		, _G(G)
+		, _velocity(velocity)
+		, _src(0)
+		, _amplitude(amplitude)
+		, _sharpen_type(sharpen_type)
+		, _nedge(edge/2)
+		, _fixedVelocityMax(velocity_max)
+		, _step(eStepTensors)
+		, _velocityMax()
+		, _valMin()
+		, _valMax()
+		, _velocityScale(0)
+		, _imgMin(0)
+		, _imgMax(0)
+	{
+	}
+
+	// run a step. For eStepTensors, src is the image the tensors are computed from.
+	void process(StepEnum step, const cimg_library::CImg<float>* src = 0)
+	{
+		_step = step;
+		_src = src;
+		unsigned int nThreads = 1;
+		if (_img.width() * _img.height() >= kCImgLineFilterMinThreadedSize && !OFX::MultiThread::isSpawnedThread()) {
+			nThreads = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)_img.height());
+		}
+		nThreads = std::max(1u, nThreads);
+		if (step == eStepVelocity) {
+			_velocityMax.assign(nThreads, 0.f);
+			_valMin.assign(nThreads, _img[0]);
+			_valMax.assign(nThreads, _img[0]);
+		}
+		multiThread(nThreads);
+		if (step == eStepVelocity) {
+			// reduce the values computed by each thread
+			const float velocityMax = *std::max_element(_velocityMax.begin(), _velocityMax.end());
+			_velocityScale = velocityMax > 0 ? _amplitude / velocityMax : 0.f;
+			_imgMin = *std::min_element(_valMin.begin(), _valMin.end());
+			_imgMax = *std::max_element(_valMax.begin(), _valMax.end());
+		}
+	}
+
+	// the largest velocity in the image is zero, nothing to do
+	bool isFlat() const { return _velocityScale == 0.f; }
+
+private:
+	virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+	{
+		const int W = _img.width();
+		const int H = _img.height();
+		const int y1 = (int)(((long)H * threadId) / nThreads);
+		const int y2 = (int)(((long)H * (threadId + 1)) / nThreads);
+		switch (_step) {
+			case eStepTensors: {
+				// forward/backward finite differences, as in CImg<T>::get_structure_tensors(2)
+				const cimg_library::CImg<float>& src = *_src;
+				for (int y = y1; y < y2; ++y) {
+					const int py = std::max(0, y - 1), ny = std::min(H - 1, y + 1);
+					for (int x = 0; x < W; ++x) {
+						const int px = std::max(0, x - 1), nx = std::min(W - 1, x + 1);
+						float g0 = 0.f, g1 = 0.f, g2 = 0.f;
+						for (int c = 0; c < src.spectrum(); ++c) {
+							const float Icc = src(x, y, 0, c);
+							const float ixf = src(nx, y, 0, c) - Icc, ixb = Icc - src(px, y, 0, c);
+							const float iyf = src(x, ny, 0, c) - Icc, iyb = Icc - src(x, py, 0, c);
+							g0 += (ixf*ixf + ixb*ixb)/2;
+							g1 += (ixf*iyf + ixf*iyb + ixb*iyf + ixb*iyb)/4;
+							g2 += (iyf*iyf + iyb*iyb)/2;
+						}
+						_G(x, y, 0, 0) = g0;
+						_G(x, y, 0, 1) = g1;
+						_G(x, y, 0, 2) = g2;
+					}
+				}
+			}   break;
+			case eStepEigen:
+				// largest eigenvector and eigenvalues, as in CImg<T>::eigen() on 2x2 matrices
+				for (int y = y1; y < y2; ++y) {
+					for (int x = 0; x < W; ++x) {
+						const double a = _G(x, y, 0, 0), b = _G(x, y, 0, 1), d = _G(x, y, 0, 2), e = a + d;
+						const double f = std::sqrt(std::max(0., e*e - 4*(a*d - b*b)));
+						const double l1 = 0.5*(e - f), l2 = 0.5*(e + f);
+						const double theta = std::atan2(l2 - a, b);
+						_G(x, y, 0, 0) = (float)std::cos(theta);
+						_G(x, y, 0, 1) = (float)std::sin(theta);
+						_G(x, y, 0, 2) = 1 - std::pow(1 + std::max((float)l2, 0.f) + std::max((float)l1, 0.f), -_nedge);
+					}
+				}
+				break;
+			case eStepVelocity: {
+				float velocityMax = 0.f;
+				float valMin = _valMin[threadId], valMax = _valMax[threadId];
+				for (int c = 0; c < _img.spectrum(); ++c) {
+					for (int y = y1; y < y2; ++y) {
+						const float *pI = _img.data(0, std::max(0, y - 1), 0, c);
+						const float *cI = _img.data(0, y, 0, c);
+						const float *nI = _img.data(0, std::min(H - 1, y + 1), 0, c);
+						float *pv = _velocity.data(0, y, 0, c);
+						for (int x = 0; x < W; ++x) {
+							const int px = std::max(0, x - 1), nx = std::min(W - 1, x + 1);
+							const float
+								Ipp = pI[px], Icp = pI[x], Inp = pI[nx],
+								Ipc = cI[px], Icc = cI[x], Inc = cI[nx],
+								Ipn = nI[px], Icn = nI[x], Inn = nI[nx];
+							float veloc;
+							if (_sharpen_type) {
+								const float
+									u = _G(x, y, 0, 0),
+									v = _G(x, y, 0, 1),
+									amp = _G(x, y, 0, 2),
+									ixx = Inc + Ipc - 2*Icc,
+									ixy = (Inn + Ipp - Inp - Ipn)/4,
+									iyy = Icn + Icp - 2*Icc,
+									ixf = Inc - Icc,
+									ixb = Icc - Ipc,
+									iyf = Icn - Icc,
+									iyb = Icc - Icp,
+									itt = u*u*ixx + v*v*iyy + 2*u*v*ixy,
+									it = u*cimg_library::cimg::minmod(ixf, ixb) + v*cimg_library::cimg::minmod(iyf, iyb);
+								veloc = -amp*cimg_library::cimg::sign(itt)*cimg_library::cimg::abs(it);
+							} else {
+								veloc = -Ipc - Inc - Icp - Icn + 4*Icc;
+							}
+							if (_fixedVelocityMax > 0) {
+								// normalize by the fixed velocity, and clamp to the range of the neighbourhood
+								const float vmin = std::min(std::min(std::min(Ipp, Icp), std::min(Inp, Ipc)), std::min(std::min(Icc, Inc), std::min(std::min(Ipn, Icn), Inn)));
+								const float vmax = std::max(std::max(std::max(Ipp, Icp), std::max(Inp, Ipc)), std::max(std::max(Icc, Inc), std::max(std::max(Ipn, Icn), Inn)));
+								pv[x] = std::min(std::max(Icc + veloc * (_amplitude / _fixedVelocityMax), vmin), vmax);
+							} else {
+								pv[x] = veloc;
+								if (veloc > velocityMax) {
+									velocityMax = veloc;
+								} else if (-veloc > velocityMax) {
+									velocityMax = -veloc;
+								}
+								if (Icc < valMin) {
+									valMin = Icc;
+								} else if (Icc > valMax) {
+									valMax = Icc;
+								}
+							}
+						}
+					}
+				}
+				_velocityMax[threadId] = velocityMax;
+				_valMin[threadId] = valMin;
+				_valMax[threadId] = valMax;
+			}   break;
+			case eStepUpdate:
+				for (int c = 0; c < _img.spectrum(); ++c) {
+					for (int y = y1; y < y2; ++y) {
+						float *pI = _img.data(0, y, 0, c);
+						const float *pv = _velocity.data(0, y, 0, c);
+						for (int x = 0; x < W; ++x) {
+							pI[x] = std::min(std::max(pv[x] * _velocityScale + pI[x], _imgMin), _imgMax);
+						}
+					}
+				}
+				break;
+		}
+	}
+
+	cimg_library::CImg<float>& _img;
+	cimg_library::CImg<float>& _G;
+	cimg_library::CImg<float>& _velocity;
+	const cimg_library::CImg<float>* _src;
+	float _amplitude;
+	bool _sharpen_type;
+	float _nedge;
+	float _fixedVelocityMax;
+	StepEnum _step;
+	std::vector<float> _velocityMax; //!< largest velocity found by each thread
+	std::vector<float> _valMin; //!< smallest value found by each thread
+	std::vector<float> _valMax; //!< largest value found by each thread
+	float _velocityScale;
+	float _imgMin;
+	float _imgMax;
+};
+
+//! Sharpen image, by inverse diffusion or by shock filters.
+/**
+ With velocity_max <= 0, this computes the same result as CImg<T>::sharpen(amplitude, sharpen_type, edge, alpha, sigma)
+ on 2D images: the velocity of the PDE is normalized by its largest value in the image, and the result is clamped to
+ the range of the image. Both are found by a reduction over all threads, so that the result depends on the whole image.
+ With velocity_max > 0, the velocity is normalized by velocity_max, and each pixel is clamped to the range of its 3x3
+ neighbourhood, so that the result only depends on a neighbourhood of each pixel, and can be computed by tiles.
+ \param amplitude sharpening amplitude
+ \param sharpen_type false for inverse diffusion, true for shock filters
+ \param edge edge threshold (shock filters only)
+ \param alpha gradient smoothness (shock filters only)
+ \param sigma tensor smoothness (shock filters only)
+ \param velocity_max the fixed normalization of the velocity, or <= 0 to use the largest velocity in the image
+ **/
+inline void
+cimgSharpen(cimg_library::CImg<float>& img, const float amplitude, const bool sharpen_type = false, const float edge = 1,
+            const float alpha = 0, const float sigma = 0, const float velocity_max = 0)
+{
+	if (img.is_empty()) {
+		return;
+	}
+	if (img.depth() > 1) {
+		img.sharpen(amplitude, sharpen_type, edge, alpha, sigma);
+
+		return;
+	}
+	CImgPooledBuffer velocityBuffer;
+	cimg_library::CImg<float> velocity(velocityBuffer.allocate(img.size()), img.width(), img.height(), 1, img.spectrum(), true);
+	CImgPooledBuffer GBuffer;
+	cimg_library::CImg<float> G;
+	CImgSharpenProcessor processor(img, G, velocity, amplitude, sharpen_type, edge, velocity_max);
+	if (sharpen_type) {
+		G.assign(GBuffer.allocate((size_t)img.width() * img.height() * 3), img.width(), img.height(), 1, 3, true);
+		CImgPooledBuffer smoothBuffer;
+		cimg_library::CImg<float> smooth;
+		if (alpha > 0) {
+			smooth.assign(smoothBuffer.allocate(img.size()), img.width(), img.height(), 1, img.spectrum(), true);
+			std::copy(img.begin(), img.end(), smooth.begin());
+			if (smooth.width() > 1) {
+				deriche(smooth, alpha, 0, 'x', true);
+			}
+			if (smooth.height() > 1) {
+				deriche(smooth, alpha, 0, 'y', true);
+			}
+		}
+		processor.process(CImgSharpenProcessor::eStepTensors, alpha > 0 ? &smooth : &img);
+		if (sigma > 0) {
+			if (G.width() > 1) {
+				deriche(G, sigma, 0, 'x', true);
+			}
+			if (G.height() > 1) {
+				deriche(G, sigma, 0, 'y', true);
+			}
+		}
+		processor.process(CImgSharpenProcessor::eStepEigen);
+	}
+	processor.process(CImgSharpenProcessor::eStepVelocity);
+	if (velocity_max > 0) {
+		std::copy(velocity.begin(), velocity.end(), img.begin());
+	} else if (!processor.isFlat()) {
+		processor.process(CImgSharpenProcessor::eStepUpdate);
+	}
+}
+
+#endif
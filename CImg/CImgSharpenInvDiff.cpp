@@ -74,6 +74,7 @@
 #include "CImgSharpenInvDiff.h"
 
 #include <memory>
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #ifdef _WINDOWS
@@ -87,21 +88,24 @@
 #include "ofxsCopier.h"
 
 #include "CImgFilter.h"
+#include "CImgSharpen.h"
 
 #define kPluginName          "SharpenInvDiffCImg"
 #define kPluginGrouping      "Filter"
 #define kPluginDescription \
 "Sharpen selected images by inverse diffusion.\n" \
-"Uses 'sharpen' function from the CImg library.\n" \
+"With Frame normalization, the result is the same as the 'sharpen' function from the CImg library. " \
+"With Fixed normalization, the image can be processed by tiles, which is faster for large images.\n" \
+"Uses the CImg library.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
 
 #define kPluginIdentifier    "net.sf.cimg.CImgSharpenInvDiff"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0 // a maximum computation is done in sharpen, tiling is theoretically not possible (although gmicol uses a 24 pixel overlap)
+#define kSupportsTiles 1 // only with Fixed normalization, see updateSupportsTiles()
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
 #define kSupportsMultipleClipPARs false
@@ -117,6 +121,25 @@
 #define kParamAmplitudeHint "Standard deviation of the spatial kernel, in pixel units (>=0). Details smaller than this size are filtered out."
 #define kParamAmplitudeDefault 0.2 // 50.0/255
 
+#define kParamNormalization "normalization"
+#define kParamNormalizationLabel "Normalization"
+#define kParamNormalizationHint "How the velocity of the sharpening is normalized at each iteration. Frame normalization needs the full frame to be processed at once, whereas with Fixed normalization each pixel only depends on a bounded neighborhood."
+#define kParamNormalizationOptionFrame "Frame"
+#define kParamNormalizationOptionFrameHint "Normalize by the largest velocity in the frame, and clamp the result to the range of the frame, as in the CImg library."
+#define kParamNormalizationOptionFixed "Fixed"
+#define kParamNormalizationOptionFixedHint "Normalize by the Max Velocity parameter, and clamp the result to the range of the 3x3 neighborhood of each pixel."
+#define kParamNormalizationDefault eNormalizationFrame
+enum NormalizationEnum
+{
+    eNormalizationFrame = 0,
+    eNormalizationFixed
+};
+
+#define kParamVelocityMax "velocityMax"
+#define kParamVelocityMaxLabel "Max Velocity"
+#define kParamVelocityMaxHint "Velocity that changes the pixel values by Amplitude, when Normalization is Fixed."
+#define kParamVelocityMaxDefault 0.5
+
 #define kParamIterations "iterations"
 #define kParamIterationsLabel "Iterations"
 #define kParamIterationsHint "Number of iterations. A reasonable value is 2."
@@ -128,6 +151,7 @@ using namespace OFX;
 struct CImgSharpenInvDiffParams
 {
     double amplitude;
+    double velocityMax; // zero for Frame normalization
     int iterations;
 };
 
@@ -139,21 +163,41 @@ public:
     : CImgFilterPluginHelper<CImgSharpenInvDiffParams,false>(handle, kSupportsTiles, kSupportsMultiResolution, kSupportsRenderScale)
     {
         _amplitude  = fetchDoubleParam(kParamAmplitude);
+        _normalization = fetchChoiceParam(kParamNormalization);
+        _velocityMax = fetchDoubleParam(kParamVelocityMax);
         _iterations = fetchIntParam(kParamIterations);
-        assert(_amplitude && _iterations);
+        assert(_amplitude && _normalization && _velocityMax && _iterations);
+        updateSupportsTiles();
     }
 
     virtual void getValuesAtTime(double time, CImgSharpenInvDiffParams& params) OVERRIDE FINAL
     {
         _amplitude->getValueAtTime(time, params.amplitude);
+        int normalization_i;
+        _normalization->getValueAtTime(time, normalization_i);
+        params.velocityMax = 0.;
+        if ((NormalizationEnum)normalization_i == eNormalizationFixed) {
+            _velocityMax->getValueAtTime(time, params.velocityMax);
+            params.velocityMax = std::max(0., params.velocityMax);
+        }
         _iterations->getValueAtTime(time, params.iterations);
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
     // only called if mix != 0.
-    virtual void getRoI(const OfxRectI& rect, const OfxPointD& /*renderScale*/, const CImgSharpenInvDiffParams& /*params*/, OfxRectI* roi) OVERRIDE FINAL
+    virtual void getRoI(const OfxRectI& rect, const OfxPointD& /*renderScale*/, const CImgSharpenInvDiffParams& params, OfxRectI* roi) OVERRIDE FINAL
     {
-        int delta_pix = 24; // overlap is 24 in gmicol
+        if (params.velocityMax <= 0.) {
+            // Frame normalization: the velocity is normalized by its maximum over the full frame
+            roi->x1 = kOfxFlagInfiniteMin;
+            roi->x2 = kOfxFlagInfiniteMax;
+            roi->y1 = kOfxFlagInfiniteMin;
+            roi->y2 = kOfxFlagInfiniteMax;
+
+            return;
+        }
+        // each iteration computes the velocity on the 3x3 neighborhood
+        int delta_pix = std::max(0, params.iterations);
         roi->x1 = rect.x1 - delta_pix;
         roi->x2 = rect.x2 + delta_pix;
         roi->y1 = rect.y1 - delta_pix;
@@ -171,7 +215,7 @@ public:
             if (abort()) {
                 return;
             }
-            cimg.sharpen((float)params.amplitude);
+            cimgSharpen(cimg, (float)params.amplitude, false, 1.f, 0.f, 0.f, (float)params.velocityMax);
         }
     }
 
@@ -180,10 +224,30 @@ public:
         return (params.iterations <= 0 || params.amplitude == 0.);
     };
 
+    virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL
+    {
+        if (paramName == kParamNormalization) {
+            updateSupportsTiles();
+        } else {
+            CImgFilterPluginHelper<CImgSharpenInvDiffParams,false>::changedParam(args, paramName);
+        }
+    }
+
 private:
 
+    // With Frame normalization, each pixel depends on the full frame, so that rendering by tiles would process the
+    // full frame for each tile: only Fixed normalization is rendered by tiles.
+    void updateSupportsTiles()
+    {
+        int normalization_i;
+        _normalization->getValue(normalization_i);
+        setSupportsTiles((NormalizationEnum)normalization_i == eNormalizationFixed);
+    }
+
     // params
     OFX::DoubleParam *_amplitude;
+    OFX::ChoiceParam *_normalization;
+    OFX::DoubleParam *_velocityMax;
     OFX::IntParam *_iterations;
 };
 
@@ -239,6 +303,32 @@ void CImgSharpenInvDiffPluginFactory::describeInContext(OFX::ImageEffectDescript
             page->addChild(*param);
         }
     }
+    {
+        OFX::ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamNormalization);
+        param->setLabel(kParamNormalizationLabel);
+        param->setHint(kParamNormalizationHint);
+        assert(param->getNOptions() == eNormalizationFrame && param->getNOptions() == 0);
+        param->appendOption(kParamNormalizationOptionFrame, kParamNormalizationOptionFrameHint);
+        assert(param->getNOptions() == eNormalizationFixed && param->getNOptions() == 1);
+        param->appendOption(kParamNormalizationOptionFixed, kParamNormalizationOptionFixedHint);
+        param->setDefault((int)kParamNormalizationDefault);
+        param->setAnimates(false); // tiled rendering depends on it, see updateSupportsTiles()
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        OFX::DoubleParamDescriptor *param = desc.defineDoubleParam(kParamVelocityMax);
+        param->setLabel(kParamVelocityMaxLabel);
+        param->setHint(kParamVelocityMaxHint);
+        param->setRange(0, 100.);
+        param->setDisplayRange(0, 1.);
+        param->setDefault(kParamVelocityMaxDefault);
+        param->setIncrement(0.01);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         OFX::IntParamDescriptor *param = desc.defineIntParam(kParamIterations);
         param->setLabel(kParamIterationsLabel);
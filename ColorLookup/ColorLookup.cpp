@@ -91,6 +91,7 @@ using std::isnan;
 #include "ofxsProcessing.H"
 #include "ofxsMaskMix.h"
 #include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
 
 #define kPluginName "ColorLookupOFX"
 #define kPluginGrouping "Color"
@@ -100,7 +101,7 @@ using std::isnan;
 "Computation is faster for values that are within the given range."
 #define kPluginIdentifier "net.sf.openfx.ColorLookupPlugin"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -151,6 +152,12 @@ using std::isnan;
 #define kParamRangeLabel "Range"
 #define kParamRangeHint "Expected range for input values. Within this range, a lookup table is used for faster computation."
 
+#define kParamExtendedRange "extendedRange"
+#define kParamExtendedRangeLabel "Extended Range"
+#define kParamExtendedRangeHint "Also use lookup tables for input values outside of the range, instead of evaluating the curves for each of these values. " \
+"Outside of the range, the curves are sampled at positions whose distance to the range grows exponentially, and are linearly extrapolated beyond 65535 times the range width. " \
+"This is much faster on HDR or scene-linear images, but less precise far from the range."
+
 #define kParamClampBlack "clampBlack"
 #define kParamClampBlackLabel "Clamp Black"
 #define kParamClampBlackHint "All colors below 0 on output are set to 0."
@@ -166,6 +173,12 @@ using std::isnan;
 #define kCurveAlpha 4
 #define kCurveNb 5
 
+// size of the tables used outside of the range when "Extended Range" is checked:
+// the table covers distances to the range of up to (2^kTailOctaves-1) times the range width
+#define kTailOctaves 16
+#define kTailStepsPerOctave 64
+#define kTailSize (kTailOctaves * kTailStepsPerOctave)
+
 using namespace OFX;
 
 class ColorLookupProcessorBase : public OFX::ImageProcessor {
@@ -258,6 +271,72 @@ componentToCurve(int comp)
 
 
 
+// Everything the content of the lookup table depends on.
+// The curves are identified by their control points rather than by the render time,
+// so that the same table is reused over a range of frames if the curves are not animated.
+struct ColorLookupCacheKey
+{
+    int nComponents;
+    int maxValue;
+    int nbValues;
+    double rangeMin;
+    double rangeMax;
+    bool clampBlack;
+    bool clampWhite;
+    bool extendedRange;
+    std::vector<double> curves; // for each curve: the number of control points, followed by their coordinates
+
+    ColorLookupCacheKey()
+    : nComponents(0)
+    , maxValue(0)
+    , nbValues(0)
+    , rangeMin(0.)
+    , rangeMax(0.)
+    , clampBlack(false)
+    , clampWhite(false)
+    , extendedRange(false)
+    , curves()
+    {
+    }
+
+    bool operator==(const ColorLookupCacheKey &other) const
+    {
+        return (nComponents == other.nComponents &&
+                maxValue == other.maxValue &&
+                nbValues == other.nbValues &&
+                rangeMin == other.rangeMin &&
+                rangeMax == other.rangeMax &&
+                clampBlack == other.clampBlack &&
+                clampWhite == other.clampWhite &&
+                extendedRange == other.extendedRange &&
+                curves == other.curves);
+    }
+};
+
+// The lookup table of the last render, shared by all render threads of a plugin instance.
+struct ColorLookupCache
+{
+    OFX::MultiThread::Mutex mutex; //< protects all the other members
+    bool valid;
+    ColorLookupCacheKey key;
+    std::vector<float> lookupTable[4];
+    std::vector<float> lowTail[4];
+    std::vector<float> highTail[4];
+
+    ColorLookupCache()
+    : mutex()
+    , valid(false)
+    , key()
+    {
+    }
+
+    void invalidate()
+    {
+        OFX::MultiThread::AutoMutex lock(mutex);
+        valid = false;
+    }
+};
+
 // template to do the processing.
 // nbValues is the number of values in the LUT minus 1. For integer types, it should be the same as
 // maxValue
@@ -266,13 +345,13 @@ class ColorLookupProcessor : public ColorLookupProcessorBase
 {
 public:
     // ctor
-    ColorLookupProcessor(OFX::ImageEffect &instance, const OFX::RenderArguments &args, OFX::ParametricParam  *lookupTableParam, double rangeMin, double rangeMax, bool clampBlack, bool clampWhite)
+    ColorLookupProcessor(OFX::ImageEffect &instance, const OFX::RenderArguments &args, OFX::ParametricParam  *lookupTableParam, double rangeMin, double rangeMax, bool clampBlack, bool clampWhite, bool extendedRange, ColorLookupCache &cache)
     : ColorLookupProcessorBase(instance, clampBlack, clampWhite)
     , _lookupTableParam(lookupTableParam)
     , _rangeMin(std::min(rangeMin,rangeMax))
     , _rangeMax(std::max(rangeMin,rangeMax))
+    , _extendedRange(extendedRange)
     {
-        // build the LUT
         assert(_lookupTableParam);
         _time = args.time;
         if (_rangeMin == _rangeMax) {
@@ -282,25 +361,112 @@ public:
         assert((PIX)maxValue == maxValue);
         // except for float, maxValue is the same as nbValues
         assert(maxValue == 1 || (maxValue == nbValues));
+
+        ColorLookupCacheKey key;
+        key.nComponents = nComponents;
+        key.maxValue = maxValue;
+        key.nbValues = nbValues;
+        key.rangeMin = _rangeMin;
+        key.rangeMax = _rangeMax;
+        key.clampBlack = clampBlack;
+        key.clampWhite = clampWhite;
+        key.extendedRange = extendedRange;
+        for (int curve = 0; curve < kCurveNb; ++curve) {
+            int n = _lookupTableParam->getNControlPoints(curve, _time);
+            key.curves.push_back(n);
+            for (int i = 0; i < n; ++i) {
+                std::pair<double, double> ctrlPt = _lookupTableParam->getNthControlPoint(curve, _time, i);
+                key.curves.push_back(ctrlPt.first);
+                key.curves.push_back(ctrlPt.second);
+            }
+        }
+
+        // the LUT is only built if it changed since the last render, and concurrent renders wait for it
+        OFX::MultiThread::AutoMutex lock(cache.mutex);
+        if (!cache.valid || !(cache.key == key)) {
+            buildLookupTable();
+            for (int component = 0; component < nComponents; ++component) {
+                cache.lookupTable[component] = _lookupTable[component];
+                cache.lowTail[component] = _lowTail[component];
+                cache.highTail[component] = _highTail[component];
+            }
+            cache.key = key;
+            cache.valid = true;
+        } else {
+            for (int component = 0; component < nComponents; ++component) {
+                _lookupTable[component] = cache.lookupTable[component];
+                _lowTail[component] = cache.lowTail[component];
+                _highTail[component] = cache.highTail[component];
+            }
+        }
+    }
+
+private:
+    // evaluate the curve for a given component (the master curve is combined with the r, g and b curves)
+    double evaluate(int component, double parametricPos)
+    {
+        int lutIndex = nComponents == 1 ? kCurveAlpha : componentToCurve(component); // special case for components == alpha only
+        double value = _lookupTableParam->getValue(lutIndex, _time, parametricPos);
+        if (nComponents != 1 && lutIndex != kCurveAlpha) {
+            value += _lookupTableParam->getValue(kCurveMaster, _time, parametricPos) - parametricPos;
+        }
+        return value;
+    }
+
+    void buildLookupTable()
+    {
+        const double width = _rangeMax - _rangeMin;
         for (int component = 0; component < nComponents; ++component) {
             _lookupTable[component].resize(nbValues+1);
-            int lutIndex = nComponents == 1 ? kCurveAlpha : componentToCurve(component); // special case for components == alpha only
             for (int position = 0; position <= nbValues; ++position) {
                 // position to evaluate the param at
-                double parametricPos = _rangeMin + (_rangeMax - _rangeMin) * double(position)/nbValues;
+                double parametricPos = _rangeMin + width * double(position)/nbValues;
 
-                // evaluate the parametric param
-                double value = _lookupTableParam->getValue(lutIndex, _time, parametricPos);
-                if (nComponents != 1 && lutIndex != kCurveAlpha) {
-                    value += _lookupTableParam->getValue(kCurveMaster, _time, parametricPos) - parametricPos;
-                }
-                // set that in the lut
-                _lookupTable[component][position] = (float)clamp<PIX>(value, maxValue);
+                // evaluate the parametric param, and set that in the lut
+                _lookupTable[component][position] = (float)clamp<PIX>(evaluate(component, parametricPos), maxValue);
+            }
+            if (!_extendedRange) {
+                _lowTail[component].clear();
+                _highTail[component].clear();
+                continue;
+            }
+            // entry i of the tails is at distance width*(2^(i/kTailStepsPerOctave)-1) from the range
+            _lowTail[component].resize(kTailSize+1);
+            _highTail[component].resize(kTailSize+1);
+            for (int i = 0; i <= kTailSize; ++i) {
+                double dist = width * (std::pow(2., double(i)/kTailStepsPerOctave) - 1.);
+                _lowTail[component][i] = (float)clamp<PIX>(evaluate(component, _rangeMin - dist), maxValue);
+                _highTail[component][i] = (float)clamp<PIX>(evaluate(component, _rangeMax + dist), maxValue);
             }
         }
     }
 
-private:
+    // interpolate in a tail table. dist is the distance to the range, divided by the range width
+    float interpolateTail(const std::vector<float> &tail, float dist)
+    {
+        assert(tail.size() == kTailSize+1);
+        if (!(dist >= 0.f)) {
+            // NaN: use the value at the range boundary
+            return tail[0];
+        }
+        // 1/log(2)
+        float x = std::log(1.f + dist) * (float)(kTailStepsPerOctave * 1.4426950408889634);
+        if (x < kTailSize) {
+            int i = (int)x;
+            float alpha = std::max(0.f,std::min(x - i, 1.f));
+            return tail[i] * (1.f - alpha) + tail[i+1] * alpha;
+        }
+        // beyond the table (or infinite value): linear extrapolation from the last two entries
+        const float distLast = (float)((1 << kTailOctaves) - 1);
+        const float distPrev = (float)(std::pow(2., double(kTailSize-1)/kTailStepsPerOctave) - 1.);
+        float slope = (tail[kTailSize] - tail[kTailSize-1]) / (distLast - distPrev);
+        if (slope == 0.f) {
+            // flat tail: avoid 0*inf
+            return tail[kTailSize];
+        }
+        return (float)clamp<PIX>(tail[kTailSize] + slope * (dist - distLast), maxValue);
+    }
+
     // and do some processing
     void multiThreadProcessImages(OfxRectI procWindow)
     {
@@ -348,13 +514,15 @@ private:
     // on input to interpolate, value should be normalized to the [0-1] range
     float interpolate(int component, float value) {
         if (value < _rangeMin || _rangeMax < value) {
-            // slow version
-            int lutIndex = nComponents == 1 ? kCurveAlpha : componentToCurve(component); // special case for components == alpha only
-            double ret = _lookupTableParam->getValue(lutIndex, _time, value);
-            if (nComponents != 1 && lutIndex != kCurveAlpha) {
-                ret += _lookupTableParam->getValue(kCurveMaster, _time, value) - value;
+            if (_extendedRange) {
+                if (value < _rangeMin) {
+                    return interpolateTail(_lowTail[component], (float)((_rangeMin - value) / (_rangeMax - _rangeMin)));
+                } else {
+                    return interpolateTail(_highTail[component], (float)((value - _rangeMax) / (_rangeMax - _rangeMin)));
+                }
             }
-            return (float)clamp<PIX>(ret, maxValue);;
+            // slow version
+            return (float)clamp<PIX>(evaluate(component, value), maxValue);
         } else {
             float x = (float)(value - _rangeMin) / (float)(_rangeMax - _rangeMin);
             int i = (int)(x * nbValues);
@@ -368,10 +536,13 @@ private:
 
 private:
     std::vector<float> _lookupTable[nComponents];
+    std::vector<float> _lowTail[nComponents];
+    std::vector<float> _highTail[nComponents];
     OFX::ParametricParam*  _lookupTableParam;
     double _time;
     double _rangeMin;
     double _rangeMax;
+    bool _extendedRange;
 };
 
 using namespace OFX;
@@ -400,6 +571,8 @@ public:
         _source = fetchRGBAParam(kParamSource);
         _target = fetchRGBAParam(kParamTarget);
         assert(_source && _target);
+        _extendedRange = fetchBooleanParam(kParamExtendedRange);
+        assert(_extendedRange);
         _clampBlack = fetchBooleanParam(kParamClampBlack);
         _clampWhite = fetchBooleanParam(kParamClampWhite);
         assert(_clampBlack && _clampWhite);
@@ -531,6 +704,11 @@ private:
             }
         }
 #endif
+        if (paramName == kParamLookupTable || paramName == kParamRange || paramName == kParamExtendedRange ||
+            paramName == kParamClampBlack || paramName == kParamClampWhite) {
+            // the cache key should catch these changes anyway, but free the table as soon as possible
+            _lutCache.invalidate();
+        }
         if (paramName == kParamRange && args.reason == eChangeUserEdit) {
             double rmin, rmax;
             _range->getValueAtTime(args.time, rmin, rmax);
@@ -548,12 +726,14 @@ private:
     OFX::Double2DParam* _range;
     OFX::RGBAParam* _source;
     OFX::RGBAParam* _target;
+    OFX::BooleanParam* _extendedRange;
     OFX::BooleanParam* _clampBlack;
     OFX::BooleanParam* _clampWhite;
     OFX::BooleanParam* _premult;
     OFX::ChoiceParam* _premultChannel;
     OFX::DoubleParam* _mix;
     OFX::BooleanParam* _maskInvert;
+    ColorLookupCache _lutCache;
 };
 
 
@@ -642,21 +822,22 @@ void
 ColorLookupPlugin::renderForComponents(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth)
 {
     double rangeMin, rangeMax;
-    bool clampBlack, clampWhite;
+    bool extendedRange, clampBlack, clampWhite;
     _range->getValueAtTime(args.time, rangeMin, rangeMax);
+    _extendedRange->getValueAtTime(args.time, extendedRange);
     _clampBlack->getValueAtTime(args.time, clampBlack);
     _clampWhite->getValueAtTime(args.time, clampWhite);
     switch(dstBitDepth) {
         case OFX::eBitDepthUByte: {
-            ColorLookupProcessor<unsigned char, nComponents, 255, 255> fred(*this, args, _lookupTable, rangeMin, rangeMax, clampBlack, clampWhite);
+            ColorLookupProcessor<unsigned char, nComponents, 255, 255> fred(*this, args, _lookupTable, rangeMin, rangeMax, clampBlack, clampWhite, extendedRange, _lutCache);
             setupAndProcess(fred, args);
         }   break;
         case OFX::eBitDepthUShort: {
-            ColorLookupProcessor<unsigned short, nComponents, 65535, 65535> fred(*this, args, _lookupTable, rangeMin, rangeMax, clampBlack, clampWhite);
+            ColorLookupProcessor<unsigned short, nComponents, 65535, 65535> fred(*this, args, _lookupTable, rangeMin, rangeMax, clampBlack, clampWhite, extendedRange, _lutCache);
             setupAndProcess(fred, args);
         }   break;
         case OFX::eBitDepthFloat: {
-            ColorLookupProcessor<float, nComponents, 1, 1023> fred(*this, args, _lookupTable, rangeMin, rangeMax, clampBlack, clampWhite);
+            ColorLookupProcessor<float, nComponents, 1, 1023> fred(*this, args, _lookupTable, rangeMin, rangeMax, clampBlack, clampWhite, extendedRange, _lutCache);
             setupAndProcess(fred, args);
         }   break;
         default :
@@ -785,6 +966,16 @@ ColorLookupPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OF
             page->addChild(*param);
         }
     }
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamExtendedRange);
+        param->setLabel(kParamExtendedRangeLabel);
+        param->setHint(kParamExtendedRangeHint);
+        param->setDefault(false);
+        param->setAnimates(true);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         OFX::ParametricParamDescriptor* param = desc.defineParametricParam(kParamLookupTable);
         assert(param);
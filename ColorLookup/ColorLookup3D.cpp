@@ -0,0 +1,882 @@
+/*
+ OFX ColorLookup3D plugin.
+
+ Copyright (C) 2015 INRIA
+ Author: Frederic Devernay <frederic.devernay@inria.fr>
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+
+ Neither the name of the {organization} nor the names of its
+ contributors may be used to endorse or promote products derived from
+ this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ INRIA
+ Domaine de Voluceau
+ Rocquencourt - B.P. 105
+ 78153 Le Chesnay Cedex - France
+ */
+
+#include "ColorLookup3D.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ofxsProcessing.H"
+#include "ofxsMaskMix.h"
+#include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
+
+#define kPluginName "ColorLookup3DOFX"
+#define kPluginGrouping "Color"
+#define kPluginDescription \
+"Apply a 3D lookup table, read from a file, to the RGB channels.\n" \
+"Supported file formats are Resolve/Iridas .cube and Autodesk/Lustre .3dl. " \
+"The file is only read when its name changes."
+#define kPluginIdentifier "net.sf.openfx.ColorLookup3DPlugin"
+#define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
+#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+
+#define kSupportsTiles 1
+#define kSupportsMultiResolution 1
+#define kSupportsRenderScale 1
+#define kSupportsMultipleClipPARs false
+#define kSupportsMultipleClipDepths false
+#define kRenderThreadSafety eRenderFullySafe
+
+#define kParamFile "file"
+#define kParamFileLabel "File"
+#define kParamFileHint "3D lookup table file (.cube or .3dl)."
+
+#define kParamInterpolation "interpolation"
+#define kParamInterpolationLabel "Interpolation"
+#define kParamInterpolationHint "Interpolation method between the lattice points of the lookup table."
+#define kParamInterpolationOptionTrilinear "Trilinear"
+#define kParamInterpolationOptionTrilinearHint "Interpolate from the 8 corners of the lattice cell."
+#define kParamInterpolationOptionTetrahedral "Tetrahedral"
+#define kParamInterpolationOptionTetrahedralHint "Interpolate from the 4 corners of the tetrahedron that contains the color. Faster, and preserves the neutral axis better."
+
+enum Lut3DInterpolationEnum
+{
+    eLut3DInterpolationTrilinear = 0,
+    eLut3DInterpolationTetrahedral
+};
+
+using namespace OFX;
+
+// A 3D lookup table, stored as a lattice of size^3 RGB triplets, with red varying fastest.
+// Once read, it is not modified, and is shared by the plugin cache and the renders: it is deleted when the last
+// of them releases it, with the plugin mutex locked.
+struct Lut3D
+{
+    int size;
+    float domainMin[3];
+    float domainMax[3];
+    std::vector<float> data;
+    int refCount;
+
+    Lut3D()
+    : size(0)
+    , data()
+    , refCount(1)
+    {
+        for (int c = 0; c < 3; ++c) {
+            domainMin[c] = 0.f;
+            domainMax[c] = 1.f;
+        }
+    }
+};
+
+// read a line, skipping empty lines and comments.
+// Returns the first non-blank character of the line, or NULL at end of file.
+static const char*
+readLine(std::FILE *f, char *line, int lineSize)
+{
+    while (std::fgets(line, lineSize, f)) {
+        const char *p = line;
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            ++p;
+        }
+        if (*p != 0 && *p != '#') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// parse n numbers at the beginning of s. Returns the number of values read.
+static int
+parseNumbers(const char *s, int n, double *values)
+{
+    for (int i = 0; i < n; ++i) {
+        char *end;
+        values[i] = std::strtod(s, &end);
+        if (end == s) {
+            return i;
+        }
+        s = end;
+    }
+    return n;
+}
+
+// Resolve/Iridas .cube file
+static bool
+readCubeFile(std::FILE *f, Lut3D *lut, std::string *error)
+{
+    char buf[1024];
+    int n = 0;
+    const char *line;
+    while ((line = readLine(f, buf, sizeof(buf))) != NULL) {
+        double v[3];
+        if (std::strncmp(line, "TITLE", 5) == 0) {
+            continue;
+        } else if (std::strncmp(line, "LUT_1D_SIZE", 11) == 0) {
+            *error = "1D lookup tables are not supported";
+            return false;
+        } else if (std::strncmp(line, "LUT_3D_SIZE", 11) == 0) {
+            lut->size = std::atoi(line + 11);
+            if (lut->size < 2 || lut->size > 256) {
+                *error = "invalid LUT_3D_SIZE";
+                return false;
+            }
+            lut->data.resize(lut->size * lut->size * lut->size * 3);
+        } else if (std::strncmp(line, "DOMAIN_MIN", 10) == 0) {
+            if (parseNumbers(line + 10, 3, v) != 3) {
+                *error = "invalid DOMAIN_MIN";
+                return false;
+            }
+            for (int c = 0; c < 3; ++c) {
+                lut->domainMin[c] = (float)v[c];
+            }
+        } else if (std::strncmp(line, "DOMAIN_MAX", 10) == 0) {
+            if (parseNumbers(line + 10, 3, v) != 3) {
+                *error = "invalid DOMAIN_MAX";
+                return false;
+            }
+            for (int c = 0; c < 3; ++c) {
+                lut->domainMax[c] = (float)v[c];
+            }
+        } else if (parseNumbers(line, 3, v) == 3) {
+            if (lut->size == 0) {
+                *error = "LUT_3D_SIZE must come before the table data";
+                return false;
+            }
+            if (n >= lut->size * lut->size * lut->size) {
+                *error = "too many entries";
+                return false;
+            }
+            // red varies fastest, as in our lattice
+            for (int c = 0; c < 3; ++c) {
+                lut->data[n * 3 + c] = (float)v[c];
+            }
+            ++n;
+        } else {
+            // unknown keyword
+            continue;
+        }
+    }
+    if (lut->size == 0 || n != lut->size * lut->size * lut->size) {
+        *error = "wrong number of entries";
+        return false;
+    }
+    for (int c = 0; c < 3; ++c) {
+        // also catches NaNs
+        if (!(lut->domainMin[c] < lut->domainMax[c])) {
+            *error = "DOMAIN_MIN must be less than DOMAIN_MAX";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Autodesk/Lustre .3dl file.
+// The first line gives the input mesh values (the number of values is the lattice size).
+// Integer output values are scaled using the smallest bit depth that contains them all.
+// Values that are not all integers, or all within [0,1], are already normalized.
+static bool
+read3dlFile(std::FILE *f, Lut3D *lut, std::string *error)
+{
+    char buf[4096];
+    std::vector<double> values;
+    int size = 0;
+    const char *line;
+    while ((line = readLine(f, buf, sizeof(buf))) != NULL) {
+        if (std::strncmp(line, "Mesh", 4) == 0 || std::strncmp(line, "3DMESH", 6) == 0 || std::strncmp(line, "LUT", 3) == 0) {
+            // headers from some applications, ignored
+            continue;
+        }
+        double v[3];
+        if (size == 0) {
+            // the input mesh
+            const char *s = line;
+            char *end;
+            for (;;) {
+                std::strtod(s, &end);
+                if (end == s) {
+                    break;
+                }
+                ++size;
+                s = end;
+            }
+            if (size < 2 || size > 256) {
+                *error = "invalid mesh size";
+                return false;
+            }
+        } else if (parseNumbers(line, 3, v) == 3) {
+            values.push_back(v[0]);
+            values.push_back(v[1]);
+            values.push_back(v[2]);
+        }
+    }
+    if (size == 0 || values.size() != (size_t)(size * size * size * 3)) {
+        *error = "wrong number of entries";
+        return false;
+    }
+    double maxValue = 0.;
+    bool integers = true;
+    for (size_t i = 0; i < values.size(); ++i) {
+        maxValue = std::max(maxValue, values[i]);
+        if (values[i] != std::floor(values[i])) {
+            integers = false;
+        }
+    }
+    double scale = 1.;
+    if (integers && maxValue > 1.) {
+        for (int bits = 8; bits <= 16; bits += 2) {
+            scale = (1 << bits) - 1;
+            if (maxValue <= scale) {
+                break;
+            }
+        }
+    }
+
+    lut->size = size;
+    lut->data.resize(values.size());
+    // blue varies fastest in the file, red varies fastest in our lattice
+    int i = 0;
+    for (int r = 0; r < size; ++r) {
+        for (int g = 0; g < size; ++g) {
+            for (int b = 0; b < size; ++b, i += 3) {
+                float *dst = &lut->data[((b * size + g) * size + r) * 3];
+                for (int c = 0; c < 3; ++c) {
+                    dst[c] = (float)(values[i + c] / scale);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static bool
+readLut3D(const std::string &filename, Lut3D *lut, std::string *error)
+{
+    std::string::size_type dot = filename.find_last_of('.');
+    std::string ext = (dot == std::string::npos) ? std::string() : filename.substr(dot + 1);
+    for (std::string::size_type i = 0; i < ext.size(); ++i) {
+        ext[i] = (char)std::tolower(ext[i]);
+    }
+    if (ext != "cube" && ext != "3dl") {
+        *error = "unknown file extension (should be .cube or .3dl)";
+        return false;
+    }
+    std::FILE *f = std::fopen(filename.c_str(), "r");
+    if (!f) {
+        *error = "cannot open file";
+        return false;
+    }
+    *lut = Lut3D();
+    bool ok = (ext == "cube") ? readCubeFile(f, lut, error) : read3dlFile(f, lut, error);
+    std::fclose(f);
+    return ok;
+}
+
+// interpolation of a normalized RGB color in the lattice
+template <Lut3DInterpolationEnum interpolation>
+static inline void
+lut3DInterpolate(const Lut3D &lut, const float *src, float *dst)
+{
+    const int n = lut.size;
+    int i[3];
+    float f[3];
+    for (int c = 0; c < 3; ++c) {
+        float x = (src[c] - lut.domainMin[c]) / (lut.domainMax[c] - lut.domainMin[c]) * (n - 1);
+        // also catches NaNs
+        if (!(x > 0.f)) {
+            x = 0.f;
+        } else if (x > n - 1) {
+            x = (float)(n - 1);
+        }
+        i[c] = std::min((int)x, n - 2);
+        f[c] = x - i[c];
+    }
+    // offsets to the neighbors along each axis
+    const int dr = 3;
+    const int dg = 3 * n;
+    const int db = 3 * n * n;
+    const float *c000 = &lut.data[((i[2] * n + i[1]) * n + i[0]) * 3];
+    const float *c100 = c000 + dr;
+    const float *c010 = c000 + dg;
+    const float *c110 = c000 + dg + dr;
+    const float *c001 = c000 + db;
+    const float *c101 = c000 + db + dr;
+    const float *c011 = c000 + db + dg;
+    const float *c111 = c000 + db + dg + dr;
+    const float fr = f[0];
+    const float fg = f[1];
+    const float fb = f[2];
+
+    if (interpolation == eLut3DInterpolationTrilinear) {
+        for (int c = 0; c < 3; ++c) {
+            float c00 = c000[c] + fr * (c100[c] - c000[c]);
+            float c10 = c010[c] + fr * (c110[c] - c010[c]);
+            float c01 = c001[c] + fr * (c101[c] - c001[c]);
+            float c11 = c011[c] + fr * (c111[c] - c011[c]);
+            float c0 = c00 + fg * (c10 - c00);
+            float c1 = c01 + fg * (c11 - c01);
+            dst[c] = c0 + fb * (c1 - c0);
+        }
+    } else {
+        // select the tetrahedron, then interpolate between its 4 corners
+        const float *p1;
+        const float *p2;
+        float w1, w2, w3;
+        if (fr > fg) {
+            if (fg > fb) {
+                p1 = c100; p2 = c110; w1 = fr; w2 = fg; w3 = fb;
+            } else if (fr > fb) {
+                p1 = c100; p2 = c101; w1 = fr; w2 = fb; w3 = fg;
+            } else {
+                p1 = c001; p2 = c101; w1 = fb; w2 = fr; w3 = fg;
+            }
+        } else {
+            if (fb > fg) {
+                p1 = c001; p2 = c011; w1 = fb; w2 = fg; w3 = fr;
+            } else if (fb > fr) {
+                p1 = c010; p2 = c011; w1 = fg; w2 = fb; w3 = fr;
+            } else {
+                p1 = c010; p2 = c110; w1 = fg; w2 = fr; w3 = fb;
+            }
+        }
+        for (int c = 0; c < 3; ++c) {
+            dst[c] = c000[c] + w1 * (p1[c] - c000[c]) + w2 * (p2[c] - p1[c]) + w3 * (c111[c] - p2[c]);
+        }
+    }
+}
+
+class ColorLookup3DProcessorBase : public OFX::ImageProcessor {
+protected:
+    const OFX::Image *_srcImg;
+    const OFX::Image *_maskImg;
+    bool   _doMasking;
+    bool _premult;
+    int _premultChannel;
+    double _mix;
+    bool _maskInvert;
+    const Lut3D *_lut;
+
+public:
+    ColorLookup3DProcessorBase(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _srcImg(0)
+    , _maskImg(0)
+    , _doMasking(false)
+    , _premult(false)
+    , _premultChannel(3)
+    , _mix(1.)
+    , _maskInvert(false)
+    , _lut(0)
+    {
+    }
+
+    void setSrcImg(const OFX::Image *v) {_srcImg = v;}
+
+    void setMaskImg(const OFX::Image *v, bool maskInvert) { _maskImg = v; _maskInvert = maskInvert; }
+
+    void doMasking(bool v) {_doMasking = v;}
+
+    // lut must stay valid until process() returns
+    void setValues(const Lut3D *lut,
+                   bool premult,
+                   int premultChannel,
+                   double mix)
+    {
+        _lut = lut;
+        _premult = premult;
+        _premultChannel = premultChannel;
+        _mix = mix;
+    }
+};
+
+template <class PIX, int nComponents, int maxValue, Lut3DInterpolationEnum interpolation>
+class ColorLookup3DProcessor : public ColorLookup3DProcessorBase
+{
+public:
+    ColorLookup3DProcessor(OFX::ImageEffect &instance)
+    : ColorLookup3DProcessorBase(instance)
+    {
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        assert(nComponents == 3 || nComponents == 4);
+        assert(_dstImg);
+        assert(_lut && _lut->size >= 2 && _lut->data.size() == (size_t)(_lut->size * _lut->size * _lut->size * 3));
+        float unpPix[4];
+        float tmpPix[4];
+        for (int y = procWindow.y1; y < procWindow.y2; y++) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+
+            for (int x = procWindow.x1; x < procWindow.x2; x++)  {
+                const PIX *srcPix = (const PIX *)  (_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
+                // ofxsUnPremult outputs normalized data
+                ofxsUnPremult<PIX, nComponents, maxValue>(srcPix, unpPix, _premult, _premultChannel);
+                lut3DInterpolate<interpolation>(*_lut, unpPix, tmpPix);
+                if (nComponents == 4) {
+                    tmpPix[3] = unpPix[3];
+                }
+                // ofxsPremultMaskMixPix expects normalized input
+                ofxsPremultMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, _premult, _premultChannel, x, y, srcPix, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
+                // increment the dst pixel
+                dstPix += nComponents;
+            }
+        }
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/** @brief The plugin that does our work */
+class ColorLookup3DPlugin : public OFX::ImageEffect
+{
+public:
+    ColorLookup3DPlugin(OfxImageEffectHandle handle)
+    : ImageEffect(handle)
+    , _dstClip(0)
+    , _srcClip(0)
+    , _maskClip(0)
+    , _lutFile()
+    , _lutRead(false)
+    , _lutError()
+    , _lut(0)
+    {
+        _dstClip = fetchClip(kOfxImageEffectOutputClipName);
+        assert(_dstClip && (_dstClip->getPixelComponents() == ePixelComponentRGB || _dstClip->getPixelComponents() == ePixelComponentRGBA));
+        _srcClip = fetchClip(kOfxImageEffectSimpleSourceClipName);
+        assert(_srcClip && (_srcClip->getPixelComponents() == ePixelComponentRGB || _srcClip->getPixelComponents() == ePixelComponentRGBA));
+
+        _maskClip = getContext() == OFX::eContextFilter ? NULL : fetchClip(getContext() == OFX::eContextPaint ? "Brush" : "Mask");
+        assert(!_maskClip || _maskClip->getPixelComponents() == ePixelComponentAlpha);
+        _file = fetchStringParam(kParamFile);
+        _interpolation = fetchChoiceParam(kParamInterpolation);
+        assert(_file && _interpolation);
+        _premult = fetchBooleanParam(kParamPremult);
+        _premultChannel = fetchChoiceParam(kParamPremultChannel);
+        assert(_premult && _premultChannel);
+        _mix = fetchDoubleParam(kParamMix);
+        _maskInvert = fetchBooleanParam(kParamMaskInvert);
+        assert(_mix && _maskInvert);
+    }
+
+    virtual ~ColorLookup3DPlugin()
+    {
+        OFX::MultiThread::AutoMutex lock(_lutMutex);
+        releaseLut3D(_lut);
+    }
+
+    // release a reference to a lookup table. _lutMutex must be locked.
+    static void releaseLut3D(Lut3D *lut)
+    {
+        if (lut && --lut->refCount == 0) {
+            delete lut;
+        }
+    }
+
+private:
+    virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
+
+    virtual bool isIdentity(const IsIdentityArguments &args, Clip * &identityClip, double &identityTime) OVERRIDE FINAL;
+
+    virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
+
+    /** @brief called when a clip has just been changed in some way (a rewire maybe) */
+    virtual void changedClip(const InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
+
+    template <int nComponents>
+    void renderForComponents(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth);
+
+    template <class PIX, int nComponents, int maxValue>
+    void renderForBitDepth(const OFX::RenderArguments &args);
+
+    void setupAndProcess(ColorLookup3DProcessorBase &, const OFX::RenderArguments &args);
+
+    // read the file if it changed since the last render, and return a reference to the lookup table
+    Lut3D* getLut3D(const std::string &filename);
+
+private:
+    OFX::Clip *_dstClip;
+    OFX::Clip *_srcClip;
+    OFX::Clip *_maskClip;
+    OFX::StringParam *_file;
+    OFX::ChoiceParam *_interpolation;
+    OFX::BooleanParam* _premult;
+    OFX::ChoiceParam* _premultChannel;
+    OFX::DoubleParam* _mix;
+    OFX::BooleanParam* _maskInvert;
+
+    OFX::MultiThread::Mutex _lutMutex; //< protects _lutFile, _lutRead, _lutError and _lut
+    std::string _lutFile;
+    bool _lutRead; //< _lutFile was read, successfully if _lut is set, else with _lutError
+    std::string _lutError;
+    Lut3D *_lut;
+
+    friend class Lut3DUser;
+};
+
+// Holds a reference to a lookup table during the lifetime of the object
+class Lut3DUser
+{
+public:
+    Lut3DUser(ColorLookup3DPlugin *plugin, Lut3D *lut)
+    : _plugin(plugin)
+    , _lut(lut)
+    {
+    }
+
+    ~Lut3DUser()
+    {
+        OFX::MultiThread::AutoMutex lock(_plugin->_lutMutex);
+        ColorLookup3DPlugin::releaseLut3D(_lut);
+    }
+
+    const Lut3D* get() const { return _lut; }
+
+private:
+    ColorLookup3DPlugin *_plugin;
+    Lut3D *_lut;
+};
+
+Lut3D*
+ColorLookup3DPlugin::getLut3D(const std::string &filename)
+{
+    std::string error;
+    {
+        OFX::MultiThread::AutoMutex lock(_lutMutex);
+        if (!_lutRead || _lutFile != filename) {
+            // the renders using the previous table keep it until they are done
+            releaseLut3D(_lut);
+            _lut = new Lut3D;
+            _lutError.clear();
+            if (!readLut3D(filename, _lut, &_lutError)) {
+                // the failure is cached too, so that the file is not parsed again by each render
+                releaseLut3D(_lut);
+                _lut = 0;
+            }
+            _lutFile = filename;
+            _lutRead = true;
+        }
+        if (_lut) {
+            ++_lut->refCount;
+            return _lut;
+        }
+        error = _lutError;
+    }
+    setPersistentMessage(OFX::Message::eMessageError, "", filename + ": " + (error.empty() ? std::string("cannot read file") : error));
+    OFX::throwSuiteStatusException(kOfxStatFailed);
+    return 0;
+}
+
+void
+ColorLookup3DPlugin::setupAndProcess(ColorLookup3DProcessorBase &processor,
+                                     const OFX::RenderArguments &args)
+{
+    assert(_dstClip);
+    std::auto_ptr<OFX::Image> dst(_dstClip->fetchImage(args.time));
+    if (!dst.get()) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    OFX::BitDepthEnum         dstBitDepth    = dst->getPixelDepth();
+    OFX::PixelComponentEnum   dstComponents  = dst->getPixelComponents();
+    if (dstBitDepth != _dstClip->getPixelDepth() ||
+        dstComponents != _dstClip->getPixelComponents()) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong depth or components");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getRenderScale().x != args.renderScale.x ||
+        dst->getRenderScale().y != args.renderScale.y ||
+        (dst->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && dst->getField() != args.fieldToRender)) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    assert(_srcClip);
+    std::auto_ptr<const OFX::Image> src((_srcClip && _srcClip->isConnected()) ?
+                                        _srcClip->fetchImage(args.time) : 0);
+    if (src.get()) {
+        if (src->getRenderScale().x != args.renderScale.x ||
+            src->getRenderScale().y != args.renderScale.y ||
+            (src->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && src->getField() != args.fieldToRender)) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        OFX::BitDepthEnum    srcBitDepth      = src->getPixelDepth();
+        OFX::PixelComponentEnum srcComponents = src->getPixelComponents();
+        if (srcBitDepth != dstBitDepth || srcComponents != dstComponents) {
+            OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+        }
+    }
+    std::auto_ptr<const OFX::Image> mask((getContext() != OFX::eContextFilter && _maskClip && _maskClip->isConnected()) ?
+                                         _maskClip->fetchImage(args.time) : 0);
+    if (getContext() != OFX::eContextFilter && _maskClip && _maskClip->isConnected()) {
+        if (mask.get()) {
+            if (mask->getRenderScale().x != args.renderScale.x ||
+                mask->getRenderScale().y != args.renderScale.y ||
+                (mask->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && mask->getField() != args.fieldToRender)) {
+                setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+                OFX::throwSuiteStatusException(kOfxStatFailed);
+            }
+        }
+        bool maskInvert;
+        _maskInvert->getValueAtTime(args.time, maskInvert);
+        processor.doMasking(true);
+        processor.setMaskImg(mask.get(), maskInvert);
+    }
+
+    // the render holds a reference to the cached table, so that it may be reloaded while rendering
+    std::string filename;
+    _file->getValue(filename);
+    Lut3DUser lut(this, getLut3D(filename));
+
+    processor.setDstImg(dst.get());
+    processor.setSrcImg(src.get());
+    processor.setRenderWindow(args.renderWindow);
+    bool premult;
+    int premultChannel;
+    _premult->getValueAtTime(args.time, premult);
+    _premultChannel->getValueAtTime(args.time, premultChannel);
+    double mix;
+    _mix->getValueAtTime(args.time, mix);
+    processor.setValues(lut.get(), premult, premultChannel, mix);
+    processor.process();
+}
+
+template <class PIX, int nComponents, int maxValue>
+void
+ColorLookup3DPlugin::renderForBitDepth(const OFX::RenderArguments &args)
+{
+    int interpolation_i;
+    _interpolation->getValueAtTime(args.time, interpolation_i);
+    if ((Lut3DInterpolationEnum)interpolation_i == eLut3DInterpolationTrilinear) {
+        ColorLookup3DProcessor<PIX, nComponents, maxValue, eLut3DInterpolationTrilinear> fred(*this);
+        setupAndProcess(fred, args);
+    } else {
+        ColorLookup3DProcessor<PIX, nComponents, maxValue, eLut3DInterpolationTetrahedral> fred(*this);
+        setupAndProcess(fred, args);
+    }
+}
+
+// the internal render function
+template <int nComponents>
+void
+ColorLookup3DPlugin::renderForComponents(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth)
+{
+    switch(dstBitDepth) {
+        case OFX::eBitDepthUByte:
+            renderForBitDepth<unsigned char, nComponents, 255>(args);
+            break;
+        case OFX::eBitDepthUShort:
+            renderForBitDepth<unsigned short, nComponents, 65535>(args);
+            break;
+        case OFX::eBitDepthFloat:
+            renderForBitDepth<float, nComponents, 1>(args);
+            break;
+        default :
+            OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
+    }
+}
+
+void
+ColorLookup3DPlugin::render(const OFX::RenderArguments &args)
+{
+    OFX::BitDepthEnum       dstBitDepth    = _dstClip->getPixelDepth();
+    OFX::PixelComponentEnum dstComponents  = _dstClip->getPixelComponents();
+
+    assert(kSupportsMultipleClipPARs   || !_srcClip || _srcClip->getPixelAspectRatio() == _dstClip->getPixelAspectRatio());
+    assert(kSupportsMultipleClipDepths || !_srcClip || _srcClip->getPixelDepth()       == _dstClip->getPixelDepth());
+    if (dstComponents == OFX::ePixelComponentRGBA) {
+        renderForComponents<4>(args, dstBitDepth);
+    } else {
+        assert(dstComponents == OFX::ePixelComponentRGB);
+        renderForComponents<3>(args, dstBitDepth);
+    }
+}
+
+bool
+ColorLookup3DPlugin::isIdentity(const IsIdentityArguments &args, Clip * &identityClip, double &/*identityTime*/)
+{
+    double mix;
+    _mix->getValueAtTime(args.time, mix);
+    std::string filename;
+    _file->getValue(filename);
+
+    if (mix == 0. || filename.empty()) {
+        identityClip = _srcClip;
+        return true;
+    }
+    return false;
+}
+
+void
+ColorLookup3DPlugin::changedParam(const OFX::InstanceChangedArgs &/*args*/, const std::string &paramName)
+{
+    if (paramName == kParamFile) {
+        // the file may have been modified even if its name did not change: force reading it again
+        {
+            OFX::MultiThread::AutoMutex lock(_lutMutex);
+            _lutRead = false;
+        }
+        clearPersistentMessage();
+    }
+}
+
+void
+ColorLookup3DPlugin::changedClip(const InstanceChangedArgs &args, const std::string &clipName)
+{
+    if (clipName == kOfxImageEffectSimpleSourceClipName && _srcClip && args.reason == OFX::eChangeUserEdit) {
+        switch (_srcClip->getPreMultiplication()) {
+            case eImageOpaque:
+                break;
+            case eImagePreMultiplied:
+                _premult->setValue(true);
+                break;
+            case eImageUnPreMultiplied:
+                _premult->setValue(false);
+                break;
+        }
+    }
+}
+
+
+mDeclarePluginFactory(ColorLookup3DPluginFactory, {}, {});
+
+void
+ColorLookup3DPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
+{
+    desc.setLabel(kPluginName);
+    desc.setPluginGrouping(kPluginGrouping);
+    desc.setPluginDescription(kPluginDescription);
+
+    desc.addSupportedContext(eContextFilter);
+    desc.addSupportedContext(eContextPaint);
+    desc.addSupportedContext(eContextGeneral);
+    desc.addSupportedBitDepth(eBitDepthUByte);
+    desc.addSupportedBitDepth(eBitDepthUShort);
+    desc.addSupportedBitDepth(eBitDepthFloat);
+
+    desc.setSingleInstance(false);
+    desc.setHostFrameThreading(false);
+    desc.setSupportsMultiResolution(kSupportsMultiResolution);
+    desc.setSupportsTiles(kSupportsTiles);
+    desc.setTemporalClipAccess(false);
+    desc.setRenderTwiceAlways(false);
+    desc.setSupportsMultipleClipPARs(kSupportsMultipleClipPARs);
+    desc.setSupportsMultipleClipDepths(kSupportsMultipleClipDepths);
+    desc.setRenderThreadSafety(kRenderThreadSafety);
+}
+
+void
+ColorLookup3DPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, OFX::ContextEnum context)
+{
+    ClipDescriptor *srcClip = desc.defineClip(kOfxImageEffectSimpleSourceClipName);
+    assert(srcClip);
+    srcClip->addSupportedComponent(ePixelComponentRGB);
+    srcClip->addSupportedComponent(ePixelComponentRGBA);
+    srcClip->setTemporalClipAccess(false);
+    srcClip->setSupportsTiles(kSupportsTiles);
+    srcClip->setIsMask(false);
+
+    ClipDescriptor *dstClip = desc.defineClip(kOfxImageEffectOutputClipName);
+    assert(dstClip);
+    dstClip->addSupportedComponent(ePixelComponentRGB);
+    dstClip->addSupportedComponent(ePixelComponentRGBA);
+    dstClip->setSupportsTiles(kSupportsTiles);
+
+    if (context == eContextGeneral || context == eContextPaint) {
+        ClipDescriptor *maskClip = context == eContextGeneral ? desc.defineClip("Mask") : desc.defineClip("Brush");
+        maskClip->addSupportedComponent(ePixelComponentAlpha);
+        maskClip->setTemporalClipAccess(false);
+        if (context == eContextGeneral)
+            maskClip->setOptional(true);
+        maskClip->setSupportsTiles(kSupportsTiles);
+        maskClip->setIsMask(true);
+    }
+
+    // make some pages and to things in
+    PageParamDescriptor *page = desc.definePageParam("Controls");
+
+    {
+        StringParamDescriptor *param = desc.defineStringParam(kParamFile);
+        param->setLabel(kParamFileLabel);
+        param->setHint(kParamFileHint);
+        param->setStringType(eStringTypeFilePath);
+        param->setFilePathExists(true);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamInterpolation);
+        param->setLabel(kParamInterpolationLabel);
+        param->setHint(kParamInterpolationHint);
+        assert(param->getNOptions() == eLut3DInterpolationTrilinear);
+        param->appendOption(kParamInterpolationOptionTrilinear, kParamInterpolationOptionTrilinearHint);
+        assert(param->getNOptions() == eLut3DInterpolationTetrahedral);
+        param->appendOption(kParamInterpolationOptionTetrahedral, kParamInterpolationOptionTetrahedralHint);
+        param->setDefault(eLut3DInterpolationTetrahedral);
+        param->setAnimates(true);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    ofxsPremultDescribeParams(desc, page);
+    ofxsMaskMixDescribeParams(desc, page);
+}
+
+OFX::ImageEffect*
+ColorLookup3DPluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
+{
+    return new ColorLookup3DPlugin(handle);
+}
+
+void getColorLookup3DPluginID(OFX::PluginFactoryArray &ids)
+{
+    static ColorLookup3DPluginFactory p(kPluginIdentifier, kPluginVersionMajor, kPluginVersionMinor);
+    ids.push_back(&p);
+}
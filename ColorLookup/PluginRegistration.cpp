@@ -1,4 +1,5 @@
 #include "ColorLookup.h"
+#include "ColorLookup3D.h"
 
 namespace OFX
 {
@@ -7,6 +8,7 @@ namespace OFX
         void getPluginIDs(OFX::PluginFactoryArray &ids)
         {
             getColorLookupPluginID(ids);
+            getColorLookup3DPluginID(ids);
         }
     }
 }
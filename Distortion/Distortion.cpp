@@ -86,6 +86,8 @@ action. Should the host be doing this instead?
 #include "Distortion.h"
 
 #include <cmath>
+#include <algorithm>
+#include <limits>
 #include <iostream>
 #include <sstream>
 #include <vector>
@@ -104,6 +106,7 @@ action. Should the host be doing this instead?
 #include "ofxsMatrix2D.h"
 #include "ofxsCopier.h"
 #include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
 
 #define kPluginIDistortName "IDistortOFX"
 #define kPluginIDistortGrouping "Transform"
@@ -142,7 +145,7 @@ action. Should the host be doing this instead?
 */
 
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -231,6 +234,30 @@ enum WrapEnum {
 #define kParamUVScaleLabel "UV Scale"
 #define kParamUVScaleHint "Scale factor to apply to the U and V channel (useful if these were stored in a file that can only store integer values)"
 
+#define kParamTightRoI "tightRoI"
+#define kParamTightRoILabel "Tight RoI"
+#define kParamTightRoIHint "Scan the UV map over each rendered region to compute the exact part of the source image that it needs, instead of asking the host for the full source image. This makes tiled renders of large images much lighter, at the cost of an extra pass on the UV map. The host must support fetching images while computing the regions of interest."
+
+#define kParamSampling "sampling"
+#define kParamSamplingLabel "Sampling"
+#define kParamSamplingHint "How the filter is applied where the distortion is not locally a translation."
+#define kParamSamplingOptionFilter "Filter"
+#define kParamSamplingOptionFilterHint "Always use the supersampling of the selected filter, which is the most accurate."
+#define kParamSamplingOptionAdaptiveFast "Adaptive (Fast)"
+#define kParamSamplingOptionAdaptiveFastHint "Evaluate the filter only once where the distortion is close to a translation or magnifies the image, and use an elliptical weighted average of at most 16 samples where it strongly minifies the image."
+#define kParamSamplingOptionAdaptiveQuality "Adaptive (Quality)"
+#define kParamSamplingOptionAdaptiveQualityHint "Evaluate the filter only once where the distortion is close to a translation or magnifies the image, and use an elliptical weighted average of at most 64 samples where it strongly minifies the image."
+
+enum SamplingEnum {
+	eSamplingFilter = 0,
+	eSamplingAdaptiveFast,
+	eSamplingAdaptiveQuality
+};
+
+// adaptive sampling: below this scale factor the filter is evaluated once, above the other one EWA is used
+#define kSamplingAdaptiveSingleScale 1.1
+#define kSamplingAdaptiveEWAScale 2.
+
 #define kParamDistortionModel "model"
 #define kParamDistortionModelLabel "Model"
 #define kParamDistortionModelHint "Choice of the distortion model, i.e. the function that goes from distorted to undistorted image coordinates."
@@ -297,6 +324,8 @@ static bool gHostHasNativeRGBACheckbox;
 
 using namespace OFX;
 
+struct LensDistortionMap;
+
 class DistortionProcessorBase : public OFX::ImageProcessor
 {
 protected:
@@ -329,6 +358,9 @@ protected:
 	double _squeeze;
 	double _ax;
 	double _ay;
+	const LensDistortionMap *_lensMap;
+	OfxRectI _srcRoDPixel;
+	int _ewaMaxTaps; // 0 if sampling is not adaptive
 	bool _blackOutside;
 	bool _doMasking;
 	double _mix;
@@ -367,6 +399,9 @@ public:
 		, _squeeze(1.)
 		, _ax(0.)
 		, _ay(0.)
+		, _lensMap(0)
+		, _srcRoDPixel()
+		, _ewaMaxTaps(0)
 		, _blackOutside(false)
 		, _doMasking(false)
 		, _mix(1.)
@@ -380,6 +415,26 @@ public:
 
 	void doMasking(bool v) { _doMasking = v; }
 
+	void setLensDistortionMap(const LensDistortionMap *map) { _lensMap = map; }
+
+	// the source RoD, which may be larger than the source image if the RoI is tight
+	void setSrcRoD(const OfxRectI &srcRoDPixel) { _srcRoDPixel = srcRoDPixel; }
+
+	void setSampling(SamplingEnum sampling)
+	{
+		switch (sampling) {
+		case eSamplingFilter:
+			_ewaMaxTaps = 0;
+			break;
+		case eSamplingAdaptiveFast:
+			_ewaMaxTaps = 16;
+			break;
+		case eSamplingAdaptiveQuality:
+			_ewaMaxTaps = 64;
+			break;
+		}
+	}
+
 	void setValues(bool processR,
 		bool processG,
 		bool processB,
@@ -495,6 +550,149 @@ double *xd, double *yd) // distorted position in normalized coordinates
 }
 #endif
 
+// Source position sampled by LensDistortion at the center of output pixel (x,y), in pixel coordinates
+static inline void
+lensDistortionSourcePosition(DistortionModelEnum distortionModel,
+const OfxRectI &srcBounds,
+double par,
+double k1, double k2,
+double cx, double cy,
+double squeeze,
+double ax, double ay,
+int x, int y,
+double *sx, double *sy)
+{
+	double fx = (srcBounds.x2 - srcBounds.x1) / 2.;
+	double fy = (srcBounds.y2 - srcBounds.y1) / 2.;
+	double f = std::max(fx, fy); // TODO: distortion scaling param for LensDistortion?
+	*sx = *sy = 0.;
+	switch (distortionModel) {
+	case eDistortionModelNuke: {
+		double xu = par * (x + 0.5 - (srcBounds.x2 + srcBounds.x1) / 2.) / f;
+		double yu = (y + 0.5 - (srcBounds.y2 + srcBounds.y1) / 2.) / f;
+		distort_nuke(xu, yu,
+			k1, k2, cx, cy, squeeze, ax, ay,
+			sx, sy);
+		*sx /= par;
+	}
+		break;
+	}
+	*sx *= f;
+	*sx += (srcBounds.x2 + srcBounds.x1) / 2.;
+	*sy *= f;
+	*sy += (srcBounds.y2 + srcBounds.y1) / 2.;
+}
+
+// The LensDistortion sampling map: the source position for each output pixel, as in an STMap.
+// It covers the render window plus a one-pixel margin, so that the Jacobian can always be
+// computed by central differences, and is reused by the renders whose window it covers.
+struct LensDistortionMapKey
+{
+	DistortionModelEnum distortionModel;
+	OfxRectI srcBounds;
+	OfxPointD renderScale;
+	double par;
+	double k1, k2;
+	double cx, cy;
+	double squeeze;
+	double ax, ay;
+
+	bool operator==(const LensDistortionMapKey &other) const
+	{
+		return (distortionModel == other.distortionModel &&
+			srcBounds.x1 == other.srcBounds.x1 && srcBounds.y1 == other.srcBounds.y1 &&
+			srcBounds.x2 == other.srcBounds.x2 && srcBounds.y2 == other.srcBounds.y2 &&
+			renderScale.x == other.renderScale.x && renderScale.y == other.renderScale.y &&
+			par == other.par &&
+			k1 == other.k1 && k2 == other.k2 &&
+			cx == other.cx && cy == other.cy &&
+			squeeze == other.squeeze &&
+			ax == other.ax && ay == other.ay);
+	}
+};
+
+// don't cache maps larger than this (each pixel takes two floats)
+#define kLensDistortionMapMaxPixels (16 * 1024 * 1024)
+
+// The map is shared by the plugin cache and the renders that use it: it is deleted when the last of them
+// releases it, with the plugin mutex locked.
+struct LensDistortionMap
+{
+	LensDistortionMap(const LensDistortionMapKey &key_, const OfxRectI &bounds_, OFX::ImageEffect *effect)
+		: key(key_)
+		, bounds(bounds_)
+		, mem(new OFX::ImageMemory(2 * sizeof(float) * (size_t)(bounds_.x2 - bounds_.x1) * (size_t)(bounds_.y2 - bounds_.y1), effect))
+		, data((float*)mem->lock())
+		, refCount(1)
+	{
+	}
+
+	// does the map cover the window, plus the margin needed by the central differences?
+	bool covers(const OfxRectI &window) const
+	{
+		return (bounds.x1 < window.x1 && window.x2 < bounds.x2 && bounds.y1 < window.y1 && window.y2 < bounds.y2);
+	}
+
+	LensDistortionMapKey key;
+	OfxRectI bounds; // render window plus margin
+	std::auto_ptr<OFX::ImageMemory> mem; // allocated by the host, so that it can account for it
+	float *data; // sx, sy for each pixel
+	int refCount;
+
+	// get the source position and its derivatives, returns false if (x,y) is not in the map
+	bool getSample(int x, int y, double *sx, double *sy, double *sxx, double *sxy, double *syx, double *syy) const
+	{
+		if (x <= bounds.x1 || bounds.x2 - 1 <= x || y <= bounds.y1 || bounds.y2 - 1 <= y) {
+			return false;
+		}
+		const int rowSize = 2 * (bounds.x2 - bounds.x1);
+		const float *p = &data[(y - bounds.y1) * (size_t)rowSize + 2 * (x - bounds.x1)];
+		*sx = p[0];
+		*sy = p[1];
+		*sxx = (p[2] - p[-2]) / 2.;
+		*syx = (p[3] - p[-1]) / 2.;
+		*sxy = (p[rowSize] - p[-rowSize]) / 2.;
+		*syy = (p[rowSize + 1] - p[-rowSize + 1]) / 2.;
+		return true;
+	}
+};
+
+// Fills the rows of a LensDistortionMap using all available threads
+class LensDistortionMapBuilder : public OFX::MultiThread::Processor
+{
+public:
+	LensDistortionMapBuilder(LensDistortionMap *map)
+		: _key(map->key)
+		, _map(map)
+	{
+	}
+
+	void build() { multiThread(); }
+
+private:
+	virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+	{
+		const OfxRectI &b = _map->bounds;
+		const int height = b.y2 - b.y1;
+		const int y1 = b.y1 + (int)(((long long)height * threadId) / nThreads);
+		const int y2 = b.y1 + (int)(((long long)height * (threadId + 1)) / nThreads);
+		for (int y = y1; y < y2; ++y) {
+			float *p = &_map->data[(y - b.y1) * 2 * (size_t)(b.x2 - b.x1)];
+			for (int x = b.x1; x < b.x2; ++x, p += 2) {
+				double sx, sy;
+				lensDistortionSourcePosition(_key.distortionModel, _key.srcBounds, _key.par,
+					_key.k1, _key.k2, _key.cx, _key.cy, _key.squeeze, _key.ax, _key.ay,
+					x, y, &sx, &sy);
+				p[0] = (float)sx;
+				p[1] = (float)sy;
+			}
+		}
+	}
+
+	const LensDistortionMapKey &_key;
+	LensDistortionMap *_map;
+};
+
 // The "filter" and "clamp" template parameters allow filter-specific optimization
 // by the compiler, using the same generic code for all filters.
 template <class PIX, int nComponents, int maxValue, DistortionPluginEnum plugin, FilterEnum filter, bool clamp>
@@ -572,6 +770,73 @@ private:
 		}
 	}
 
+	// The cost of the filter depends on the local scale of the distortion (the largest singular value of the Jacobian):
+	// the filter is evaluated once where the distortion is close to a translation or magnifies the image,
+	// and strong minifications use an elliptical weighted average (EWA, see Heckbert's thesis) with a bounded number
+	// of bilinear taps instead of supersampling the filter.
+	void adaptiveInterpolate(double sx, double sy, double Jxx, double Jxy, double Jyx, double Jyy, float *tmpPix)
+	{
+		double a = Jxx * Jxx + Jyx * Jyx;
+		double b = Jxx * Jxy + Jyx * Jyy;
+		double c = Jxy * Jxy + Jyy * Jyy;
+		double h = (a - c) / 2;
+		double scale2 = (a + c) / 2 + std::sqrt(h * h + b * b);
+		if (scale2 <= kSamplingAdaptiveSingleScale * kSamplingAdaptiveSingleScale) {
+			ofxsFilterInterpolate2D<PIX, nComponents, filter, clamp>(sx, sy, _srcImg, _blackOutside, tmpPix);
+			return;
+		}
+		if (scale2 < kSamplingAdaptiveEWAScale * kSamplingAdaptiveEWAScale) {
+			ofxsFilterInterpolate2DSuper<PIX, nComponents, filter, clamp>(sx, sy, Jxx, Jxy, Jyx, Jyy, _srcImg, _blackOutside, tmpPix);
+			return;
+		}
+		// the ellipse A.u^2 + B.u.v + C.v^2 = F, convolved with a one-pixel reconstruction filter
+		double A = Jyx * Jyx + Jyy * Jyy + 1.;
+		double B = -2. * (Jxx * Jyx + Jxy * Jyy);
+		double C = Jxx * Jxx + Jxy * Jxy + 1.;
+		double F = A * C - B * B / 4.;
+		A /= F;
+		B /= F;
+		C /= F;
+		// half-size of the bounding box of the ellipse
+		double uMax = std::sqrt(C * F);
+		double vMax = std::sqrt(A * F);
+		// at most sqrt(_ewaMaxTaps) taps along the minor axis, and the rest of the budget along the major axis,
+		// so that (2nu+1)(2nv+1) <= _ewaMaxTaps even for very anisotropic footprints
+		const bool uMajor = uMax >= vMax;
+		double minorMax = uMajor ? vMax : uMax;
+		double majorMax = uMajor ? uMax : vMax;
+		double minorStep = std::max(1., 2. * minorMax / std::max(1., std::sqrt((double)_ewaMaxTaps) - 1.));
+		int nMinor = (int)(minorMax / minorStep);
+		double majorStep = std::max(1., 2. * majorMax / std::max(1., (double)_ewaMaxTaps / (2 * nMinor + 1) - 1.));
+		int nMajor = (int)(majorMax / majorStep);
+		double uStep = uMajor ? majorStep : minorStep;
+		double vStep = uMajor ? minorStep : majorStep;
+		int nu = uMajor ? nMajor : nMinor;
+		int nv = uMajor ? nMinor : nMajor;
+		float accPix[4] = { 0., 0., 0., 0. };
+		double accWeight = 0.;
+		for (int j = -nv; j <= nv; ++j) {
+			double v = j * vStep;
+			for (int i = -nu; i <= nu; ++i) {
+				double u = i * uStep;
+				double q = A * u * u + B * u * v + C * v * v;
+				if (q < 1.) {
+					double w = std::exp(-2. * q);
+					float tapPix[4];
+					ofxsFilterInterpolate2D<PIX, nComponents, eFilterBilinear, false>(sx + u, sy + v, _srcImg, _blackOutside, tapPix);
+					for (int k = 0; k < nComponents; ++k) {
+						accPix[k] += (float)w * tapPix[k];
+					}
+					accWeight += w;
+				}
+			}
+		}
+		// the center tap is always in the ellipse
+		for (int k = 0; k < nComponents; ++k) {
+			tmpPix[k] = (float)(accPix[k] / accWeight);
+		}
+	}
+
 	void multiThreadProcessImages(OfxRectI procWindow)
 	{
 		assert(nComponents == 1 || nComponents == 3 || nComponents == 4);
@@ -583,18 +848,13 @@ private:
 		compFromChannel(_uChannel, &uImg, &uComp);
 		compFromChannel(_vChannel, &vImg, &vComp);
 		int srcx1 = 0, srcx2 = 1, srcy1 = 0, srcy2 = 0;
-		double f = 0, par = 1.;
+		OfxRectI srcBounds = { 0, 0, 1, 0 };
 		if ((plugin == eDistortionPluginSTMap || plugin == eDistortionPluginLensDistortion) && _srcImg) {
-			const OfxRectI& srcBounds = _srcImg->getBounds();
+			srcBounds = _srcRoDPixel;
 			srcx1 = srcBounds.x1;
 			srcx2 = srcBounds.x2;
 			srcy1 = srcBounds.y1;
 			srcy2 = srcBounds.y2;
-			if (plugin == eDistortionPluginLensDistortion) {
-				double fx = (srcBounds.x2 - srcBounds.x1) / 2.;
-				double fy = (srcBounds.y2 - srcBounds.y1) / 2.;
-				f = std::max(fx, fy); // TODO: distortion scaling param for LensDistortion?
-			}
 		}
 		float tmpPix[4];
 		for (int y = procWindow.y1; y < procWindow.y2; y++) {
@@ -683,25 +943,31 @@ private:
 				}
 					break;
 				case eDistortionPluginLensDistortion: {
-														  switch (_distortionModel) {
-														  case eDistortionModelNuke: {
-																						 double xu = _par * (x + 0.5 - (srcx2 + srcx1) / 2.) / f;
-																						 double yu = (y + 0.5 - (srcy2 + srcy1) / 2.) / f;
-																						 distort_nuke(xu, yu,
-																							 _k1, _k2, _cx / par, _cy, _squeeze, _ax, _ay,
-																							 &sx, &sy);
-																						 sx /= _par;
-														  }
-															  break;
+														  if (!_lensMap || !_lensMap->getSample(x, y, &sx, &sy, &sxx, &sxy, &syx, &syy)) {
+															  lensDistortionSourcePosition(_distortionModel, srcBounds, _par,
+																  _k1, _k2, _cx, _cy, _squeeze, _ax, _ay,
+																  x, y, &sx, &sy);
+															  if (filter != eFilterImpulse) {
+																  // Jacobian by central differences, as in the cached map
+																  double sxn, syn, sxp, syp;
+																  lensDistortionSourcePosition(_distortionModel, srcBounds, _par,
+																	  _k1, _k2, _cx, _cy, _squeeze, _ax, _ay,
+																	  x + 1, y, &sxn, &syn);
+																  lensDistortionSourcePosition(_distortionModel, srcBounds, _par,
+																	  _k1, _k2, _cx, _cy, _squeeze, _ax, _ay,
+																	  x - 1, y, &sxp, &syp);
+																  sxx = (sxn - sxp) / 2.;
+																  syx = (syn - syp) / 2.;
+																  lensDistortionSourcePosition(_distortionModel, srcBounds, _par,
+																	  _k1, _k2, _cx, _cy, _squeeze, _ax, _ay,
+																	  x, y + 1, &sxn, &syn);
+																  lensDistortionSourcePosition(_distortionModel, srcBounds, _par,
+																	  _k1, _k2, _cx, _cy, _squeeze, _ax, _ay,
+																	  x, y - 1, &sxp, &syp);
+																  sxy = (sxn - sxp) / 2.;
+																  syy = (syn - syp) / 2.;
+															  }
 														  }
-														  sx *= f;
-														  sx += (srcx2 + srcx1) / 2.;
-														  sy *= f;
-														  sy += (srcy2 + srcy1) / 2.;
-														  sxx = 1; // TODO: Jacobian
-														  sxy = 0;
-														  syx = 0;
-														  syy = 1;
 				}
 					break;
 				}
@@ -737,9 +1003,12 @@ private:
 				if (filter == eFilterImpulse) {
 					ofxsFilterInterpolate2D<PIX, nComponents, filter, clamp>(sx, sy, _srcImg, _blackOutside, tmpPix);
 				}
-				else {
+				else if (_ewaMaxTaps == 0) {
 					ofxsFilterInterpolate2DSuper<PIX, nComponents, filter, clamp>(sx, sy, Jxx, Jxy, Jyx, Jyy, _srcImg, _blackOutside, tmpPix);
 				}
+				else {
+					adaptiveInterpolate(sx, sy, Jxx, Jxy, Jyx, Jyy, tmpPix);
+				}
 				ofxsMaskMix<PIX, nComponents, maxValue, true>(tmpPix, x, y, _srcImg, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
 				// copy back original values from unprocessed channels
 				if (nComponents == 1) {
@@ -774,6 +1043,103 @@ private:
 };
 
 
+// Bounding box of the positions sampled in the source image, in pixel coordinates
+struct SourceBoundingBox
+{
+	double x1, y1, x2, y2;
+
+	SourceBoundingBox()
+		: x1(std::numeric_limits<double>::infinity())
+		, y1(std::numeric_limits<double>::infinity())
+		, x2(-std::numeric_limits<double>::infinity())
+		, y2(-std::numeric_limits<double>::infinity())
+	{
+	}
+
+	bool isEmpty() const { return x2 < x1 || y2 < y1; }
+
+	void add(double x, double y)
+	{
+		// also skips NaNs
+		if (!(std::abs(x) <= std::numeric_limits<double>::max() && std::abs(y) <= std::numeric_limits<double>::max())) {
+			return;
+		}
+		x1 = std::min(x1, x);
+		x2 = std::max(x2, x);
+		y1 = std::min(y1, y);
+		y2 = std::max(y2, y);
+	}
+};
+
+// How STMap and IDistort get the source position from the UV map (see DistortionProcessor)
+struct UVMapping
+{
+	int uComp, vComp; // -1 if the channel is a constant
+	double uConst, vConst;
+	double uOffset, vOffset;
+	double uScale, vScale;
+	OfxRectI srcRoDPixel;
+};
+
+static int
+uvComponent(InputChannelEnum channel, int nComponents)
+{
+	switch (channel) {
+	case eInputChannelR:
+		return (nComponents >= 3) ? 0 : -1;
+	case eInputChannelG:
+		return (nComponents >= 3) ? 1 : -1;
+	case eInputChannelB:
+		return (nComponents >= 3) ? 2 : -1;
+	case eInputChannelA:
+		return (nComponents == 4) ? 3 : ((nComponents == 1) ? 0 : -1);
+	case eInputChannel0:
+	case eInputChannel1:
+		return -1;
+	}
+	return -1;
+}
+
+// scan the UV map over window and add the unwrapped source positions to bbox
+template <class PIX, DistortionPluginEnum plugin>
+static void
+uvSourceBoundingBox(const OFX::Image *uvImg, const UVMapping &m, const OfxRectI &window, SourceBoundingBox *bbox)
+{
+	const OfxRectI &srcRoD = m.srcRoDPixel;
+	for (int y = window.y1; y < window.y2; ++y) {
+		for (int x = window.x1; x < window.x2; ++x) {
+			const PIX *uvPix = (const PIX *)(uvImg ? uvImg->getPixelAddress(x, y) : 0);
+			double u = (m.uComp < 0) ? m.uConst : (uvPix ? (double)uvPix[m.uComp] : 0.);
+			double v = (m.vComp < 0) ? m.vConst : (uvPix ? (double)uvPix[m.vComp] : 0.);
+			u = (u - m.uOffset) * m.uScale;
+			v = (v - m.vOffset) * m.vScale;
+			if (plugin == eDistortionPluginSTMap) {
+				bbox->add(srcRoD.x1 + u * (srcRoD.x2 - srcRoD.x1), srcRoD.y1 + v * (srcRoD.y2 - srcRoD.y1));
+			}
+			else {
+				bbox->add(x + u + 0.5, y + v + 0.5);
+			}
+		}
+	}
+}
+
+// number of pixels around a sample position that are used by the filter
+static int
+filterRadius(FilterEnum filter)
+{
+	switch (filter) {
+	case eFilterImpulse:
+		return 0;
+	case eFilterBilinear:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+// LensDistortion evaluates the model on the border of the window and on a grid of this step inside it
+#define kLensDistortionRoIGridStep 16
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class DistortionPlugin : public OFX::ImageEffect
@@ -796,6 +1162,7 @@ public:
 		, _uvScale(0)
 		, _uWrap(0)
 		, _vWrap(0)
+		, _tightRoI(0)
 		, _distortionModel(0)
 		, _k1(0)
 		, _k2(0)
@@ -808,9 +1175,13 @@ public:
 		, _filter(0)
 		, _clamp(0)
 		, _blackOutside(0)
+		, _sampling(0)
 		, _mix(0)
 		, _maskInvert(0)
 		, _plugin(plugin)
+		, _lensMapMutex()
+		, _lensMap(0)
+		, _lensMapBuilding(false)
 	{
 		_dstClip = fetchClip(kOfxImageEffectOutputClipName);
 		assert(_dstClip && (_dstClip->getPixelComponents() == ePixelComponentRGB || _dstClip->getPixelComponents() == ePixelComponentRGBA || _dstClip->getPixelComponents() == ePixelComponentAlpha));
@@ -834,7 +1205,8 @@ public:
 			_vChannel = fetchChoiceParam(kParamChannelV);
 			_uvOffset = fetchDouble2DParam(kParamUVOffset);
 			_uvScale = fetchDouble2DParam(kParamUVScale);
-			assert(_uChannel && _vChannel && _uvOffset && _uvScale);
+			_tightRoI = fetchBooleanParam(kParamTightRoI);
+			assert(_uChannel && _vChannel && _uvOffset && _uvScale && _tightRoI);
 			if (plugin == eDistortionPluginSTMap) {
 				_uWrap = fetchChoiceParam(kParamWrapU);
 				_vWrap = fetchChoiceParam(kParamWrapV);
@@ -856,7 +1228,8 @@ public:
 		_filter = fetchChoiceParam(kParamFilterType);
 		_clamp = fetchBooleanParam(kParamFilterClamp);
 		_blackOutside = fetchBooleanParam(kParamFilterBlackOutside);
-		assert(_filter && _clamp && _blackOutside);
+		_sampling = fetchChoiceParam(kParamSampling);
+		assert(_filter && _clamp && _blackOutside && _sampling);
 		_mix = fetchDoubleParam(kParamMix);
 		_maskInvert = fetchBooleanParam(kParamMaskInvert);
 		assert(_mix && _maskInvert);
@@ -864,6 +1237,11 @@ public:
 		updateVisibility();
 	}
 
+	virtual ~DistortionPlugin()
+	{
+		purgeCaches();
+	}
+
 private:
 	// override the roi call
 	virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
@@ -883,8 +1261,26 @@ private:
 	/* set up and run a processor */
 	void setupAndProcess(DistortionProcessorBase &, const OFX::RenderArguments &args);
 
+	bool getSourceBoundingBox(double time, const OfxPointD &renderScale, const OfxRectI &window, const OfxRectI &srcRoDPixel, SourceBoundingBox *bbox);
+
 	virtual bool isIdentity(const IsIdentityArguments &args, Clip * &identityClip, double &identityTime) OVERRIDE FINAL;
 
+	// free the cached LensDistortion map (the renders that use it keep it until they are done)
+	virtual void purgeCaches() OVERRIDE FINAL
+	{
+		OFX::MultiThread::AutoMutex lock(_lensMapMutex);
+		releaseLensMap(_lensMap);
+		_lensMap = 0;
+	}
+
+	// release a reference to a LensDistortion map. _lensMapMutex must be locked.
+	static void releaseLensMap(LensDistortionMap *map)
+	{
+		if (map && --map->refCount == 0) {
+			delete map;
+		}
+	}
+
 	/** @brief called when a param has just had its value changed */
 	void changedParam(const InstanceChangedArgs &args, const std::string &paramName)
 	{
@@ -931,6 +1327,7 @@ private:
 	OFX::Double2DParam *_uvScale;
 	OFX::ChoiceParam* _uWrap;
 	OFX::ChoiceParam* _vWrap;
+	OFX::BooleanParam* _tightRoI;
 	OFX::ChoiceParam* _distortionModel;
 	OFX::DoubleParam* _k1;
 	OFX::DoubleParam* _k2;
@@ -943,9 +1340,40 @@ private:
 	OFX::ChoiceParam* _filter;
 	OFX::BooleanParam* _clamp;
 	OFX::BooleanParam* _blackOutside;
+	OFX::ChoiceParam* _sampling;
 	OFX::DoubleParam* _mix;
 	OFX::BooleanParam* _maskInvert;
 	DistortionPluginEnum _plugin;
+
+	// LensDistortion sampling map, shared by all renders with the same parameters whose window it covers.
+	// It is built without the mutex locked, by one render at a time: the renders that cannot use the cached map
+	// while another one is built evaluate the distortion at each pixel.
+	OFX::MultiThread::Mutex _lensMapMutex;
+	LensDistortionMap *_lensMap;
+	bool _lensMapBuilding;
+
+	friend class LensDistortionMapUser;
+};
+
+// Holds a reference to a LensDistortion map during the lifetime of the object
+class LensDistortionMapUser
+{
+public:
+	LensDistortionMapUser(DistortionPlugin *plugin, LensDistortionMap *map)
+		: _plugin(plugin)
+		, _map(map)
+	{
+	}
+
+	~LensDistortionMapUser()
+	{
+		OFX::MultiThread::AutoMutex lock(_plugin->_lensMapMutex);
+		DistortionPlugin::releaseLensMap(_map);
+	}
+
+private:
+	DistortionPlugin *_plugin;
+	LensDistortionMap *_map;
 };
 
 
@@ -1029,6 +1457,11 @@ DistortionPlugin::setupAndProcess(DistortionProcessorBase &processor, const OFX:
 	// set the images
 	processor.setDstImg(dst.get());
 	processor.setSrcImgs(src.get(), uv.get());
+	OfxRectI srcRoDPixel = { 0, 0, 0, 0 };
+	if (src.get()) {
+		MergeImages2D::toPixelEnclosing(_srcClip->getRegionOfDefinition(time), args.renderScale, _srcClip->getPixelAspectRatio(), &srcRoDPixel);
+	}
+	processor.setSrcRoD(srcRoDPixel);
 	// set the render window
 	processor.setRenderWindow(args.renderWindow);
 
@@ -1067,6 +1500,9 @@ DistortionPlugin::setupAndProcess(DistortionProcessorBase &processor, const OFX:
 	}
 	bool blackOutside;
 	_blackOutside->getValueAtTime(time, blackOutside);
+	int sampling_i;
+	_sampling->getValueAtTime(time, sampling_i);
+	processor.setSampling((SamplingEnum)sampling_i);
 	double mix;
 	_mix->getValueAtTime(time, mix);
 
@@ -1120,6 +1556,68 @@ DistortionPlugin::setupAndProcess(DistortionProcessorBase &processor, const OFX:
 		}
 
 	}
+	// The sampling map only depends on the distortion parameters, the render scale and the source bounds:
+	// compute it once, and only do the filtered gather on the following renders of the same window, or of a
+	// part of it.
+	std::auto_ptr<LensDistortionMapUser> lensMapUser;
+	if (_plugin == eDistortionPluginLensDistortion && src.get()) {
+		LensDistortionMapKey key;
+		key.distortionModel = distortionModel;
+		key.srcBounds = srcRoDPixel;
+		key.renderScale = args.renderScale;
+		key.par = par;
+		key.k1 = k1;
+		key.k2 = k2;
+		key.cx = cx;
+		key.cy = cy;
+		key.squeeze = squeeze;
+		key.ax = ax;
+		key.ay = ay;
+		OfxRectI mapBounds = args.renderWindow;
+		mapBounds.x1 -= 1;
+		mapBounds.y1 -= 1;
+		mapBounds.x2 += 1;
+		mapBounds.y2 += 1;
+		double mapPixels = (double)(mapBounds.x2 - mapBounds.x1) * (double)(mapBounds.y2 - mapBounds.y1);
+		if (key.srcBounds.x1 < key.srcBounds.x2 && key.srcBounds.y1 < key.srcBounds.y2 && mapPixels <= kLensDistortionMapMaxPixels) {
+			LensDistortionMap *map = 0;
+			bool build = false;
+			{
+				OFX::MultiThread::AutoMutex lock(_lensMapMutex);
+				if (_lensMap && _lensMap->key == key && _lensMap->covers(args.renderWindow)) {
+					map = _lensMap;
+					++map->refCount;
+				} else if (!_lensMapBuilding) {
+					_lensMapBuilding = true;
+					build = true;
+				}
+			}
+			// if another render is building a map, the distortion is evaluated at each pixel
+			if (build) {
+				std::auto_ptr<LensDistortionMap> newMap;
+				try {
+					newMap.reset(new LensDistortionMap(key, mapBounds, this));
+					LensDistortionMapBuilder builder(newMap.get());
+					builder.build();
+				} catch (...) {
+					OFX::MultiThread::AutoMutex lock(_lensMapMutex);
+					_lensMapBuilding = false;
+					throw;
+				}
+				OFX::MultiThread::AutoMutex lock(_lensMapMutex);
+				_lensMapBuilding = false;
+				// replace the cached map: the renders using the previous one keep it until they are done
+				releaseLensMap(_lensMap);
+				_lensMap = newMap.release();
+				map = _lensMap;
+				++map->refCount;
+			}
+			if (map) {
+				lensMapUser.reset(new LensDistortionMapUser(this, map));
+				processor.setLensDistortionMap(map);
+			}
+		}
+	}
 	processor.setValues(processR, processG, processB, processA,
 		transformIsIdentity, srcTransformInverse,
 		uChannel, vChannel,
@@ -1328,6 +1826,140 @@ DistortionPlugin::isIdentity(const IsIdentityArguments &args, Clip * &identityCl
 	return false;
 }
 
+// Compute the bounding box of the positions sampled in the source image when rendering window (in pixel coordinates).
+// Returns false if it cannot be computed, in which case the whole source image may be needed.
+bool
+DistortionPlugin::getSourceBoundingBox(double time,
+const OfxPointD &renderScale,
+const OfxRectI &window,
+const OfxRectI &srcRoDPixel,
+SourceBoundingBox *bbox)
+{
+	switch (_plugin) {
+	case eDistortionPluginSTMap:
+	case eDistortionPluginIDistort: {
+		bool tightRoI;
+		_tightRoI->getValueAtTime(time, tightRoI);
+		if (!tightRoI || !_uvClip || !_uvClip->isConnected()) {
+			return false;
+		}
+		bool wrapU = false, wrapV = false;
+		if (_plugin == eDistortionPluginSTMap) {
+			int uWrap_i, vWrap_i;
+			_uWrap->getValueAtTime(time, uWrap_i);
+			_vWrap->getValueAtTime(time, vWrap_i);
+			wrapU = ((WrapEnum)uWrap_i != eWrapClamp);
+			wrapV = ((WrapEnum)vWrap_i != eWrapClamp);
+			if (wrapU && wrapV) {
+				return false;
+			}
+		}
+		std::auto_ptr<const OFX::Image> uv(_uvClip->fetchImage(time));
+		if (!uv.get() ||
+			uv->getRenderScale().x != renderScale.x ||
+			uv->getRenderScale().y != renderScale.y) {
+			return false;
+		}
+		int uChannel_i, vChannel_i;
+		_uChannel->getValueAtTime(time, uChannel_i);
+		_vChannel->getValueAtTime(time, vChannel_i);
+		UVMapping m;
+		m.uComp = uvComponent((InputChannelEnum)uChannel_i, uv->getPixelComponentCount());
+		m.vComp = uvComponent((InputChannelEnum)vChannel_i, uv->getPixelComponentCount());
+		m.uConst = ((InputChannelEnum)uChannel_i == eInputChannel1) ? 1. : 0.;
+		m.vConst = ((InputChannelEnum)vChannel_i == eInputChannel1) ? 1. : 0.;
+		_uvOffset->getValueAtTime(time, m.uOffset, m.vOffset);
+		_uvScale->getValueAtTime(time, m.uScale, m.vScale);
+		m.srcRoDPixel = srcRoDPixel;
+		if (_plugin == eDistortionPluginIDistort) {
+			// in IDistort, displacement is given in full-scale pixels
+			m.uScale *= renderScale.x;
+			m.vScale *= renderScale.y;
+		}
+		switch (uv->getPixelDepth()) {
+		case OFX::eBitDepthUByte:
+			if (_plugin == eDistortionPluginSTMap) {
+				uvSourceBoundingBox<unsigned char, eDistortionPluginSTMap>(uv.get(), m, window, bbox);
+			}
+			else {
+				uvSourceBoundingBox<unsigned char, eDistortionPluginIDistort>(uv.get(), m, window, bbox);
+			}
+			break;
+		case OFX::eBitDepthUShort:
+			if (_plugin == eDistortionPluginSTMap) {
+				uvSourceBoundingBox<unsigned short, eDistortionPluginSTMap>(uv.get(), m, window, bbox);
+			}
+			else {
+				uvSourceBoundingBox<unsigned short, eDistortionPluginIDistort>(uv.get(), m, window, bbox);
+			}
+			break;
+		case OFX::eBitDepthFloat:
+			if (_plugin == eDistortionPluginSTMap) {
+				uvSourceBoundingBox<float, eDistortionPluginSTMap>(uv.get(), m, window, bbox);
+			}
+			else {
+				uvSourceBoundingBox<float, eDistortionPluginIDistort>(uv.get(), m, window, bbox);
+			}
+			break;
+		default:
+			return false;
+		}
+		// wrapped coordinates may fall anywhere in the source
+		if (!bbox->isEmpty()) {
+			if (wrapU) {
+				bbox->x1 = srcRoDPixel.x1;
+				bbox->x2 = srcRoDPixel.x2;
+			}
+			if (wrapV) {
+				bbox->y1 = srcRoDPixel.y1;
+				bbox->y2 = srcRoDPixel.y2;
+			}
+		}
+		return true;
+	}
+	case eDistortionPluginLensDistortion: {
+		int distortionModel_i;
+		_distortionModel->getValue(distortionModel_i);
+		DistortionModelEnum distortionModel = (DistortionModelEnum)distortionModel_i;
+		double par = 1., k1 = 0., k2 = 0., cx = 0., cy = 0., squeeze = 1., ax = 0., ay = 0.;
+		switch (distortionModel) {
+		case eDistortionModelNuke:
+			par = _srcClip->getPixelAspectRatio();
+			_k1->getValueAtTime(time, k1);
+			_k2->getValueAtTime(time, k2);
+			_center->getValueAtTime(time, cx, cy);
+			_squeeze->getValueAtTime(time, squeeze);
+			_asymmetric->getValueAtTime(time, ax, ay);
+			break;
+		}
+		// The model is smooth, so that its extrema are reached on the border of the window.
+		// A coarse grid inside the window is also evaluated, for strong distortions.
+		for (int y = window.y1; y < window.y2; ++y) {
+			int xStep;
+			if (y == window.y1 || y == window.y2 - 1) {
+				xStep = 1;
+			}
+			else if ((y - window.y1) % kLensDistortionRoIGridStep == 0) {
+				xStep = kLensDistortionRoIGridStep;
+			}
+			else {
+				xStep = std::max(1, window.x2 - 1 - window.x1);
+			}
+			for (int x = window.x1; x < window.x2; x += xStep) {
+				double sx, sy;
+				lensDistortionSourcePosition(distortionModel, srcRoDPixel, par, k1, k2, cx, cy, squeeze, ax, ay, x, y, &sx, &sy);
+				bbox->add(sx, sy);
+			}
+			double sx, sy;
+			lensDistortionSourcePosition(distortionModel, srcRoDPixel, par, k1, k2, cx, cy, squeeze, ax, ay, window.x2 - 1, y, &sx, &sy);
+			bbox->add(sx, sy);
+		}
+		return true;
+	}
+	}
+	return false;
+}
+
 // override the roi call
 // Required if the plugin requires a region from the inputs which is different from the rendered region of the output.
 // (this is the case here)
@@ -1339,9 +1971,42 @@ OFX::RegionOfInterestSetter &rois)
 	if (!_srcClip) {
 		return;
 	}
-	// ask for full RoD of srcClip
 	const OfxRectD& srcRod = _srcClip->getRegionOfDefinition(time);
-	rois.setRegionOfInterest(*_srcClip, srcRod);
+	OfxRectD srcRoI = srcRod;
+	const double par = _srcClip->getPixelAspectRatio();
+	OfxRectI srcRoDPixel;
+	OfxRectI window;
+	MergeImages2D::toPixelEnclosing(srcRod, args.renderScale, par, &srcRoDPixel);
+	MergeImages2D::toPixelEnclosing(args.regionOfInterest, args.renderScale, par, &window);
+	SourceBoundingBox bbox;
+	if (window.x1 < window.x2 && window.y1 < window.y2 &&
+		srcRoDPixel.x1 < srcRoDPixel.x2 && srcRoDPixel.y1 < srcRoDPixel.y2 &&
+		getSourceBoundingBox(time, args.renderScale, window, srcRoDPixel, &bbox)) {
+		// the source pixels under the window are also used for masking, mixing and unprocessed channels
+		OfxRectI roiPixel = window;
+		if (!bbox.isEmpty()) {
+			int filter = eFilterCubic;
+			_filter->getValueAtTime(time, filter);
+			// supersampling enlarges the filter footprint by about the scale of the distortion
+			double scale = std::max(1., std::max((bbox.x2 - bbox.x1) / (window.x2 - window.x1),
+				(bbox.y2 - bbox.y1) / (window.y2 - window.y1)));
+			int pad = (int)std::ceil(filterRadius((FilterEnum)filter) * scale) + 1;
+			// positions outside of the source use its edges
+			OfxRectI bboxPixel;
+			bboxPixel.x1 = (int)std::floor(std::min(std::max(bbox.x1, (double)srcRoDPixel.x1), (double)srcRoDPixel.x2)) - pad;
+			bboxPixel.y1 = (int)std::floor(std::min(std::max(bbox.y1, (double)srcRoDPixel.y1), (double)srcRoDPixel.y2)) - pad;
+			bboxPixel.x2 = (int)std::ceil(std::min(std::max(bbox.x2, (double)srcRoDPixel.x1), (double)srcRoDPixel.x2)) + pad;
+			bboxPixel.y2 = (int)std::ceil(std::min(std::max(bbox.y2, (double)srcRoDPixel.y1), (double)srcRoDPixel.y2)) + pad;
+			MergeImages2D::rectBoundingBox(bboxPixel, roiPixel, &roiPixel);
+		}
+		MergeImages2D::toCanonical(roiPixel, args.renderScale, par, &srcRoI);
+		if (!MergeImages2D::rectIntersection(srcRoI, srcRod, &srcRoI)) {
+			// no source pixel is needed
+			srcRoI.x1 = srcRoI.x2 = srcRod.x1;
+			srcRoI.y1 = srcRoI.y2 = srcRod.y1;
+		}
+	}
+	rois.setRegionOfInterest(*_srcClip, srcRoI);
 	// only ask for the renderWindow (intersected with the RoD) from uvClip
 	if (_uvClip) {
 		OfxRectD uvRoI = _uvClip->getRegionOfDefinition(time);
@@ -1637,6 +2302,16 @@ void DistortionPluginFactory<plugin>::describeInContext(OFX::ImageEffectDescript
 			}
 		}
 		}
+		{
+			BooleanParamDescriptor *param = desc.defineBooleanParam(kParamTightRoI);
+			param->setLabel(kParamTightRoILabel);
+			param->setHint(kParamTightRoIHint);
+			param->setDefault(false);
+			param->setAnimates(false);
+			if (page) {
+				page->addChild(*param);
+			}
+		}
 	}
 
 	if (plugin == eDistortionPluginLensDistortion) {
@@ -1732,6 +2407,22 @@ void DistortionPluginFactory<plugin>::describeInContext(OFX::ImageEffectDescript
 	}
 
 	ofxsFilterDescribeParamsInterpolate2D(desc, page, (plugin == eDistortionPluginSTMap));
+	{
+		ChoiceParamDescriptor *param = desc.defineChoiceParam(kParamSampling);
+		param->setLabel(kParamSamplingLabel);
+		param->setHint(kParamSamplingHint);
+		assert(param->getNOptions() == eSamplingFilter);
+		param->appendOption(kParamSamplingOptionFilter, kParamSamplingOptionFilterHint);
+		assert(param->getNOptions() == eSamplingAdaptiveFast);
+		param->appendOption(kParamSamplingOptionAdaptiveFast, kParamSamplingOptionAdaptiveFastHint);
+		assert(param->getNOptions() == eSamplingAdaptiveQuality);
+		param->appendOption(kParamSamplingOptionAdaptiveQuality, kParamSamplingOptionAdaptiveQualityHint);
+		param->setDefault(eSamplingFilter);
+		param->setAnimates(false);
+		if (page) {
+			page->addChild(*param);
+		}
+	}
 	ofxsMaskMixDescribeParams(desc, page);
 }
 
@@ -73,6 +73,7 @@
 #include "Merge.h"
 
 #include <cmath>
+#include <algorithm>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -89,7 +90,7 @@
 #define kPluginDescription "Pixel-by-pixel merge operation between the two inputs."
 #define kPluginIdentifier "net.sf.openfx.MergePlugin"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -180,6 +181,74 @@ public:
 
 
 
+// Row kernels.
+// The kernel is selected once per render by getMergeRowFunction(), instead of once per pixel.
+// A, B and dst are normalized float rows of n pixels. dst must not alias A or B.
+typedef void (*MergeRowFunction)(MergingFunctionEnum f, bool alphaMasking, const float *A, const float *B, float *dst, int n);
+
+// the generic kernel, also used as a fallback for the less common operations: the operation is tested for each pixel
+template <int nComponents>
+static inline void
+mergeRowGeneric(MergingFunctionEnum f, bool alphaMasking, const float *A, const float *B, float *dst, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        mergePixel<float, nComponents, 1>(f, alphaMasking, A, B, dst);
+        A += nComponents;
+        B += nComponents;
+        dst += nComponents;
+    }
+}
+
+// The merging operation and the alpha masking flag are template parameters: once the generic kernel is inlined,
+// the switch in mergePixel() is resolved at compile-time and the inner loop may be vectorized by the compiler.
+template <int nComponents, MergingFunctionEnum f, bool alphaMasking>
+static void
+mergeRow(MergingFunctionEnum /*f*/, bool /*alphaMasking*/, const float *A, const float *B, float *dst, int n)
+{
+    mergeRowGeneric<nComponents>(f, alphaMasking, A, B, dst, n);
+}
+
+template <int nComponents>
+static MergeRowFunction
+getMergeRowFunction(MergingFunctionEnum f, bool alphaMasking)
+{
+#define MERGE_ROW_CASE(op) \
+    case op: \
+        return alphaMasking ? &mergeRow<nComponents, op, true> : &mergeRow<nComponents, op, false>
+
+    switch (f) {
+        MERGE_ROW_CASE(eMergeATop);
+        MERGE_ROW_CASE(eMergeIn);
+        MERGE_ROW_CASE(eMergeLighten);
+        MERGE_ROW_CASE(eMergeDarken);
+        MERGE_ROW_CASE(eMergeMultiply);
+        MERGE_ROW_CASE(eMergeOut);
+        MERGE_ROW_CASE(eMergeOver);
+        MERGE_ROW_CASE(eMergePlus);
+        MERGE_ROW_CASE(eMergeScreen);
+        MERGE_ROW_CASE(eMergeCopy);
+        MERGE_ROW_CASE(eMergeMinus);
+        MERGE_ROW_CASE(eMergeFrom);
+        MERGE_ROW_CASE(eMergeDifference);
+        MERGE_ROW_CASE(eMergeMask);
+        MERGE_ROW_CASE(eMergeStencil);
+        MERGE_ROW_CASE(eMergeUnder);
+        default:
+            break;
+    }
+#undef MERGE_ROW_CASE
+    return &mergeRowGeneric<nComponents>;
+}
+
+// an interval [x1,x2) of a row where the set of defined main inputs is constant
+struct MergeRowSpan
+{
+    int x1;
+    int x2;
+    bool hasA;
+    bool hasB;
+};
+
 template <class PIX, int nComponents, int maxValue>
 class MergeProcessor : public MergeProcessorBase
 {
@@ -190,12 +259,81 @@ public:
     }
     
 private:
+    // compute the part [*sx1,*sx2) of [x1,x2) where row y of img is defined.
+    // returns false if it is empty.
+    static bool getRowSpan(const OFX::Image *img, int y, int x1, int x2, int *sx1, int *sx2)
+    {
+        if (!img) {
+            return false;
+        }
+        const OfxRectI& bounds = img->getBounds();
+        if (y < bounds.y1 || bounds.y2 <= y) {
+            return false;
+        }
+        *sx1 = std::max(x1, bounds.x1);
+        *sx2 = std::min(x2, bounds.x2);
+        return *sx1 < *sx2;
+    }
+
+    // convert pixels [sx1,sx2) of row y of img to normalized float, and store them in buf
+    static void fetchRow(const OFX::Image *img, int y, int sx1, int sx2, float *buf)
+    {
+        const PIX *srcPix = (const PIX *) img->getPixelAddress(sx1, y);
+        assert(srcPix);
+        for (int i = 0; i < (sx2 - sx1) * nComponents; ++i) {
+            buf[i] = (float)srcPix[i] / maxValue;
+        }
+    }
+
+    // split [x1,x2) into spans where the set of defined inputs (A and/or B) is constant.
+    static void planRowSpans(int x1, int x2,
+                             bool hasA, int ax1, int ax2,
+                             bool hasB, int bx1, int bx2,
+                             std::vector<MergeRowSpan> *spans)
+    {
+        int cuts[6];
+        int nCuts = 0;
+        cuts[nCuts++] = x1;
+        cuts[nCuts++] = x2;
+        if (hasA) {
+            cuts[nCuts++] = ax1;
+            cuts[nCuts++] = ax2;
+        }
+        if (hasB) {
+            cuts[nCuts++] = bx1;
+            cuts[nCuts++] = bx2;
+        }
+        std::sort(cuts, cuts + nCuts);
+        nCuts = std::unique(cuts, cuts + nCuts) - cuts;
+
+        spans->clear();
+        for (int i = 0; i + 1 < nCuts; ++i) {
+            MergeRowSpan span;
+            span.x1 = cuts[i];
+            span.x2 = cuts[i + 1];
+            span.hasA = hasA && ax1 <= span.x1 && span.x2 <= ax2;
+            span.hasB = hasB && bx1 <= span.x1 && span.x2 <= bx2;
+            spans->push_back(span);
+        }
+    }
+
     void multiThreadProcessImages(OfxRectI procWindow)
     {
-        float tmpPix[nComponents];
-        float tmpA[nComponents];
-        float tmpB[nComponents];
-        
+        assert(_optionalAImages.size() == 0 || _optionalAImages.size() == (kMaximumAInputs - 1));
+
+        const int width = procWindow.x2 - procWindow.x1;
+        if (width <= 0) {
+            return;
+        }
+        // work in float: clamping is done when mixing
+        std::vector<float> rowA(width * nComponents);
+        std::vector<float> rowB(width * nComponents);
+        std::vector<float> rowPix(width * nComponents);
+        std::vector<float> rowTmp(width * nComponents);
+        std::vector<MergeRowSpan> spans;
+        spans.reserve(5);
+        const MergeRowFunction mergeRowFunc = getMergeRowFunction<nComponents>(_operation, _alphaMasking);
+
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_effect.abort()) {
                 break;
@@ -203,56 +341,64 @@ private:
 
             PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                
-                const PIX *srcPixA = (const PIX *)  (_srcImgA ? _srcImgA->getPixelAddress(x, y) : 0);
-                const PIX *srcPixB = (const PIX *)  (_srcImgB ? _srcImgB->getPixelAddress(x, y) : 0);
-                
-                assert(_optionalAImages.size() == 0 || _optionalAImages.size() == (kMaximumAInputs - 1));
-                
-                
-                if (srcPixA || srcPixB) {
+            int ax1 = 0, ax2 = 0, bx1 = 0, bx2 = 0;
+            const bool hasA = getRowSpan(_srcImgA, y, procWindow.x1, procWindow.x2, &ax1, &ax2);
+            const bool hasB = getRowSpan(_srcImgB, y, procWindow.x1, procWindow.x2, &bx1, &bx2);
+            if (hasA) {
+                fetchRow(_srcImgA, y, ax1, ax2, &rowA[(ax1 - procWindow.x1) * nComponents]);
+            }
+            if (hasB) {
+                fetchRow(_srcImgB, y, bx1, bx2, &rowB[(bx1 - procWindow.x1) * nComponents]);
+            }
+            planRowSpans(procWindow.x1, procWindow.x2, hasA, ax1, ax2, hasB, bx1, bx2, &spans);
 
-                    for (int c = 0; c < nComponents; ++c) {
-                        // all images are supposed to be black and transparent outside o
-                        tmpA[c] = srcPixA ? ((float)srcPixA[c] / maxValue) : 0.f;
-                        tmpB[c] = srcPixB ? ((float)srcPixB[c] / maxValue) : 0.f;
-                    }
-                    // work in float: clamping is done when mixing
-                    mergePixel<float, nComponents, 1>(_operation, _alphaMasking, tmpA, tmpB, tmpPix);
-    
-                    
-                } else {
+            for (std::vector<MergeRowSpan>::const_iterator it = spans.begin(); it != spans.end(); ++it) {
+                const int offset = (it->x1 - procWindow.x1) * nComponents;
+                const int n = (it->x2 - it->x1) * nComponents;
+                if (!it->hasA && !it->hasB) {
                     // everything is black and transparent
+                    std::fill(&rowPix[offset], &rowPix[offset] + n, 0.f);
+                    continue;
+                }
+                // all images are supposed to be black and transparent outside of their bounds
+                if (!it->hasA) {
+                    std::fill(&rowA[offset], &rowA[offset] + n, 0.f);
+                }
+                if (!it->hasB) {
+                    std::fill(&rowB[offset], &rowB[offset] + n, 0.f);
+                }
+                mergeRowFunc(_operation, _alphaMasking, &rowA[offset], &rowB[offset], &rowPix[offset], it->x2 - it->x1);
+            }
+
+            // the optional A inputs are merged only where they are defined
+            for (unsigned int i = 0; i < _optionalAImages.size(); ++i) {
+                int sx1, sx2;
+                if (getRowSpan(_optionalAImages[i], y, procWindow.x1, procWindow.x2, &sx1, &sx2)) {
+                    const int offset = (sx1 - procWindow.x1) * nComponents;
+                    fetchRow(_optionalAImages[i], y, sx1, sx2, &rowA[offset]);
+                    mergeRowFunc(_operation, _alphaMasking, &rowA[offset], &rowPix[offset], &rowTmp[offset], sx2 - sx1);
+                    std::copy(&rowTmp[offset], &rowTmp[offset] + (sx2 - sx1) * nComponents, &rowPix[offset]);
+                }
+            }
+
+            const PIX *srcRowB = hasB ? (const PIX *) _srcImgB->getPixelAddress(bx1, y) : 0;
+            float *tmpPix = &rowPix[0];
+            for (std::vector<MergeRowSpan>::const_iterator it = spans.begin(); it != spans.end(); ++it) {
+                const PIX *srcPixB = it->hasB ? (srcRowB + (it->x1 - bx1) * nComponents) : 0;
+                for (int x = it->x1; x < it->x2; ++x) {
+                    // denormalize
                     for (int c = 0; c < nComponents; ++c) {
-                        tmpPix[c] = 0;
+                        tmpPix[c] *= maxValue;
                     }
-                }
-                
-                for (unsigned int i = 0; i < _optionalAImages.size(); ++i) {
-                    srcPixA = (const PIX *)  (_optionalAImages[i] ? _optionalAImages[i]->getPixelAddress(x, y) : 0);
-                    
-                    if (srcPixA) {
-                        
-                        for (int c = 0; c < nComponents; ++c) {
-                            // all images are supposed to be black and transparent outside o
-                            tmpA[c] = (float)srcPixA[c] / maxValue;
-                            tmpB[c] = tmpPix[c];
-                        }
-                        // work in float: clamping is done when mixing
-                        mergePixel<float, nComponents, 1>(_operation, _alphaMasking, tmpA, tmpB, tmpPix);
-           
+
+                    ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPixB, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
+
+                    if (srcPixB) {
+                        srcPixB += nComponents;
                     }
+                    tmpPix += nComponents;
+                    dstPix += nComponents;
                 }
-                
-                // denormalize
-                for (int c = 0; c < nComponents; ++c) {
-                    tmpPix[c] *= maxValue;
-                }
-                
-                ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPixB, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
-                
-                dstPix += nComponents;
             }
         }
     }
@@ -43,6 +43,7 @@
 #include "Rectangle.h"
 #include "Retime.h"
 #include "ColorLookup.h"
+#include "ColorLookup3D.h"
 #include "Roto.h"
 #include "Saturation.h"
 #include "Shuffle.h"
@@ -110,6 +111,7 @@ namespace OFX
 			getRectanglePluginID(ids);
 			getRetimePluginID(ids);
 			//getColorLookupPluginID(ids);
+			getColorLookup3DPluginID(ids);
 			getRotoPluginID(ids);
 			getSaturationPluginID(ids);
 			getShufflePluginID(ids);
@@ -71,14 +71,22 @@
  */
 #include "TrackerPM.h"
 
+#include <algorithm>
 #include <cmath>
+#include <complex>
 #include <map>
+#include <memory>
 #include <limits>
+#include <vector>
 
 #include "ofxsProcessing.H"
 #include "ofxsTracking.h"
 #include "ofxsMerging.h"
 
+#ifndef M_PI
+#define M_PI        3.14159265358979323846264338327950288   /* pi             */
+#endif
+
 #define kPluginName "TrackerPM"
 #define kPluginGrouping "Transform"
 #define kPluginDescription \
@@ -86,11 +94,15 @@
 "The Mask input is used to weight the pattern, so that only pixels from the Mask will be tracked. \n" \
 "The tracker always takes the previous/next frame as reference when searching for a pattern in an image. This can " \
 "overtime make a track drift from its original pattern.\n"\
+"With the Pyramid search, the pattern is first searched in a low-resolution version of the images, and the match is " \
+"refined at each finer resolution, which is much faster for large search areas.\n"\
+"With the Exhaustive search, the SSD, NCC and ZNCC scores of all positions are computed at once by FFT when the " \
+"pattern and the search area are large enough for this to be faster.\n"\
 "Canceling a tracking operation will not wipe all the data analysed so far. If you resume a previously canceled tracking, " \
 "the tracker will continue tracking, picking up the previous/next frame as reference. "
 #define kPluginIdentifier "net.sf.openfx.TrackerPM"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -111,6 +123,34 @@
 #define kParamScoreOptionZNCC "ZNCC"
 #define kParamScoreOptionZNCCHint "Zero-mean Normalized Cross-Correlation, less sensitive to illumination changes"
 
+#define kParamSearch "search"
+#define kParamSearchLabel "Search"
+#define kParamSearchHint "Method used to find the position of the pattern within the search area"
+#define kParamSearchOptionExhaustive "Exhaustive"
+#define kParamSearchOptionExhaustiveHint "Compute the score at every position in the search area. The cost is proportional to the pattern area times the search area, or, if it is faster, to the search area times its logarithm for SSD, NCC and ZNCC, which are then computed by FFT."
+#define kParamSearchOptionPyramid "Pyramid"
+#define kParamSearchOptionPyramidHint "Search every position at the coarsest level of a Gaussian pyramid of the images, then refine the best match in a small neighbourhood at each finer level. Much faster for large search areas, but the pattern must still be recognizable at low resolution."
+
+// the coarsest level of the pyramid has a pattern of at least this size, or is level kTrackerPMPyramidMaxLevel
+#define kTrackerPMPyramidMinPatternSize 4
+#define kTrackerPMPyramidMaxLevel 5
+// levels are added while the search area is larger than this at the previous level
+#define kTrackerPMPyramidMinSearchSize 8
+// radius of the neighbourhood searched at each finer level, around the match of the coarser level
+#define kTrackerPMPyramidRefineRadius 2
+
+// number of independent accumulators in the row loops of the scores, so that they can be vectorized
+#define kTrackerPMLanes 4
+
+// estimated cost of one point of one stage of an FFT, relative to the cost of one pixel of a spatial score, when
+// the score is a single dot product. The scores are computed by FFT if this makes them cheaper.
+#define kTrackerPMFFTCost 3.
+// maximum number of points of the FFTs (each buffer takes 16 bytes per point): larger search areas are searched
+// directly, to bound the memory used by the transforms
+#define kTrackerPMFFTMaxSize (1 << 21)
+// number of columns transformed together by the FFT
+#define kTrackerPMFFTColumnBlock 4
+
 using namespace OFX;
 
 enum TrackerScoreEnum
@@ -121,7 +161,34 @@ enum TrackerScoreEnum
     eTrackerZNCC
 };
 
+enum TrackerSearchEnum
+{
+    eTrackerSearchExhaustive = 0,
+    eTrackerSearchPyramid
+};
+
 class TrackerPMProcessorBase;
+
+/** @brief A source image kept between two steps of trackRange.
+ *
+ * The other image fetched at one step is the reference image of the next step, and it covers the
+ * search window, so it usually contains the next pattern window: keeping it avoids fetching each
+ * frame twice from the host.
+ */
+struct TrackerPMFetchedImage
+{
+    TrackerPMFetchedImage()
+    : image()
+    , time(0.)
+    , bounds()
+    {
+    }
+
+    std::auto_ptr<const OFX::Image> image;
+    OfxTime time;
+    OfxRectD bounds; // the region that was requested, in canonical coordinates
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class TrackerPMPlugin : public GenericTrackerPlugin
@@ -131,6 +198,7 @@ public:
     TrackerPMPlugin(OfxImageEffectHandle handle)
     : GenericTrackerPlugin(handle)
     , _score(0)
+    , _search(0)
     , _center(0)
     , _offset(0)
     , _innerBtmLeft(0)
@@ -141,7 +209,8 @@ public:
         _maskClip = getContext() == OFX::eContextFilter ? NULL : fetchClip(getContext() == OFX::eContextPaint ? "Brush" : "Mask");
 		assert(!_maskClip || _maskClip->getPixelComponents() == ePixelComponentAlpha || _maskClip->getPixelComponents() == ePixelComponentRGBA);
         _score = fetchChoiceParam(kParamScore);
-        assert(_score);
+        _search = fetchChoiceParam(kParamSearch);
+        assert(_score && _search);
         
         _center = fetchDouble2DParam(kParamTrackingCenterPoint);
         _offset = fetchDouble2DParam(kParamTrackingOffset);
@@ -163,7 +232,7 @@ private:
     virtual void trackRange(const OFX::TrackArguments& args);
     
     template <int nComponents>
-    void trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::TrackArguments& args);
+    void trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::TrackArguments& args, TrackerPMFetchedImage* fetched);
 
     template <class PIX, int nComponents, int maxValue>
     void trackInternalForDepth(OfxTime refTime,
@@ -190,6 +259,7 @@ private:
 
     OFX::Clip *_maskClip;
     ChoiceParam* _score;
+    ChoiceParam* _search;
     
     OFX::Double2DParam* _center;
     OFX::Double2DParam* _offset;
@@ -200,12 +270,342 @@ private:
 };
 
 
+// floor(a/b) and ceil(a/b), for b > 0
+static inline int
+floorDiv(int a, int b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static inline int
+ceilDiv(int a, int b)
+{
+    return -floorDiv(-a, b);
+}
+
+/** @brief sum of a[j]*b[j] over a row */
+template <class T>
+static inline double
+rowDot(const T* a, const float* b, int n)
+{
+    double acc[kTrackerPMLanes];
+    for (int l = 0; l < kTrackerPMLanes; ++l) {
+        acc[l] = 0.;
+    }
+    int j = 0;
+    for (; j + kTrackerPMLanes <= n; j += kTrackerPMLanes) {
+        for (int l = 0; l < kTrackerPMLanes; ++l) {
+            acc[l] += (double)a[j + l] * b[j + l];
+        }
+    }
+    for (; j < n; ++j) {
+        acc[0] += (double)a[j] * b[j];
+    }
+    double sum = 0.;
+    for (int l = 0; l < kTrackerPMLanes; ++l) {
+        sum += acc[l];
+    }
+    return sum;
+}
+
+/** @brief Add the term of a score for one pixel, with weight w, pattern value p and other image value o, to acc (and
+    the term of the sum of squares of the other image to accSq for NCC and ZNCC). */
+template <TrackerScoreEnum scoreTypeE>
+static inline void
+scoreTerm(float w, float p, float o, double refMean, double otherMean, double& acc, double& accSq)
+{
+    switch (scoreTypeE) {
+        case eTrackerSSD: {
+            // reference is squared in SSD, so is the weight
+            const double d = (double)p - o;
+            acc += (double)(w * w) * d * d;
+        }   break;
+        case eTrackerSAD:
+            acc += w * std::abs((double)p - o);
+            break;
+        case eTrackerNCC:
+            acc += (double)w * p * o;
+            accSq += (double)w * o * o;
+            break;
+        case eTrackerZNCC: {
+            const double od = o - otherMean;
+            acc += w * (p - refMean) * od;
+            accSq += w * od * od;
+        }   break;
+    }
+}
+
+/** @brief Sum the terms of a score over a row of the pattern. For SSD and SAD, the score is added to *score. For NCC
+    and ZNCC, the cross-correlation (centered on refMean and otherMean for ZNCC) is added to *score, and the weighted
+    sum of squares of the other image to *otherSsq. */
+template <TrackerScoreEnum scoreTypeE>
+static inline void
+rowScore(const float* w, const float* p, const float* o, int n, double refMean, double otherMean,
+         double* score, double* otherSsq)
+{
+    double acc[kTrackerPMLanes];
+    double accSq[kTrackerPMLanes];
+    for (int l = 0; l < kTrackerPMLanes; ++l) {
+        acc[l] = 0.;
+        accSq[l] = 0.;
+    }
+    int j = 0;
+    for (; j + kTrackerPMLanes <= n; j += kTrackerPMLanes) {
+        for (int l = 0; l < kTrackerPMLanes; ++l) {
+            scoreTerm<scoreTypeE>(w[j + l], p[j + l], o[j + l], refMean, otherMean, acc[l], accSq[l]);
+        }
+    }
+    for (; j < n; ++j) {
+        scoreTerm<scoreTypeE>(w[j], p[j], o[j], refMean, otherMean, acc[0], accSq[0]);
+    }
+    for (int l = 0; l < kTrackerPMLanes; ++l) {
+        *score += acc[l];
+        *otherSsq += accSq[l];
+    }
+}
+
+/** @brief A float image with a weight per pixel, used for the levels of the pyramid search.
+    The components are interleaved, and the bounds are in pixels of the level. */
+struct TrackerPMImage
+{
+    OfxRectI bounds;
+    int nComps;
+    std::vector<float> data;
+    std::vector<float> weight;
+
+    TrackerPMImage()
+    : bounds()
+    , nComps(0)
+    , data()
+    , weight()
+    {
+    }
+
+    void assign(const OfxRectI& b, int n)
+    {
+        bounds = b;
+        nComps = n;
+        data.assign((size_t)width() * height() * n, 0.f);
+        weight.assign((size_t)width() * height(), 0.f);
+    }
+
+    int width() const { return bounds.x2 - bounds.x1; }
+
+    int height() const { return bounds.y2 - bounds.y1; }
+
+    size_t index(int x, int y) const { return (size_t)(y - bounds.y1) * width() + (x - bounds.x1); }
+
+    /** @brief the pixel at (x,y), or the nearest pixel if (x,y) is outside of the bounds */
+    const float* clampedPixel(int x, int y) const
+    {
+        x = std::max(bounds.x1, std::min(x, bounds.x2 - 1));
+        y = std::max(bounds.y1, std::min(y, bounds.y2 - 1));
+        return &data[index(x, y) * nComps];
+    }
+};
+
+/** @brief Compute the next level of a pyramid: blur with the separable [1 2 1]/4 kernel and subsample by 2.
+    Pixel X of the result is centered on pixel 2X of src. The taps are weighted by the weights of the pixels, and
+    the weight of the result is the blurred weight, so that pixels outside of the pattern or of the mask do not
+    contribute. */
+static void
+pyramidDown(const TrackerPMImage& src, TrackerPMImage* dst)
+{
+    const int n = src.nComps;
+    // horizontal pass
+    OfxRectI hb = src.bounds;
+    hb.x1 = floorDiv(src.bounds.x1, 2);
+    hb.x2 = floorDiv(src.bounds.x2 - 1, 2) + 1;
+    TrackerPMImage tmp;
+    tmp.assign(hb, n);
+    for (int y = hb.y1; y < hb.y2; ++y) {
+        for (int x = hb.x1; x < hb.x2; ++x) {
+            double sumW = 0.;
+            double sum[3] = {0., 0., 0.};
+            for (int k = -1; k <= 1; ++k) {
+                const int sx = 2 * x + k;
+                if (sx < src.bounds.x1 || sx >= src.bounds.x2) {
+                    continue;
+                }
+                const size_t i = src.index(sx, y);
+                const double w = (k ? 1. : 2.) * src.weight[i];
+                sumW += w;
+                for (int c = 0; c < n; ++c) {
+                    sum[c] += w * src.data[i * n + c];
+                }
+            }
+            const size_t i = tmp.index(x, y);
+            tmp.weight[i] = (float)(sumW / 4);
+            for (int c = 0; c < n; ++c) {
+                tmp.data[i * n + c] = sumW > 0. ? (float)(sum[c] / sumW) : 0.f;
+            }
+        }
+    }
+    // vertical pass
+    OfxRectI vb = hb;
+    vb.y1 = floorDiv(hb.y1, 2);
+    vb.y2 = floorDiv(hb.y2 - 1, 2) + 1;
+    dst->assign(vb, n);
+    for (int y = vb.y1; y < vb.y2; ++y) {
+        for (int x = vb.x1; x < vb.x2; ++x) {
+            double sumW = 0.;
+            double sum[3] = {0., 0., 0.};
+            for (int k = -1; k <= 1; ++k) {
+                const int sy = 2 * y + k;
+                if (sy < hb.y1 || sy >= hb.y2) {
+                    continue;
+                }
+                const size_t i = tmp.index(x, sy);
+                const double w = (k ? 1. : 2.) * tmp.weight[i];
+                sumW += w;
+                for (int c = 0; c < n; ++c) {
+                    sum[c] += w * tmp.data[i * n + c];
+                }
+            }
+            const size_t i = dst->index(x, y);
+            dst->weight[i] = (float)(sumW / 4);
+            for (int c = 0; c < n; ++c) {
+                dst->data[i * n + c] = sumW > 0. ? (float)(sum[c] / sumW) : 0.f;
+            }
+        }
+    }
+}
+
+/** @brief the smallest power of 2 greater than or equal to n */
+static inline int
+nextPowerOf2(int n)
+{
+    int p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+/** @brief 2D FFT of complex images whose sizes are powers of 2, computed in place by transforming the rows then the
+    columns with a radix-2 FFT, using all threads. The inverse transform is not normalized. */
+class TrackerPMFFT : public OFX::MultiThread::Processor
+{
+public:
+    TrackerPMFFT(int width, int height)
+    : _data(0)
+    , _width(width)
+    , _height(height)
+    , _rowTwiddles()
+    , _columnTwiddles()
+    , _inverse(false)
+    , _columns(false)
+    {
+        computeTwiddles(width, &_rowTwiddles);
+        computeTwiddles(height, &_columnTwiddles);
+    }
+
+    void transform(std::complex<double>* data, bool inverse)
+    {
+        _data = data;
+        _inverse = inverse;
+        for (int pass = 0; pass < 2; ++pass) {
+            _columns = (pass == 1);
+            unsigned int nThreads = 1;
+            if (!OFX::MultiThread::isSpawnedThread()) {
+                // same heuristic as OFX::ImageProcessor
+                nThreads = std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)((size_t)_width * _height / 4096));
+            }
+            multiThread(std::max(1u, nThreads));
+        }
+    }
+
+private:
+    static void computeTwiddles(int n, std::vector<std::complex<double> >* twiddles)
+    {
+        twiddles->resize(std::max(1, n / 2));
+        for (int k = 0; k < n / 2; ++k) {
+            const double a = -2. * M_PI * k / n;
+            (*twiddles)[k] = std::complex<double>(std::cos(a), std::sin(a));
+        }
+    }
+
+    /** @brief in-place FFT of n values, n being a power of 2 */
+    void fft1D(std::complex<double>* data, int n, const std::vector<std::complex<double> >& twiddles) const
+    {
+        // bit-reversal permutation
+        for (int i = 1, j = 0; i < n; ++i) {
+            int bit = n >> 1;
+            for (; j & bit; bit >>= 1) {
+                j ^= bit;
+            }
+            j ^= bit;
+            if (i < j) {
+                std::swap(data[i], data[j]);
+            }
+        }
+        // butterflies (complex products are written explicitly, std::complex checks for NaNs)
+        for (int len = 2; len <= n; len <<= 1) {
+            const int half = len / 2;
+            const int step = n / len;
+            for (int i = 0; i < n; i += len) {
+                for (int k = 0; k < half; ++k) {
+                    const double wr = twiddles[k * step].real();
+                    const double wi = _inverse ? -twiddles[k * step].imag() : twiddles[k * step].imag();
+                    std::complex<double>& a = data[i + k];
+                    std::complex<double>& b = data[i + k + half];
+                    const double vr = b.real() * wr - b.imag() * wi;
+                    const double vi = b.real() * wi + b.imag() * wr;
+                    b = std::complex<double>(a.real() - vr, a.imag() - vi);
+                    a = std::complex<double>(a.real() + vr, a.imag() + vi);
+                }
+            }
+        }
+    }
+
+    virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int n = _columns ? _width : _height;
+        const int i1 = (int)(((size_t)n * threadId) / nThreads);
+        const int i2 = (int)(((size_t)n * (threadId + 1)) / nThreads);
+        if (!_columns) {
+            for (int y = i1; y < i2; ++y) {
+                fft1D(_data + (size_t)y * _width, _width, _rowTwiddles);
+            }
+        } else {
+            // copy a few columns at a time, to read whole cache lines
+            const int block = kTrackerPMFFTColumnBlock;
+            std::vector<std::complex<double> > columns((size_t)block * _height);
+            for (int x = i1; x < i2; x += block) {
+                const int nb = std::min(block, i2 - x);
+                for (int y = 0; y < _height; ++y) {
+                    for (int b = 0; b < nb; ++b) {
+                        columns[(size_t)b * _height + y] = _data[(size_t)y * _width + x + b];
+                    }
+                }
+                for (int b = 0; b < nb; ++b) {
+                    fft1D(&columns[(size_t)b * _height], _height, _columnTwiddles);
+                }
+                for (int y = 0; y < _height; ++y) {
+                    for (int b = 0; b < nb; ++b) {
+                        _data[(size_t)y * _width + x + b] = columns[(size_t)b * _height + y];
+                    }
+                }
+            }
+        }
+    }
+
+    std::complex<double>* _data;
+    int _width;
+    int _height;
+    std::vector<std::complex<double> > _rowTwiddles;
+    std::vector<std::complex<double> > _columnTwiddles;
+    bool _inverse;
+    bool _columns;
+};
+
 class TrackerPMProcessorBase : public OFX::ImageProcessor
 {
 protected:
     const OFX::Image *_otherImg;
     OfxRectI _refRectPixel;
     OfxPointI _refCenterI;
+    TrackerSearchEnum _searchMethod;
     std::pair<OfxPointD,double> _bestMatch; //< the results for the current processor
     OFX::MultiThread::Mutex _bestMatchMutex; //< this is used so we can multi-thread the tracking and protect the shared results
     
@@ -215,6 +615,7 @@ public:
     , _otherImg(0)
     , _refRectPixel()
     , _refCenterI()
+    , _searchMethod(eTrackerSearchExhaustive)
     {
         _bestMatch.second = std::numeric_limits<double>::infinity();
 
@@ -224,6 +625,9 @@ public:
     {
     }
 
+    /** @brief set the search method. Must be called before setValues(). */
+    void setSearchMethod(TrackerSearchEnum searchMethod) { _searchMethod = searchMethod; }
+
     /** @brief set the processing parameters. return false if processing cannot be done. */
     virtual bool setValues(const OFX::Image *ref, const OFX::Image *other, const OFX::Image *mask,
                            const OfxRectI& pattern, const OfxPointI& centeri) = 0;
@@ -243,10 +647,24 @@ class TrackerPMProcessor : public TrackerPMProcessorBase
 {
 protected:
     std::auto_ptr<OFX::ImageMemory> _patternImg;
-    PIX *_patternData;
+    float *_patternData; //< the pattern, one plane per component (without alpha)
     std::auto_ptr<OFX::ImageMemory> _weightImg;
     float *_weightData;
     double _weightTotal;
+    double _refMean[3]; //< the weighted mean of the pattern
+    std::auto_ptr<OFX::ImageMemory> _otherBufferImg;
+    float *_otherData; //< the pixels of the other image covered by the pattern at all positions, one plane per component
+    OfxRectI _otherRect; //< the bounds of _otherData
+    std::vector<double> _otherSat; //< integral images of _otherData and of its square, empty if not used
+    double _otherShift[3]; //< the value subtracted from the other image in the integral images and FFT correlations
+    double _otherSatTolerance; //< variances below this are considered as zero
+    std::vector<double> _patternDev; //< the pattern, minus its mean for ZNCC, one plane per component, used with _otherSat
+    double _patternDevSum[3]; //< the sum of _patternDev, which is zero up to rounding errors
+    std::vector<double> _scoreSurface; //< the scores of all positions computed by FFT, empty if not used
+    std::vector<TrackerPMImage> _patternPyramid; //< the pattern at each level of the pyramid, empty if the search is exhaustive
+    std::vector<TrackerPMImage> _otherPyramid; //< the search area at each level of the pyramid
+    std::vector<double> _pyramidWeightTotal; //< the sum of the pattern weights at each level
+    std::vector<double> _pyramidRefMean; //< the weighted mean of the pattern at each level (3 components per level)
 public:
     TrackerPMProcessor(OFX::ImageEffect &instance)
     : TrackerPMProcessorBase(instance)
@@ -255,7 +673,23 @@ public:
     , _weightImg(0)
     , _weightData(0)
     , _weightTotal(0.)
+    , _otherBufferImg(0)
+    , _otherData(0)
+    , _otherRect()
+    , _otherSat()
+    , _otherSatTolerance(0.)
+    , _patternDev()
+    , _scoreSurface()
+    , _patternPyramid()
+    , _otherPyramid()
+    , _pyramidWeightTotal()
+    , _pyramidRefMean()
     {
+        for (int c = 0; c < 3; ++c) {
+            _refMean[c] = 0.;
+            _otherShift[c] = 0.;
+            _patternDevSum[c] = 0.;
+        }
     }
 
     ~TrackerPMProcessor()
@@ -276,32 +710,33 @@ private:
             return false;
         }
         
-        _patternImg.reset(new ImageMemory(sizeof(PIX) * nComponents * nPix, &_effect));
+        ///we're not interested in the alpha channel for RGBA images
+        const int scoreComps = std::min(nComponents, 3);
+        _patternImg.reset(new ImageMemory(sizeof(float) * scoreComps * nPix, &_effect));
         _weightImg.reset(new ImageMemory(sizeof(float) * nPix, &_effect));
         _otherImg = other;
         _refRectPixel = pattern;
         _refCenterI = centeri;
 
-        _patternData = (PIX*)_patternImg->lock();
+        _patternData = (float*)_patternImg->lock();
         _weightData = (float*)_weightImg->lock();
 
         // sliding pointers
         long patternIdx = 0; // sliding index
-        PIX *patternPtr = _patternData;
         float *weightPtr = _weightData;
         _weightTotal = 0.;
 
         // extract ref and mask
         for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-            for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
+            for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, ++patternIdx) {
                 assert(patternIdx == ((i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1)));
                 PIX *refPix = (PIX*) ref->getPixelAddress(_refCenterI.x + j, _refCenterI.y + i);
 
                 if (!refPix) {
                     // no reference pixel, set weight to 0
                     *weightPtr = 0.f;
-                    for (int c = 0; c < nComponents; ++c) {
-                        patternPtr[c] = PIX();
+                    for (int c = 0; c < scoreComps; ++c) {
+                        _patternData[c * nPix + patternIdx] = 0.f;
                     }
                 } else {
                     if (!mask) {
@@ -312,14 +747,457 @@ private:
                         // weight is zero if there's a mask but we're outside of it
                         *weightPtr = maskPix ? (*maskPix/(float)maxValue) : 0.f;
                     }
-                    for (int c = 0; c < nComponents; ++c) {
-                        patternPtr[c] = refPix[c];
+                    for (int c = 0; c < scoreComps; ++c) {
+                        _patternData[c * nPix + patternIdx] = refPix[c];
                     }
                 }
                 _weightTotal += *weightPtr;
             }
         }
-        return (_weightTotal > 0);
+        if (_weightTotal <= 0) {
+            return false;
+        }
+        // weighted mean of the pattern
+        for (int c = 0; c < 3; ++c) {
+            _refMean[c] = 0.;
+        }
+        for (int c = 0; c < scoreComps; ++c) {
+            _refMean[c] = rowDot(_weightData, _patternData + c * nPix, (int)nPix) / _weightTotal;
+        }
+        extractOther();
+        const bool fft = (_searchMethod == eTrackerSearchExhaustive) && fftIsFaster();
+        _otherSat.clear();
+        if (scoreType == eTrackerNCC || scoreType == eTrackerZNCC || (fft && scoreType == eTrackerSSD)) {
+            buildIntegralImages();
+        }
+        _scoreSurface.clear();
+        if (fft) {
+            computeScoreSurface();
+        }
+        if (_searchMethod == eTrackerSearchPyramid) {
+            buildPyramids();
+        } else {
+            _patternPyramid.clear();
+            _otherPyramid.clear();
+        }
+        return true;
+    }
+
+    /** @brief Copy the pixels of the other image covered by the pattern at all the positions of the search window,
+        plus one pixel on each side for the subpixel refinement, to _otherData, so that the scores can be computed on
+        contiguous rows. Outside of the other image, take the nearest pixel (more chance to get a track than with
+        black). */
+    void extractOther()
+    {
+        const int scoreComps = std::min(nComponents, 3);
+        _otherRect.x1 = _renderWindow.x1 - 1 + _refRectPixel.x1;
+        _otherRect.y1 = _renderWindow.y1 - 1 + _refRectPixel.y1;
+        _otherRect.x2 = std::max(_otherRect.x1, _renderWindow.x2 + _refRectPixel.x2);
+        _otherRect.y2 = std::max(_otherRect.y1, _renderWindow.y2 + _refRectPixel.y2);
+        const int w = _otherRect.x2 - _otherRect.x1;
+        const int h = _otherRect.y2 - _otherRect.y1;
+        const size_t planeSize = (size_t)w * h;
+        _otherBufferImg.reset(new ImageMemory(sizeof(float) * scoreComps * std::max(planeSize, (size_t)1), &_effect));
+        _otherData = (float*)_otherBufferImg->lock();
+
+        const OfxRectI& otherBounds = _otherImg->getBounds();
+        for (int y = 0; y < h; ++y) {
+            const int othery = std::max(otherBounds.y1, std::min(_otherRect.y1 + y, otherBounds.y2 - 1));
+            // pixels of a row are contiguous
+            const PIX *otherRow = (const PIX *) _otherImg->getPixelAddress(otherBounds.x1, othery);
+            float *dst = _otherData + (size_t)y * w;
+            for (int x = 0; x < w; ++x) {
+                const int otherx = std::max(otherBounds.x1, std::min(_otherRect.x1 + x, otherBounds.x2 - 1));
+                const PIX *otherPix = otherRow ? otherRow + (size_t)(otherx - otherBounds.x1) * nComponents : 0;
+                for (int c = 0; c < scoreComps; ++c) {
+                    dst[c * planeSize + x] = otherPix ? otherPix[c] : 0.f;
+                }
+            }
+        }
+
+        // SSD and ZNCC don't change if the same value is subtracted from both images: subtract a value of the image
+        // in the integral images and FFT correlations, to make them more accurate
+        for (int c = 0; c < 3; ++c) {
+            _otherShift[c] = 0.;
+        }
+        if ((scoreType == eTrackerSSD || scoreType == eTrackerZNCC) && planeSize > 0) {
+            for (int c = 0; c < scoreComps; ++c) {
+                _otherShift[c] = _otherData[c * planeSize];
+            }
+        }
+    }
+
+    /** @brief true if all the weights of the pattern are equal, which is the case if there is no mask */
+    bool uniformWeights() const
+    {
+        const size_t nPix = (size_t)(_refRectPixel.x2 - _refRectPixel.x1) * (_refRectPixel.y2 - _refRectPixel.y1);
+        for (size_t i = 1; i < nPix; ++i) {
+            if (_weightData[i] != _weightData[0]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /** @brief If the weights of the pattern are uniform (which is the case if there is no mask), build the integral
+        images of the other image and of its square over the search area, so that the sums over the other image in
+        the NCC and ZNCC scores take four lookups, and only the cross-correlation with the pattern has to be computed
+        for each position. */
+    void buildIntegralImages()
+    {
+        if (!uniformWeights()) {
+            return;
+        }
+        const size_t nPix = (size_t)(_refRectPixel.x2 - _refRectPixel.x1) * (_refRectPixel.y2 - _refRectPixel.y1);
+        const int scoreComps = std::min(nComponents, 3);
+        const int stride = 2 * scoreComps;
+        const int w = _otherRect.x2 - _otherRect.x1;
+        const int h = _otherRect.y2 - _otherRect.y1;
+        if (w <= 0 || h <= 0) {
+            return;
+        }
+        const size_t planeSize = (size_t)w * h;
+
+        _otherSat.assign((size_t)(w + 1) * (h + 1) * stride, 0.);
+        for (int y = 0; y < h; ++y) {
+            const double *sprev = &_otherSat[(size_t)y * (w + 1) * stride];
+            double *s = &_otherSat[(size_t)(y + 1) * (w + 1) * stride];
+            const float *src = _otherData + (size_t)y * w;
+            double rowSum[6] = {0., 0., 0., 0., 0., 0.};
+            for (int x = 0; x < w; ++x) {
+                for (int c = 0; c < scoreComps; ++c) {
+                    const double v = src[c * planeSize + x] - _otherShift[c];
+                    rowSum[c] += v;
+                    rowSum[scoreComps + c] += v * v;
+                }
+                for (int k = 0; k < stride; ++k) {
+                    s[(x + 1) * stride + k] = sprev[(x + 1) * stride + k] + rowSum[k];
+                }
+            }
+        }
+        // variances smaller than this are rounding errors of the integral images
+        double sumSq = 0.;
+        const double *s = &_otherSat[((size_t)h * (w + 1) + w) * stride];
+        for (int c = 0; c < scoreComps; ++c) {
+            sumSq += s[scoreComps + c];
+        }
+        _otherSatTolerance = 1e-10 * sumSq * nPix / ((double)w * h);
+
+        _patternDev.resize(nPix * scoreComps);
+        for (int c = 0; c < 3; ++c) {
+            _patternDevSum[c] = 0.;
+        }
+        for (int c = 0; c < scoreComps; ++c) {
+            const double mean = (scoreType == eTrackerZNCC) ? _refMean[c] : 0.;
+            for (size_t i = 0; i < nPix; ++i) {
+                const double dev = _patternData[c * nPix + i] - mean;
+                _patternDev[c * nPix + i] = dev;
+                _patternDevSum[c] += dev;
+            }
+        }
+    }
+
+    /** @brief Estimate whether computing the scores of all positions by FFT is faster than computing them one by one.
+        The spatial cost is proportional to the number of positions times the pattern size, the FFT cost to the
+        number of transforms times the size of the transforms times its logarithm. */
+    bool fftIsFaster() const
+    {
+        if (scoreType == eTrackerSAD) {
+            return false;
+        }
+        const bool uniform = uniformWeights();
+        const double nPositions = (double)(_renderWindow.x2 - _renderWindow.x1) * (_renderWindow.y2 - _renderWindow.y1);
+        const double nPix = (double)(_refRectPixel.x2 - _refRectPixel.x1) * (_refRectPixel.y2 - _refRectPixel.y1);
+        // with uniform weights, NCC and ZNCC use the integral images and only compute a dot product for each pixel
+        int spatialPasses = 2;
+        if (uniform && scoreType != eTrackerSSD) {
+            spatialPasses = 1;
+        } else if (scoreType == eTrackerZNCC) {
+            spatialPasses = 3;
+        }
+        const double spatialCost = nPositions * nPix * spatialPasses;
+        const double fftSize = (double)nextPowerOf2(_otherRect.x2 - _otherRect.x1) * nextPowerOf2(_otherRect.y2 - _otherRect.y1);
+        if (fftSize > kTrackerPMFFTMaxSize) {
+            return false;
+        }
+        int nTransforms = 2;
+        if (!uniform) {
+            nTransforms = (scoreType == eTrackerZNCC) ? 4 : 3;
+        }
+        const double fftCost = kTrackerPMFFTCost * nTransforms * fftSize * std::log(fftSize) / std::log(2.);
+        return fftCost < spatialCost;
+    }
+
+    /** @brief Compute the scores of all the positions of the search window, plus one pixel on each side, by
+        correlating the other image with the pattern in the frequency domain. For each component:
+        - the cross-correlation of the pattern with the other image (and, for SSD, the energy of the pattern),
+        - the weighted sum of the squares of the other image under the pattern, and for ZNCC its weighted mean.
+        These sums are taken from the integral images if the weights are uniform, and are correlations of the
+        weights with the other image and its square otherwise. Two real images are transformed at once, as the real
+        and imaginary parts of a complex image: the other image and the pattern if the weights are uniform, else the
+        other image and its square, then the pattern and the weights. */
+    void computeScoreSurface()
+    {
+        typedef std::complex<double> Complex;
+        const int scoreComps = std::min(nComponents, 3);
+        const int patternWidth = _refRectPixel.x2 - _refRectPixel.x1;
+        const int patternHeight = _refRectPixel.y2 - _refRectPixel.y1;
+        const size_t nPix = (size_t)patternWidth * patternHeight;
+        const int w = _otherRect.x2 - _otherRect.x1;
+        const int h = _otherRect.y2 - _otherRect.y1;
+        const size_t planeSize = (size_t)w * h;
+        // number of positions
+        const int nx = w - patternWidth + 1;
+        const int ny = h - patternHeight + 1;
+        if (nx <= 0 || ny <= 0) {
+            return;
+        }
+        // the correlations are circular, but the wrapped values don't reach the positions if the transforms are
+        // at least as large as the other image
+        const int fw = nextPowerOf2(w);
+        const int fh = nextPowerOf2(h);
+        const size_t fftSize = (size_t)fw * fh;
+        const bool uniform = !_otherSat.empty();
+        const bool needMean = (scoreType == eTrackerZNCC) && !uniform;
+        // the transforms are allocated by the host, so that it can account for them
+        std::auto_ptr<OFX::ImageMemory> otherImg(new ImageMemory(sizeof(Complex) * fftSize, &_effect));
+        std::auto_ptr<OFX::ImageMemory> kernelImg(uniform ? 0 : new ImageMemory(sizeof(Complex) * fftSize, &_effect));
+        std::auto_ptr<OFX::ImageMemory> meanImg(needMean ? new ImageMemory(sizeof(Complex) * fftSize, &_effect) : 0);
+        Complex *other = (Complex*)otherImg->lock();
+        Complex *kernel = kernelImg.get() ? (Complex*)kernelImg->lock() : 0;
+        Complex *mean = meanImg.get() ? (Complex*)meanImg->lock() : 0;
+        std::vector<double> cross((size_t)nx * ny, 0.);
+        std::vector<double> energy((size_t)nx * ny, 0.);
+        double patternEnergy = 0.;
+        double otherMeanSq = 0.;
+        TrackerPMFFT fft(fw, fh);
+
+        for (int c = 0; c < scoreComps; ++c) {
+            if (_effect.abort()) {
+                return;
+            }
+            const float *otherPlane = _otherData + c * planeSize;
+            const float *patternPlane = _patternData + c * nPix;
+            const double shift = _otherShift[c];
+
+            // the other image in the real part, its square or the weighted pattern in the imaginary part
+            std::fill(other, other + fftSize, Complex(0.));
+            for (int y = 0; y < h; ++y) {
+                for (int x = 0; x < w; ++x) {
+                    const double v = otherPlane[(size_t)y * w + x] - shift;
+                    other[(size_t)y * fw + x] = Complex(v, uniform ? 0. : v * v);
+                    otherMeanSq += v * v / planeSize;
+                }
+            }
+            // the weighted pattern in the real part, the weights in the imaginary part
+            Complex *patternImage = uniform ? other : kernel;
+            if (!uniform) {
+                std::fill(kernel, kernel + fftSize, Complex(0.));
+            }
+            double devSum = 0.;
+            for (int i = 0; i < patternHeight; ++i) {
+                for (int j = 0; j < patternWidth; ++j) {
+                    const size_t k = (size_t)i * patternWidth + j;
+                    const double weight = _weightData[k];
+                    double kp = 0.;
+                    double kw = weight;
+                    switch (scoreType) {
+                        case eTrackerSSD: {
+                            // reference is squared in SSD, so is the weight
+                            kw = weight * weight;
+                            const double p = patternPlane[k] - shift;
+                            kp = kw * p;
+                            patternEnergy += kw * p * p;
+                        }   break;
+                        case eTrackerSAD:
+                            break;
+                        case eTrackerNCC:
+                            kp = weight * patternPlane[k];
+                            break;
+                        case eTrackerZNCC:
+                            kp = weight * (patternPlane[k] - _refMean[c]);
+                            devSum += kp;
+                            break;
+                    }
+                    Complex& z = patternImage[(size_t)i * fw + j];
+                    z = uniform ? Complex(z.real(), kp) : Complex(kp, kw);
+                }
+            }
+            fft.transform(other, false);
+            if (!uniform) {
+                fft.transform(kernel, false);
+            }
+
+            // Multiply the spectra of the real images, which are separated using the symmetry of the spectrum of a
+            // real image, F(-k) = conj(F(k)). The frequencies k and -k are processed together, so that the results
+            // can be written in place to other: the correlation with the pattern in the real part, the correlation
+            // of the weights with the square in the imaginary part, and the correlation of the weights with the other
+            // image in mean.
+            for (int ky = 0; ky < fh; ++ky) {
+                const int nky = (fh - ky) % fh;
+                for (int kx = 0; kx < fw; ++kx) {
+                    const int nkx = (fw - kx) % fw;
+                    const size_t i = (size_t)ky * fw + kx;
+                    const size_t ni = (size_t)nky * fw + nkx;
+                    if (ni < i) {
+                        continue;
+                    }
+                    const Complex zo = other[i];
+                    const Complex nzo = std::conj(other[ni]);
+                    // spectra at k of the other image O, of its square Q, of the pattern P and of the weights W
+                    const Complex specO = 0.5 * (zo + nzo);
+                    Complex specQ = Complex(0., -0.5) * (zo - nzo);
+                    Complex specP;
+                    Complex specW;
+                    if (uniform) {
+                        specP = specQ;
+                        specQ = specW = Complex(0.);
+                    } else {
+                        const Complex zk = kernel[i];
+                        const Complex nzk = std::conj(kernel[ni]);
+                        specP = 0.5 * (zk + nzk);
+                        specW = Complex(0., -0.5) * (zk - nzk);
+                    }
+                    const Complex corr = specO * std::conj(specP);
+                    const Complex corrSq = specQ * std::conj(specW);
+                    // at -k, the spectra are the conjugates
+                    other[i] = corr + Complex(0., 1.) * corrSq;
+                    other[ni] = std::conj(corr) + Complex(0., 1.) * std::conj(corrSq);
+                    if (needMean) {
+                        const Complex corrMean = specO * std::conj(specW);
+                        mean[i] = corrMean;
+                        mean[ni] = std::conj(corrMean);
+                    }
+                }
+            }
+            fft.transform(other, true);
+            if (needMean) {
+                fft.transform(mean, true);
+            }
+
+            // sum the terms of the scores
+            const double norm = 1. / fftSize;
+            const int stride = 2 * scoreComps;
+            const double weight = _weightData[0];
+            for (int y = 0; y < ny; ++y) {
+                for (int x = 0; x < nx; ++x) {
+                    const size_t i = (size_t)y * fw + x;
+                    const double corr = other[i].real() * norm;
+                    double corrSq;
+                    double corrMean = 0.;
+                    if (uniform) {
+                        const double *s11 = &_otherSat[((size_t)y * (w + 1) + x) * stride];
+                        const double *s12 = &_otherSat[((size_t)y * (w + 1) + x + patternWidth) * stride];
+                        const double *s21 = &_otherSat[((size_t)(y + patternHeight) * (w + 1) + x) * stride];
+                        const double *s22 = &_otherSat[((size_t)(y + patternHeight) * (w + 1) + x + patternWidth) * stride];
+                        const double sum = s22[c] - s21[c] - s12[c] + s11[c];
+                        const double sumSq = s22[scoreComps + c] - s21[scoreComps + c] - s12[scoreComps + c] + s11[scoreComps + c];
+                        corrSq = (scoreType == eTrackerSSD ? weight * weight : weight) * sumSq;
+                        corrMean = weight * sum;
+                    } else {
+                        corrSq = other[i].imag() * norm;
+                        if (needMean) {
+                            corrMean = mean[i].real() * norm;
+                        }
+                    }
+                    const size_t k = (size_t)y * nx + x;
+                    if (scoreType == eTrackerZNCC) {
+                        const double m = corrMean / _weightTotal;
+                        cross[k] += corr - m * devSum;
+                        energy[k] += corrSq - m * corrMean;
+                    } else {
+                        cross[k] += corr;
+                        energy[k] += corrSq;
+                    }
+                }
+            }
+        }
+
+        // variances smaller than this are rounding errors
+        const double tolerance = 1e-10 * otherMeanSq * _weightTotal;
+        _scoreSurface.resize((size_t)nx * ny);
+        for (size_t k = 0; k < _scoreSurface.size(); ++k) {
+            if (scoreType == eTrackerSSD) {
+                _scoreSurface[k] = std::max(0., patternEnergy - 2. * cross[k] + energy[k]);
+            } else if (energy[k] > tolerance) {
+                _scoreSurface[k] = -cross[k] / std::sqrt(energy[k]);
+            } else {
+                _scoreSurface[k] = std::numeric_limits<double>::infinity();
+            }
+        }
+    }
+
+    /** @brief Build the Gaussian pyramids of the pattern and of the search area, down to the level where the pattern
+        becomes too small or the search area is small enough. The pyramids stay empty if the search area is already
+        small, in which case the search is exhaustive. */
+    void buildPyramids()
+    {
+        _patternPyramid.clear();
+        _otherPyramid.clear();
+        const int patternSize = std::min(_refRectPixel.x2 - _refRectPixel.x1, _refRectPixel.y2 - _refRectPixel.y1);
+        const int searchSize = std::max(_renderWindow.x2 - _renderWindow.x1, _renderWindow.y2 - _renderWindow.y1);
+        int nLevels = 1;
+        while (nLevels <= kTrackerPMPyramidMaxLevel &&
+               (patternSize >> nLevels) >= kTrackerPMPyramidMinPatternSize &&
+               (searchSize >> (nLevels - 1)) > kTrackerPMPyramidMinSearchSize) {
+            ++nLevels;
+        }
+        if (nLevels == 1) {
+            return;
+        }
+        const int scoreComps = std::min(nComponents, 3);
+        _patternPyramid.resize(nLevels);
+        _otherPyramid.resize(nLevels);
+
+        // level 0 of the pattern, with its weights
+        {
+            TrackerPMImage& pattern = _patternPyramid[0];
+            pattern.assign(_refRectPixel, scoreComps);
+            const size_t nPix = pattern.weight.size();
+            for (size_t i = 0; i < nPix; ++i) {
+                pattern.weight[i] = _weightData[i];
+                for (int c = 0; c < scoreComps; ++c) {
+                    pattern.data[i * scoreComps + c] = _patternData[c * nPix + i];
+                }
+            }
+        }
+        // level 0 of the search area: the pixels covered by the pattern at all positions in the search window
+        {
+            TrackerPMImage& other = _otherPyramid[0];
+            other.assign(_otherRect, scoreComps);
+            const size_t planeSize = other.weight.size();
+            for (size_t i = 0; i < planeSize; ++i) {
+                other.weight[i] = 1.f;
+                for (int c = 0; c < scoreComps; ++c) {
+                    other.data[i * scoreComps + c] = _otherData[c * planeSize + i];
+                }
+            }
+        }
+        for (int level = 1; level < nLevels; ++level) {
+            pyramidDown(_patternPyramid[level - 1], &_patternPyramid[level]);
+            pyramidDown(_otherPyramid[level - 1], &_otherPyramid[level]);
+        }
+
+        // weight total and weighted mean of the pattern at each level
+        _pyramidWeightTotal.assign(nLevels, 0.);
+        _pyramidRefMean.assign(3 * nLevels, 0.);
+        for (int level = 0; level < nLevels; ++level) {
+            const TrackerPMImage& pattern = _patternPyramid[level];
+            double *refMean = &_pyramidRefMean[3 * level];
+            double weightTotal = 0.;
+            for (size_t i = 0; i < pattern.weight.size(); ++i) {
+                weightTotal += pattern.weight[i];
+                for (int c = 0; c < scoreComps; ++c) {
+                    refMean[c] += pattern.weight[i] * pattern.data[i * scoreComps + c];
+                }
+            }
+            if (weightTotal > 0.) {
+                for (int c = 0; c < scoreComps; ++c) {
+                    refMean[c] /= weightTotal;
+                }
+            }
+            _pyramidWeightTotal[level] = weightTotal;
+        }
     }
 
     void multiThreadProcessImages(OfxRectI procWindow) {
@@ -338,75 +1216,172 @@ private:
     template<enum TrackerScoreEnum scoreTypeE>
     double computeScore(int x, int y, const double refMean[3])
     {
-        double score = 0;
-        double otherSsq = 0.;
-        double otherMean[3];
+        if (!_scoreSurface.empty()) {
+            // position (x,y) is the position of the first pixel of the pattern in _otherRect
+            const int nx = (_otherRect.x2 - _otherRect.x1) - (_refRectPixel.x2 - _refRectPixel.x1) + 1;
+            const int u = x + _refRectPixel.x1 - _otherRect.x1;
+            const int v = y + _refRectPixel.y1 - _otherRect.y1;
+            assert(0 <= u && u < nx && 0 <= v && (size_t)(v * nx + u) < _scoreSurface.size());
+            return _scoreSurface[(size_t)v * nx + u];
+        }
+        if ((scoreTypeE == eTrackerNCC || scoreTypeE == eTrackerZNCC) && !_otherSat.empty()) {
+            return computeIntegralScore<scoreTypeE>(x, y);
+        }
         const int scoreComps = std::min(nComponents, 3);
+        const int patternWidth = _refRectPixel.x2 - _refRectPixel.x1;
+        const int patternHeight = _refRectPixel.y2 - _refRectPixel.y1;
+        const size_t nPix = (size_t)patternWidth * patternHeight;
+        const int otherWidth = _otherRect.x2 - _otherRect.x1;
+        const size_t otherPlaneSize = (size_t)otherWidth * (_otherRect.y2 - _otherRect.y1);
+        assert(_otherRect.x1 <= x + _refRectPixel.x1 && x + _refRectPixel.x2 <= _otherRect.x2 &&
+               _otherRect.y1 <= y + _refRectPixel.y1 && y + _refRectPixel.y2 <= _otherRect.y2);
+        // the pixel of the other image under the first pixel of the pattern
+        const float *otherOrigin = _otherData + (size_t)(y + _refRectPixel.y1 - _otherRect.y1) * otherWidth + (x + _refRectPixel.x1 - _otherRect.x1);
+
+        double otherMean[3] = {0., 0., 0.};
         if (scoreTypeE == eTrackerZNCC) {
-            for (int c = 0; c < 3; ++c) {
-                otherMean[c] = 0;
-            }
-            // sliding pointers
-            long patternIdx = 0; // sliding index
-            const PIX *patternPtr = _patternData;
-            float *weightPtr = _weightData;
-            for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-                for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                    assert(patternIdx == ((i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1)));
-                   // take nearest pixel in other image (more chance to get a track than with black)
-                    int otherx = x + j;
-                    int othery = y + i;
-                    otherx = std::max(_otherImg->getBounds().x1,std::min(otherx,_otherImg->getBounds().x2-1));
-                    othery = std::max(_otherImg->getBounds().y1,std::min(othery,_otherImg->getBounds().y2-1));
-                    const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
-                    for (int c = 0; c < scoreComps; ++c) {
-                        otherMean[c] += *weightPtr * otherPix[c];
-                    }
-                }
-            }
             for (int c = 0; c < scoreComps; ++c) {
+                const float *otherPtr = otherOrigin + c * otherPlaneSize;
+                const float *weightPtr = _weightData;
+                for (int i = 0; i < patternHeight; ++i, otherPtr += otherWidth, weightPtr += patternWidth) {
+                    otherMean[c] += rowDot(weightPtr, otherPtr, patternWidth);
+                }
                 otherMean[c] /= _weightTotal;
             }
         }
 
-        // sliding pointers
-        long patternIdx = 0; // sliding index
-        const PIX *patternPtr = _patternData;
-        float *weightPtr = _weightData;
-
-        for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-            for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                assert(patternIdx == ((i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1)));
-                const PIX * const refPix = patternPtr;
+        double score = 0.;
+        double otherSsq = 0.;
+        for (int c = 0; c < scoreComps; ++c) {
+            const float *patternPtr = _patternData + c * nPix;
+            const float *otherPtr = otherOrigin + c * otherPlaneSize;
+            const float *weightPtr = _weightData;
+            for (int i = 0; i < patternHeight; ++i, patternPtr += patternWidth, otherPtr += otherWidth, weightPtr += patternWidth) {
+                rowScore<scoreTypeE>(weightPtr, patternPtr, otherPtr, patternWidth, refMean[c], otherMean[c], &score, &otherSsq);
+            }
+        }
+        if (scoreTypeE == eTrackerNCC || scoreTypeE == eTrackerZNCC) {
+            double sdev = std::sqrt(otherSsq);
+            if (sdev != 0.) {
+                score = -score / sdev;
+            } else {
+                score = std::numeric_limits<double>::infinity();
+            }
+        }
+        return score;
+    }
 
-                const float weight = *weightPtr;
+    /** @brief computeScore() for NCC and ZNCC with uniform weights: the sums over the other image are read from the
+        integral images, and only the cross-correlation with the pattern is summed over the pattern. */
+    template<enum TrackerScoreEnum scoreTypeE>
+    double computeIntegralScore(int x, int y)
+    {
+        const int scoreComps = std::min(nComponents, 3);
+        const int stride = 2 * scoreComps;
+        const int patternWidth = _refRectPixel.x2 - _refRectPixel.x1;
+        const int patternHeight = _refRectPixel.y2 - _refRectPixel.y1;
+        const size_t nPix = (size_t)patternWidth * patternHeight;
+        const int w = _otherRect.x2 - _otherRect.x1;
+        const size_t otherPlaneSize = (size_t)w * (_otherRect.y2 - _otherRect.y1);
+        const int x1 = x + _refRectPixel.x1 - _otherRect.x1;
+        const int x2 = x + _refRectPixel.x2 - _otherRect.x1;
+        const int y1 = y + _refRectPixel.y1 - _otherRect.y1;
+        const int y2 = y + _refRectPixel.y2 - _otherRect.y1;
+        assert(0 <= x1 && x2 <= w && 0 <= y1 && y2 <= _otherRect.y2 - _otherRect.y1);
+        const double *s11 = &_otherSat[((size_t)y1 * (w + 1) + x1) * stride];
+        const double *s12 = &_otherSat[((size_t)y1 * (w + 1) + x2) * stride];
+        const double *s21 = &_otherSat[((size_t)y2 * (w + 1) + x1) * stride];
+        const double *s22 = &_otherSat[((size_t)y2 * (w + 1) + x2) * stride];
+        const double n = (double)nPix;
+        const double weight = _weightData[0];
+
+        // sum of the squares (NCC) or variance (ZNCC) of the other image, from the integral images
+        double otherSsq = 0.;
+        double otherMean[3] = {0., 0., 0.};
+        for (int c = 0; c < scoreComps; ++c) {
+            const double sum = s22[c] - s21[c] - s12[c] + s11[c];
+            const double sumSq = s22[scoreComps + c] - s21[scoreComps + c] - s12[scoreComps + c] + s11[scoreComps + c];
+            if (scoreTypeE == eTrackerZNCC) {
+                otherMean[c] = sum / n;
+                otherSsq += sumSq - sum * otherMean[c];
+                otherMean[c] += _otherShift[c];
+            } else {
+                otherSsq += sumSq;
+            }
+        }
+        if (!(otherSsq > _otherSatTolerance)) {
+            return std::numeric_limits<double>::infinity();
+        }
 
-                // take nearest pixel in other image (more chance to get a track than with black)
-                int otherx = x + j;
-                int othery = y + i;
-                otherx = std::max(_otherImg->getBounds().x1,std::min(otherx,_otherImg->getBounds().x2-1));
-                othery = std::max(_otherImg->getBounds().y1,std::min(othery,_otherImg->getBounds().y2-1));
-                const PIX *otherPix = (const PIX *) _otherImg->getPixelAddress(otherx, othery);
+        // cross-correlation
+        double cross = 0.;
+        const float *otherOrigin = _otherData + (size_t)y1 * w + x1;
+        for (int c = 0; c < scoreComps; ++c) {
+            const double *devPtr = &_patternDev[c * nPix];
+            const float *otherPtr = otherOrigin + c * otherPlaneSize;
+            for (int i = 0; i < patternHeight; ++i, devPtr += patternWidth, otherPtr += w) {
+                cross += rowDot(devPtr, otherPtr, patternWidth);
+            }
+            if (scoreTypeE == eTrackerZNCC) {
+                cross -= otherMean[c] * _patternDevSum[c];
+            }
+        }
+        return -weight * cross / std::sqrt(weight * otherSsq);
+    }
 
-                ///the search window & pattern window have been intersected to the reference image's bounds
-                assert(refPix && otherPix);
-                for (int c = 0; c < scoreComps; ++c) {
+    /** @brief the same as computeScore(), at a level of the pyramid */
+    template<enum TrackerScoreEnum scoreTypeE>
+    double computeLevelScore(int level, int x, int y)
+    {
+        const TrackerPMImage& pattern = _patternPyramid[level];
+        const TrackerPMImage& other = _otherPyramid[level];
+        const int n = pattern.nComps;
+        const double weightTotal = _pyramidWeightTotal[level];
+        const double *refMean = &_pyramidRefMean[3 * level];
+        double score = 0;
+        double otherSsq = 0.;
+        double otherMean[3] = {0., 0., 0.};
+        if (weightTotal <= 0.) {
+            return std::numeric_limits<double>::infinity();
+        }
+        if (scoreTypeE == eTrackerZNCC) {
+            for (int i = pattern.bounds.y1; i < pattern.bounds.y2; ++i) {
+                for (int j = pattern.bounds.x1; j < pattern.bounds.x2; ++j) {
+                    const float weight = pattern.weight[pattern.index(j, i)];
+                    const float *otherPix = other.clampedPixel(x + j, y + i);
+                    for (int c = 0; c < n; ++c) {
+                        otherMean[c] += weight * otherPix[c];
+                    }
+                }
+            }
+            for (int c = 0; c < n; ++c) {
+                otherMean[c] /= weightTotal;
+            }
+        }
+        for (int i = pattern.bounds.y1; i < pattern.bounds.y2; ++i) {
+            for (int j = pattern.bounds.x1; j < pattern.bounds.x2; ++j) {
+                const size_t idx = pattern.index(j, i);
+                const float weight = pattern.weight[idx];
+                const float *refPix = &pattern.data[idx * n];
+                const float *otherPix = other.clampedPixel(x + j, y + i);
+                for (int c = 0; c < n; ++c) {
                     switch (scoreTypeE) {
-                        case eTrackerSSD:
-                            // reference is squared in SSD, so is the weight
-                            score += weight * weight * aggregateSD(refPix[c], otherPix[c]);
-                            break;
+                        case eTrackerSSD: {
+                            const double d = (double)refPix[c] - otherPix[c];
+                            score += weight * weight * d * d;
+                        }   break;
                         case eTrackerSAD:
-                            score += weight * aggregateAD(refPix[c], otherPix[c]);
+                            score += weight * std::abs((double)refPix[c] - otherPix[c]);
                             break;
                         case eTrackerNCC:
-                            score += weight * aggregateCC(refPix[c], otherPix[c]);
-                            otherSsq -= weight * aggregateCC(otherPix[c], otherPix[c]);
-                            break;
-                        case eTrackerZNCC:
-                            score += weight * aggregateNCC(refPix[c], refMean[c], otherPix[c], otherMean[c]);
-                            otherSsq -= weight * aggregateNCC(otherPix[c], otherMean[c], otherPix[c], otherMean[c]);
+                            score -= weight * (double)refPix[c] * otherPix[c];
+                            otherSsq += weight * (double)otherPix[c] * otherPix[c];
                             break;
+                        case eTrackerZNCC: {
+                            const double o = otherPix[c] - otherMean[c];
+                            score -= weight * (refPix[c] - refMean[c]) * o;
+                            otherSsq += weight * o * o;
+                        }   break;
                     }
                 }
             }
@@ -422,6 +1397,63 @@ private:
         return score;
     }
 
+    /** @brief Coarse-to-fine search: all the positions of the coarsest level whose full resolution rows are in
+        procWindow are tried, then the best one is refined in a small neighbourhood at each finer level.
+        The score of the full resolution is computed by computeScore(). */
+    template<enum TrackerScoreEnum scoreTypeE>
+    void pyramidSearch(const OfxRectI& procWindow, const double refMean[3], OfxPointI* point, double* bestScore)
+    {
+        const int top = (int)_patternPyramid.size() - 1;
+        OfxPointI best;
+        best.x = best.y = 0;
+        *bestScore = std::numeric_limits<double>::infinity();
+        {
+            // the positions (x,y) of the level are the positions (x,y)*2^level of the full resolution
+            const int s = 1 << top;
+            const int x1 = ceilDiv(_renderWindow.x1, s), x2 = ceilDiv(_renderWindow.x2, s);
+            const int y1 = ceilDiv(procWindow.y1, s), y2 = ceilDiv(procWindow.y2, s);
+            for (int y = y1; y < y2; ++y) {
+                if (_effect.abort()) {
+                    return;
+                }
+                for (int x = x1; x < x2; ++x) {
+                    double score = computeLevelScore<scoreTypeE>(top, x, y);
+                    if (score < *bestScore) {
+                        *bestScore = score;
+                        best.x = x;
+                        best.y = y;
+                    }
+                }
+            }
+        }
+        if (*bestScore == std::numeric_limits<double>::infinity()) {
+            return;
+        }
+        for (int level = top - 1; level >= 0; --level) {
+            const int s = 1 << level;
+            const int x1 = std::max(ceilDiv(_renderWindow.x1, s), 2 * best.x - kTrackerPMPyramidRefineRadius);
+            const int x2 = std::min(ceilDiv(_renderWindow.x2, s), 2 * best.x + kTrackerPMPyramidRefineRadius + 1);
+            const int y1 = std::max(ceilDiv(_renderWindow.y1, s), 2 * best.y - kTrackerPMPyramidRefineRadius);
+            const int y2 = std::min(ceilDiv(_renderWindow.y2, s), 2 * best.y + kTrackerPMPyramidRefineRadius + 1);
+            *bestScore = std::numeric_limits<double>::infinity();
+            OfxPointI levelBest = best;
+            levelBest.x *= 2;
+            levelBest.y *= 2;
+            for (int y = y1; y < y2; ++y) {
+                for (int x = x1; x < x2; ++x) {
+                    double score = (level == 0) ? computeScore<scoreTypeE>(x, y, refMean) : computeLevelScore<scoreTypeE>(level, x, y);
+                    if (score < *bestScore) {
+                        *bestScore = score;
+                        levelBest.x = x;
+                        levelBest.y = y;
+                    }
+                }
+            }
+            best = levelBest;
+        }
+        *point = best;
+    }
+
     template<enum TrackerScoreEnum scoreTypeE>
     void multiThreadProcessImagesForScore(const OfxRectI& procWindow)
     {
@@ -436,47 +1468,31 @@ private:
         ///that minimize the sum of squared differences between the pattern in the ref image
         ///and the pattern in the other image.
 
-        const int scoreComps = std::min(nComponents,3);
-        double refMean[3];
-        if (scoreTypeE == eTrackerZNCC) {
-            for (int c = 0; c < 3; ++c) {
-                refMean[c] = 0;
-            }
-        }
-        if (scoreTypeE == eTrackerZNCC) {
-            // sliding pointers
-            long patternIdx = 0; // sliding index
-            const PIX *patternPtr = _patternData;
-            float *weightPtr = _weightData;
-            for (int i = _refRectPixel.y1; i < _refRectPixel.y2; ++i) {
-                for (int j = _refRectPixel.x1; j < _refRectPixel.x2; ++j, ++weightPtr, patternPtr += nComponents, ++patternIdx) {
-                    assert(patternIdx == ((i - _refRectPixel.y1) * (_refRectPixel.x2 - _refRectPixel.x1) + (j - _refRectPixel.x1)));
-                    const PIX *refPix = patternPtr;
-                    for (int c = 0; c < scoreComps; ++c) {
-                        refMean[c] += *weightPtr * refPix[c];
-                    }
+        const double *refMean = _refMean;
+
+        if (!_patternPyramid.empty()) {
+            pyramidSearch<scoreTypeE>(procWindow, refMean, &point, &bestScore);
+        } else {
+            ///we're not interested in the alpha channel for RGBA images
+            for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+                if (_effect.abort()) {
+                    break;
                 }
-            }
-            for (int c = 0; c < scoreComps; ++c) {
-                refMean[c] /= _weightTotal;
-            }
-        }
 
-        ///we're not interested in the alpha channel for RGBA images
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if (_effect.abort()) {
-                break;
-            }
-            
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                double score = computeScore<scoreTypeE>(x, y, refMean);
-                if (score < bestScore) {
-                    bestScore = score;
-                    point.x = x;
-                    point.y = y;
+                for (int x = procWindow.x1; x < procWindow.x2; ++x) {
+                    double score = computeScore<scoreTypeE>(x, y, refMean);
+                    if (score < bestScore) {
+                        bestScore = score;
+                        point.x = x;
+                        point.y = y;
+                    }
                 }
             }
         }
+        if (bestScore == std::numeric_limits<double>::infinity()) {
+            // no possible match in the rows of this thread
+            return;
+        }
         
         // do the subpixel refinement, only if the score is a possible winner
         // TODO: only do this for the best match
@@ -524,27 +1540,6 @@ private:
 
         }
     }
-
-    double aggregateSD(PIX refPix, PIX otherPix)
-    {
-        double d = (double)refPix - otherPix;
-        return d * d;
-    }
-
-    double aggregateAD(PIX refPix, PIX otherPix)
-    {
-        return std::abs((double)refPix - otherPix);
-    }
-
-    double aggregateCC(PIX refPix, PIX otherPix)
-    {
-        return - (double)refPix * otherPix;
-    }
-
-    double aggregateNCC(PIX refPix, double refMean, PIX otherPix, double otherMean)
-    {
-        return - (refPix - refMean) * (otherPix - otherMean);
-    }
 };
 
 
@@ -569,6 +1564,9 @@ TrackerPMPlugin::trackRange(const OFX::TrackArguments& args)
         progressStart(name);
     }
 
+    // the image fetched at the other time of the previous step
+    TrackerPMFetchedImage fetched;
+
     while (args.forward ? (t <= args.last) : (t >= args.last)) {
         OfxTime other = args.forward ? (t + 1) : (t - 1);
         
@@ -577,12 +1575,12 @@ TrackerPMPlugin::trackRange(const OFX::TrackArguments& args)
                srcComponents == OFX::ePixelComponentAlpha);
         
         if (srcComponents == OFX::ePixelComponentRGBA) {
-            trackInternal<4>(t, other, args);
+            trackInternal<4>(t, other, args, &fetched);
         } else if (srcComponents == OFX::ePixelComponentRGB) {
-            trackInternal<3>(t, other, args);
+            trackInternal<3>(t, other, args, &fetched);
         } else {
             assert(srcComponents == OFX::ePixelComponentAlpha);
-            trackInternal<1>(t, other, args);
+            trackInternal<1>(t, other, args, &fetched);
         }
         if (args.forward) {
             ++t;
@@ -631,6 +1629,12 @@ getRefBounds(const OfxRectD& refRect, const OfxPointD &refCenter, OfxRectD *boun
     }
 }
 
+static bool
+rectContains(const OfxRectD& a, const OfxRectD& b)
+{
+    return a.x1 <= b.x1 && b.x2 <= a.x2 && a.y1 <= b.y1 && b.y2 <= a.y2;
+}
+
 static void
 getTrackSearchBounds(const OfxRectD& refRect, const OfxPointD &refCenter, const OfxRectD& searchRect, OfxRectD *bounds)
 {
@@ -769,22 +1773,29 @@ TrackerPMPlugin::trackInternalForDepth(OfxTime refTime,
     int scoreI;
     _score->getValueAtTime(refTime, scoreI);
     TrackerScoreEnum typeE = (TrackerScoreEnum)scoreI;
+    int searchI;
+    _search->getValueAtTime(refTime, searchI);
+    TrackerSearchEnum searchE = (TrackerSearchEnum)searchI;
 
     switch (typeE) {
         case eTrackerSSD: {
             TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerSSD> fred(*this);
+            fred.setSearchMethod(searchE);
             setupAndProcess(fred, refTime, refBounds, refCenter, refCenterWithOffset, refImg, maskImg, otherTime, trackSearchBounds, otherImg);
         }   break;
         case eTrackerSAD: {
             TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerSAD> fred(*this);
+            fred.setSearchMethod(searchE);
             setupAndProcess(fred, refTime, refBounds, refCenter, refCenterWithOffset, refImg, maskImg, otherTime, trackSearchBounds, otherImg);
         }   break;
         case eTrackerNCC: {
             TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerNCC> fred(*this);
+            fred.setSearchMethod(searchE);
             setupAndProcess(fred, refTime, refBounds, refCenter, refCenterWithOffset,  refImg, maskImg, otherTime, trackSearchBounds, otherImg);
         }   break;
         case eTrackerZNCC: {
             TrackerPMProcessor<PIX, nComponents, maxValue, eTrackerZNCC> fred(*this);
+            fred.setSearchMethod(searchE);
             setupAndProcess(fred, refTime, refBounds, refCenter, refCenterWithOffset, refImg, maskImg, otherTime, trackSearchBounds, otherImg);
         }   break;
     }
@@ -794,7 +1805,7 @@ TrackerPMPlugin::trackInternalForDepth(OfxTime refTime,
 // the internal render function
 template <int nComponents>
 void
-TrackerPMPlugin::trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::TrackArguments& args)
+TrackerPMPlugin::trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::TrackArguments& args, TrackerPMFetchedImage* fetched)
 {
     OfxRectD refRect;
     _innerBtmLeft->getValueAtTime(refTime, refRect.x1, refRect.y1);
@@ -818,8 +1829,13 @@ TrackerPMPlugin::trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::Tr
     OfxRectD otherBounds;
     getOtherBounds(refCenterWithOffset, searchRect, &otherBounds);
 
-    std::auto_ptr<const OFX::Image> srcRef((_srcClip && _srcClip->isConnected()) ?
-                                           _srcClip->fetchImage(refTime, refBounds) : 0);
+    std::auto_ptr<const OFX::Image> srcRef;
+    if (fetched->image.get() && fetched->time == refTime && rectContains(fetched->bounds, refBounds)) {
+        // the image fetched at the previous step contains the pattern window
+        srcRef = fetched->image;
+    } else if (_srcClip && _srcClip->isConnected()) {
+        srcRef.reset(_srcClip->fetchImage(refTime, refBounds));
+    }
     std::auto_ptr<const OFX::Image> srcOther((_srcClip && _srcClip->isConnected()) ?
                                              _srcClip->fetchImage(otherTime, otherBounds) : 0);
     if (!srcRef.get() || !srcOther.get()) {
@@ -876,6 +1892,11 @@ TrackerPMPlugin::trackInternal(OfxTime refTime, OfxTime otherTime, const OFX::Tr
         default:
             OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
     }
+
+    // keep the other image: it is the reference image of the next step
+    fetched->image = srcOther;
+    fetched->time = otherTime;
+    fetched->bounds = otherBounds;
 }
 
 
@@ -1070,6 +2091,21 @@ void TrackerPMPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+
+    // search
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamSearch);
+        param->setLabel(kParamSearchLabel);
+        param->setHint(kParamSearchHint);
+        assert(param->getNOptions() == eTrackerSearchExhaustive);
+        param->appendOption(kParamSearchOptionExhaustive, kParamSearchOptionExhaustiveHint);
+        assert(param->getNOptions() == eTrackerSearchPyramid);
+        param->appendOption(kParamSearchOptionPyramid, kParamSearchOptionPyramidHint);
+        param->setDefault((int)eTrackerSearchExhaustive);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 }
 
 